@@ -0,0 +1,291 @@
+/**
+Copyright 2022 orIgo <mrorigo@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bpred.h"
+
+#define TABLE_MASK ((1 << BPRED_TABLE_BITS) - 1)
+#define TAGE_MASK  ((1 << TAGE_BITS) - 1)
+#define TAGE_TAG_MASK ((1 << TAGE_TAG_BITS) - 1)
+#define TAGE_RESET_PERIOD (1 << 18) // updates between useful bit decays
+#define REPORT_SITES 16
+
+#define IS_LINK(r) ((r) == X1 || (r) == X5)
+
+static const uint32_t tage_history[TAGE_TABLES] = { 5, 11, 22, 44 };
+
+bpred_t *bpred_init(void)
+{
+  bpred_t *bp = malloc(sizeof(bpred_t));
+  if(!bp) {
+    return NULL;
+  }
+  memset(bp, 0, sizeof(bpred_t));
+  // weakly not taken
+  memset(bp->bimodal, 1, sizeof(bp->bimodal));
+  memset(bp->gshare, 1, sizeof(bp->gshare));
+  for(size_t t=0; t < TAGE_TABLES; t++) {
+    for(size_t i=0; i <= TAGE_MASK; i++) {
+      bp->tage[t][i].ctr = -1;
+    }
+  }
+  return bp;
+}
+
+static inline void counter2(uint8_t *c, const bool taken)
+{
+  if(taken && *c < 3) {
+    (*c)++;
+  } else if(!taken && *c > 0) {
+    (*c)--;
+  }
+}
+
+// Fold the last len outcomes of the global history into bits bits
+static inline uint32_t fold(const uint64_t history, const uint32_t len, const uint32_t bits)
+{
+  uint64_t h = len < 64 ? history & ((1ull << len) - 1) : history;
+  uint32_t f = 0;
+  while(h) {
+    f ^= h & ((1u << bits) - 1);
+    h >>= bits;
+  }
+  return f;
+}
+
+static inline uint32_t tage_index(const bpred_t *bp, const vaddr_t pc, const size_t t)
+{
+  return ((pc >> 1) ^ (pc >> (1 + TAGE_BITS)) ^ fold(bp->history, tage_history[t], TAGE_BITS)) & TAGE_MASK;
+}
+
+static inline uint16_t tage_tag(const bpred_t *bp, const vaddr_t pc, const size_t t)
+{
+  return ((pc >> 1) ^ fold(bp->history, tage_history[t], TAGE_TAG_BITS) ^
+	  (fold(bp->history, tage_history[t], TAGE_TAG_BITS - 1) << 1)) & TAGE_TAG_MASK;
+}
+
+// Predict and train TAGE-lite, returning the prediction
+static bool tage_update(bpred_t *bp, const vaddr_t pc, const bool taken)
+{
+  uint32_t index[TAGE_TABLES];
+  uint16_t tag[TAGE_TABLES];
+  int provider = -1, alt = -1;
+
+  for(int t = TAGE_TABLES - 1; t >= 0; t--) {
+    index[t] = tage_index(bp, pc, t);
+    tag[t] = tage_tag(bp, pc, t);
+    if(bp->tage[t][index[t]].tag == tag[t]) {
+      if(provider < 0) {
+	provider = t;
+      } else if(alt < 0) {
+	alt = t;
+      }
+    }
+  }
+
+  uint8_t *base = &bp->bimodal[(pc >> 1) & TABLE_MASK];
+  const bool base_pred = *base >= 2;
+  const bool alt_pred = alt >= 0 ? bp->tage[alt][index[alt]].ctr >= 0 : base_pred;
+  bool pred = base_pred;
+
+  if(provider >= 0) {
+    tage_entry_t *e = &bp->tage[provider][index[provider]];
+    pred = e->ctr >= 0;
+    if(pred != alt_pred) {
+      if(pred == taken && e->useful < 3) {
+	e->useful++;
+      } else if(pred != taken && e->useful > 0) {
+	e->useful--;
+      }
+    }
+    if(taken && e->ctr < 3) {
+      e->ctr++;
+    } else if(!taken && e->ctr > -4) {
+      e->ctr--;
+    }
+  }
+
+  // Allocate in a longer history table on a misprediction
+  if(pred != taken && provider < TAGE_TABLES - 1) {
+    bool allocated = false;
+    for(int t = provider + 1; t < TAGE_TABLES && !allocated; t++) {
+      tage_entry_t *e = &bp->tage[t][index[t]];
+      if(e->useful == 0) {
+	e->tag = tag[t];
+	e->ctr = taken ? 0 : -1;
+	allocated = true;
+      }
+    }
+    for(int t = provider + 1; t < TAGE_TABLES && !allocated; t++) {
+      tage_entry_t *e = &bp->tage[t][index[t]];
+      if(e->useful > 0) {
+	e->useful--;
+      }
+    }
+  }
+
+  if(++bp->tage_updates % TAGE_RESET_PERIOD == 0) {
+    for(size_t t=0; t < TAGE_TABLES; t++) {
+      for(size_t i=0; i <= TAGE_MASK; i++) {
+	bp->tage[t][i].useful >>= 1;
+      }
+    }
+  }
+  return pred;
+}
+
+static bpred_site_t *site(bpred_t *bp, const vaddr_t pc)
+{
+  uint32_t i = (pc >> 1) & (BPRED_SITES - 1);
+  for(size_t probe = 0; probe < BPRED_SITES; probe++) {
+    bpred_site_t *s = &bp->sites[i];
+    if(s->count == 0) {
+      s->pc = pc;
+      return s;
+    }
+    if(s->pc == pc) {
+      return s;
+    }
+    i = (i + 1) & (BPRED_SITES - 1);
+  }
+  return NULL;
+}
+
+// Conditional branch: all direction predictors
+static void bpred_branch(bpred_t *bp, const dinstr_t *d, const bool taken)
+{
+  const vaddr_t pc = d->pc;
+  bool pred[BP_KINDS];
+
+  pred[BP_STATIC] = d->imm < 0;
+  pred[BP_TAGE] = tage_update(bp, pc, taken); // before the shared bimodal trains
+
+  uint8_t *bim = &bp->bimodal[(pc >> 1) & TABLE_MASK];
+  pred[BP_BIMODAL] = *bim >= 2;
+  counter2(bim, taken);
+
+  uint8_t *gs = &bp->gshare[((pc >> 1) ^ bp->history) & TABLE_MASK];
+  pred[BP_GSHARE] = *gs >= 2;
+  counter2(gs, taken);
+
+  bp->history = (bp->history << 1) | taken;
+
+  bpred_site_t *s = site(bp, pc);
+  bp->branches++;
+  if(s) {
+    s->count++;
+    s->taken += taken;
+  } else {
+    bp->untracked++;
+  }
+  for(size_t k=0; k < BP_KINDS; k++) {
+    if(pred[k] != taken) {
+      bp->miss[k]++;
+      if(s) {
+	s->miss[k]++;
+      }
+    }
+  }
+}
+
+void bpred_update(bpred_t *bp, const dinstr_t *d, const vaddr_t next)
+{
+  const vaddr_t fallthrough = d->pc + d->len;
+  const bool taken = next != fallthrough;
+
+  if(d->optype == B) {
+    bpred_branch(bp, d, taken);
+  }
+  if(!taken) {
+    return;
+  }
+
+  // Returns come off the RAS, everything else taken goes through the BTB
+  if(d->op == OP_JALR && d->rd == 0 && IS_LINK(d->rs1)) {
+    bp->returns++;
+    if(bp->ras_top == 0 || bp->ras[--bp->ras_top % BPRED_RAS_SIZE] != next) {
+      bp->return_miss++;
+    }
+  } else {
+    bpred_btb_t *e = &bp->btb[(d->pc >> 1) % BPRED_BTB_SIZE];
+    bp->targets++;
+    if(e->pc != d->pc || e->target != next) {
+      bp->target_miss++;
+    }
+    e->pc = d->pc;
+    e->target = next;
+  }
+  if(d->optype != B && IS_LINK(d->rd)) {
+    bp->ras[bp->ras_top++ % BPRED_RAS_SIZE] = fallthrough;
+  }
+}
+
+static int site_cmp(const void *a, const void *b)
+{
+  const bpred_site_t *sa = *(const bpred_site_t **)a;
+  const bpred_site_t *sb = *(const bpred_site_t **)b;
+  return sa->count < sb->count ? 1 : sa->count > sb->count ? -1 : 0;
+}
+
+#define PERCENT(a, b) ((b) ? 100.0 * (a) / (b) : 0.0)
+
+void bpred_report(const bpred_t *bp, const uint8_t id)
+{
+  static const char *names[BP_KINDS] = { "static", "bimodal", "gshare", "tage" };
+
+  fprintf(stderr, "bpred::core %d: %lu conditional branches\n", id, (unsigned long)bp->branches);
+  for(size_t k=0; k < BP_KINDS; k++) {
+    fprintf(stderr, "bpred::core %d: %-8s %10lu mispredicted (%.2f%%)\n", id, names[k],
+	    (unsigned long)bp->miss[k], PERCENT(bp->miss[k], bp->branches));
+  }
+  fprintf(stderr, "bpred::core %d: btb      %10lu of %lu targets mispredicted (%.2f%%)\n", id,
+	  (unsigned long)bp->target_miss, (unsigned long)bp->targets, PERCENT(bp->target_miss, bp->targets));
+  fprintf(stderr, "bpred::core %d: ras      %10lu of %lu returns mispredicted (%.2f%%)\n", id,
+	  (unsigned long)bp->return_miss, (unsigned long)bp->returns, PERCENT(bp->return_miss, bp->returns));
+  if(bp->untracked) {
+    fprintf(stderr, "bpred::core %d: %lu branches not tracked per pc\n", id, (unsigned long)bp->untracked);
+  }
+
+  // Most executed branches
+  const bpred_site_t *sorted[BPRED_SITES];
+  size_t n = 0;
+  for(size_t i=0; i < BPRED_SITES; i++) {
+    if(bp->sites[i].count) {
+      sorted[n++] = &bp->sites[i];
+    }
+  }
+  qsort(sorted, n, sizeof(sorted[0]), site_cmp);
+
+  fprintf(stderr, "bpred::core %d: pc         count      taken%%", id);
+  for(size_t k=0; k < BP_KINDS; k++) {
+    fprintf(stderr, " %8s%%", names[k]);
+  }
+  fprintf(stderr, "\n");
+  for(size_t i=0; i < n && i < REPORT_SITES; i++) {
+    const bpred_site_t *s = sorted[i];
+    fprintf(stderr, "bpred::core %d: 0x%08x %-10lu %6.2f", id, s->pc, (unsigned long)s->count, PERCENT(s->taken, s->count));
+    for(size_t k=0; k < BP_KINDS; k++) {
+      fprintf(stderr, " %8.2f", PERCENT(s->miss[k], s->count));
+    }
+    fprintf(stderr, "\n");
+  }
+}
@@ -0,0 +1,88 @@
+/**
+Copyright 2022 orIgo <mrorigo@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef __BPRED_H__
+#define __BPRED_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include "cpu.h"
+
+// Branch predictor simulation. Every conditional branch outcome is fed to
+// all direction predictors side by side, every taken branch and jump to a
+// BTB with a return address stack in front of it for returns.
+typedef enum _bpred_kind_t {
+  BP_STATIC,   // backward taken, forward not taken
+  BP_BIMODAL,
+  BP_GSHARE,
+  BP_TAGE,     // TAGE-lite: bimodal base plus tagged tables
+  BP_KINDS
+} bpred_kind_t;
+
+#define TAGE_TABLES   4
+#define TAGE_BITS     10
+#define TAGE_TAG_BITS 9
+
+typedef struct _tage_entry_t {
+  uint16_t tag;
+  int8_t   ctr;     // 3 bit signed, taken when >= 0
+  uint8_t  useful;  // 2 bit
+} tage_entry_t;
+
+typedef struct _bpred_btb_t {
+  vaddr_t pc;
+  vaddr_t target;
+} bpred_btb_t;
+
+// Per branch pc statistics
+typedef struct _bpred_site_t {
+  vaddr_t  pc;
+  uint64_t count;
+  uint64_t taken;
+  uint64_t miss[BP_KINDS];
+} bpred_site_t;
+
+#define BPRED_SITES 4096
+
+typedef struct _bpred_t {
+  uint64_t      history;   // global, conditional branch outcomes
+  uint8_t       bimodal[1 << BPRED_TABLE_BITS];
+  uint8_t       gshare[1 << BPRED_TABLE_BITS];
+  tage_entry_t  tage[TAGE_TABLES][1 << TAGE_BITS];
+  uint64_t      tage_updates;
+  bpred_btb_t   btb[BPRED_BTB_SIZE];
+  vaddr_t       ras[BPRED_RAS_SIZE];
+  uint32_t      ras_top;
+
+  uint64_t      branches;
+  uint64_t      miss[BP_KINDS];
+  uint64_t      targets;   // taken branches and jumps, through the BTB
+  uint64_t      target_miss;
+  uint64_t      returns;   // through the RAS
+  uint64_t      return_miss;
+  uint64_t      untracked; // branches not in sites, table full
+  bpred_site_t  sites[BPRED_SITES];
+} bpred_t;
+
+bpred_t	*bpred_init(void);
+void	 bpred_update(bpred_t *, const dinstr_t *, const vaddr_t);
+void	 bpred_report(const bpred_t *, const uint8_t);
+
+#endif
@@ -24,6 +24,79 @@
 #include <pthread.h>
 #include "bus.h"
 
+// The device each thread, and so each hart, found last, and the range the
+// map has it as the sole device for
+static __thread struct {
+  const bus_t   *bus;
+  uint32_t       gen;
+  uint64_t       first;
+  uint64_t       size;
+  mmio_device_t *dev;
+} last_hit;
+
+// dev has any of [addr, addr+size)
+static bool overlaps(const mmio_device_t *dev, const uint64_t addr, const uint64_t size)
+{
+  return dev->base_address < addr + size && addr < (uint64_t)dev->base_address + dev->size;
+}
+
+// dev answers at offs
+static inline bool answers(mmio_device_t *dev, const size_t offs)
+{
+  return dev->base_address <= offs &&
+    offs - dev->base_address < dev->size && // RAM may reach the top of the address space
+    (dev->contains == NULL || dev->contains(dev, offs));
+}
+
+static mmio_device_t *first_overlapping(bus_t *bus, const uint64_t addr, const uint64_t size)
+{
+  mmio_device_t *dev = bus->mmio_devices;
+  while(dev != NULL && !overlaps(dev, addr, size)) {
+    dev = dev->next;
+  }
+  return dev;
+}
+
+// The first device on the list that overlaps [addr, addr+size), and
+// whether no other one does
+static bus_slot_t slot_for(bus_t *bus, const uint64_t addr, const uint64_t size)
+{
+  bus_slot_t slot = { first_overlapping(bus, addr, size), true };
+  for(const mmio_device_t *dev = slot.device ? slot.device->next : NULL; dev != NULL; dev = dev->next) {
+    slot.sole &= !overlaps(dev, addr, size);
+  }
+  return slot;
+}
+
+// Rebuild the map from the device list. Regions no device starts or ends
+// in have the same device all over, only the others get a page table.
+static void bus_map(bus_t *bus)
+{
+  for(size_t r=0; r < BUS_REGIONS; r++) {
+    bus_region_t *region = &bus->map[r];
+    const uint64_t first = (uint64_t)r << BUS_REGION_SHIFT;
+    const uint64_t end = first + ((uint64_t)1 << BUS_REGION_SHIFT);
+    free(region->pages);
+    region->pages = NULL;
+    region->all = slot_for(bus, first, end - first);
+
+    bool split = false;
+    for(const mmio_device_t *dev = bus->mmio_devices; dev != NULL; dev = dev->next) {
+      const uint64_t dev_end = (uint64_t)dev->base_address + dev->size;
+      split |= (dev->base_address > first && dev->base_address < end) || (dev_end > first && dev_end < end);
+    }
+    if(!split) {
+      continue;
+    }
+    region->pages = malloc(sizeof(bus_slot_t) * BUS_REGION_PAGES);
+    assert(region->pages);
+    for(size_t pg=0; pg < BUS_REGION_PAGES; pg++) {
+      region->pages[pg] = slot_for(bus, first + (pg << BUS_PAGE_SHIFT), 1 << BUS_PAGE_SHIFT);
+    }
+  }
+  bus->map_gen++;
+}
+
 void bus_init(bus_t *bus)
 {
   mmio_device_t *dev = bus->mmio_devices;
@@ -33,6 +106,22 @@ void bus_init(bus_t *bus)
   }
 
   pthread_mutex_init(&bus->mutex, NULL);
+  bus_map(bus);
+}
+
+// Attach a device after bus_init, behind those already there
+void bus_add_device(bus_t *bus, mmio_device_t *dev)
+{
+  pthread_mutex_lock(&bus->mutex);
+  mmio_device_t **link = &bus->mmio_devices;
+  while(*link != NULL) {
+    link = &(*link)->next;
+  }
+  dev->next = NULL;
+  *link = dev;
+  dev->init(dev);
+  bus_map(bus);
+  pthread_mutex_unlock(&bus->mutex);
 }
 
 static void bus_lock_read(bus_t *bus)
@@ -55,19 +144,41 @@ static void bus_unlock_write(bus_t *bus)
   pthread_mutex_unlock(&bus->mutex);
 }
 
+// The device at offs, through the last one this thread found and then the
+// map. Only a sole device is taken from either without asking the list;
+// otherwise, as RAM without memory or a device sharing the page with
+// another, the first device on the list that answers wins.
 static mmio_device_t *bus_find_device(bus_t *bus, const size_t offs)
 {
-  mmio_device_t *dev = bus->mmio_devices;
   bus->status = BUS_OK;
-  while(dev != NULL) {
-    if((dev->base_address <= offs) &&
-       (dev->base_address + (dev->size)) > offs) {
+  if(last_hit.bus == bus && last_hit.gen == bus->map_gen &&
+     offs - last_hit.first < last_hit.size && answers(last_hit.dev, offs)) {
+    return last_hit.dev;
+  }
+  mmio_device_t *dev = NULL;
+  if(((uint64_t)offs >> 32) == 0) {
+    const bus_region_t *region = &bus->map[offs >> BUS_REGION_SHIFT];
+    const uint32_t shift = region->pages == NULL ? BUS_REGION_SHIFT : BUS_PAGE_SHIFT;
+    const bus_slot_t *slot = region->pages == NULL ? &region->all :
+      &region->pages[(offs >> BUS_PAGE_SHIFT) & (BUS_REGION_PAGES - 1)];
+    dev = slot->device;
+    if(slot->sole && dev != NULL && answers(dev, offs)) {
+      last_hit.bus = bus;
+      last_hit.gen = bus->map_gen;
+      last_hit.first = offs & ~(((uint64_t)1 << shift) - 1);
+      last_hit.size = (uint64_t)1 << shift;
+      last_hit.dev = dev;
       return dev;
     }
-    dev = dev->next;
   }
-  bus->status = BUS_ADDRESS_NOT_FOUND;
-  return NULL;
+  if(dev == NULL || !answers(dev, offs)) {
+    for(dev = bus->mmio_devices; dev != NULL && !answers(dev, offs); dev = dev->next) {
+    }
+  }
+  if(dev == NULL) {
+    bus->status = BUS_ADDRESS_NOT_FOUND;
+  }
+  return dev;
 }
 
 void bus_begin_write(bus_t *bus)
@@ -128,7 +239,7 @@ size_t bus_read_multiple(bus_t *bus, const size_t offs, void *dst, size_t count,
     return 0;
   }
   bus->status = BUS_OK;
-  if(dev->read(dev, offs, dst, count, aw) != count) {
+  if(dev->read == NULL || dev->read(dev, offs, dst, count, aw) != count) {
     #ifdef BUS_TRACE
     fprintf(stderr, "bus:read_multiple:dev_read failed: %d\n", dev->state);
     #endif
@@ -169,13 +280,14 @@ size_t bus_write_multiple(bus_t *bus, const size_t offs, void *src, size_t count
     bus->status = BUS_ACCESS_DENIED;
     // TODO: Raise trap
     assert((dev->perm & WRITE) == WRITE);
+    bus_end_write(bus);
     return 0;
   }
 
-  assert(dev->state == READY);
-  if(dev->write(dev, offs, src, count, aw) != count) {
+  if(dev->write == NULL || dev->write(dev, offs, src, count, aw) != count) {
     //bus->status = dev->state;
     bus->status = BUS_DEVICE_FAILURE;
+    bus_end_write(bus);
     return 0;
   }
   bus->status = BUS_OK;
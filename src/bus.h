@@ -34,13 +34,37 @@ typedef enum _bus_status_t {
   BUS_DEVICE_FAILURE    = 6
 } bus_status_t;
 
+// The 32 bit address space is mapped to devices in regions of 4 MiB. A
+// region all of whose pages go to the same device holds just that one,
+// others have a table by page. A page holds the first device on the list
+// that overlaps it, which still has to answer for the address itself.
+#define BUS_PAGE_SHIFT   12
+#define BUS_REGION_SHIFT 22
+#define BUS_REGIONS      (1 << (32 - BUS_REGION_SHIFT))
+#define BUS_REGION_PAGES (1 << (BUS_REGION_SHIFT - BUS_PAGE_SHIFT))
+
+// The device for a region or page, sole when no other device overlaps it
+// there, so that the device answering settles it
+typedef struct _bus_slot_t {
+  mmio_device_t *device;
+  bool           sole;
+} bus_slot_t;
+
+typedef struct _bus_region_t {
+  bus_slot_t  all;
+  bus_slot_t *pages; // BUS_REGION_PAGES slots, NULL when all has the whole region
+} bus_region_t;
+
 typedef struct _bus_t {
   mmio_device_t *mmio_devices;
   pthread_mutex_t mutex;
   bus_status_t status;
+  bus_region_t map[BUS_REGIONS];
+  uint32_t     map_gen; // bumped when the map is rebuilt
 } bus_t;
 
 void     bus_init(bus_t *);
+void     bus_add_device(bus_t *, mmio_device_t *);
 uint32_t bus_read_single(bus_t *, const size_t,  const memory_access_width_t);
 void     bus_write_single(bus_t *, const size_t, const uint32_t, const memory_access_width_t);
 
@@ -8,11 +8,38 @@
 //#define SYSCALL_TRACE 1
 
 #define PREFETCH_SIZE 8
+#define DECODE_CACHE_SIZE 4096 // decoded instructions per core, power of 2
+#define BLOCK_CACHE_SIZE 1024  // basic blocks per core, power of 2
+#define BLOCK_MAX_INSTRS 32
 #define NUMCORES 1
 
+#define CPU_ENGINE ENGINE_BLOCK // ENGINE_FAST, or ENGINE_STAGED for pipeline stage visibility
+#define CPU_RUN_BUDGET 10000  // instructions per core_run() call
+#define CPU_THREADED_DISPATCH 1 // call per-instruction handlers, undef for switch dispatch
+#if defined(__x86_64__)
+#define CPU_JIT 1 // translate hot blocks to native code, ENGINE_BLOCK only
+#endif
+#define JIT_THRESHOLD 50 // block executions before translation
+#define JIT_CODE_SIZE (16<<20) // native code buffer per core, flushed when full
+//#define CPU_TIMING 1 // in-order pipeline timing model, runs ENGINE_BLOCK as ENGINE_FAST
+#define TIMING_FORWARDING 1 // bypass ALU/load results, undef to stall until writeback
+#define TIMING_MEM_LATENCY 0 // extra MEM cycles per load/store
+#define TIMING_BRANCH_PENALTY 2 // taken branches and JALR resolve in EX
+#define TIMING_JUMP_PENALTY 1 // JAL resolves in ID
+//#define CPU_BPRED 1 // branch predictor simulation, runs ENGINE_BLOCK as ENGINE_FAST
+#define BPRED_TABLE_BITS 12 // bimodal/gshare counters, gshare history length
+#define BPRED_BTB_SIZE 512
+#define BPRED_RAS_SIZE 16
+#define TLB_ENTRIES 64 // Sv32 translations cached per core, power of 2
+#define VECTOR_VLEN 256 // V register bits, a multiple of the host SIMD width
+
 #define RAM_START	(0x10000)
 #define RAM_END		(0x7ffff)
-#define RAM_SIZE	(RAM_END-RAM_START)
+#define RAM_SIZE	(RAM_END-RAM_START) // default, CRISCV_RAM_SIZE in the environment overrides
+//#define RAM_HUGEPAGES 1 // back guest RAM with transparent huge pages
+#if defined(__x86_64__) && defined(__linux__)
+//#define MMU_GUARD 1 // guest RAM in a 4 GiB host range with page protections, faults catch bad accesses
+#endif
 
 #define VIDEO_WIDTH		640
 #define VIDEO_HEIGHT		480
@@ -28,16 +28,145 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include "cpu.h"
 #include "memory.h"
+#include "jit.h"
+#include "timing.h"
+#include "bpred.h"
+#include "fpu.h"
+#include "rvc.h"
+#include "sv32.h"
+#include "guard.h"
 
-RV32I_cpu_t *cpu_init(bus_t *bus)
+// Analysis modes that look at every retired instruction. They run on
+// single instructions, so the block engine and its fused pairs are left
+// out of the build.
+#if defined(CPU_TIMING) || defined(CPU_BPRED)
+#define CPU_RETIRE_HOOKS 1
+#endif
+
+RV32I_cpu_t *cpu_init(bus_t *bus, mmu_t *mmu)
 {
   RV32I_cpu_t *cpu = malloc(sizeof(RV32I_cpu_t));
   memset(cpu, 0, sizeof(RV32I_cpu_t));
   cpu->bus = bus;
+  cpu->mmu = mmu;
 
   return cpu;
 }
 
+// One bit per CODE_CHUNK_SHIFT sized chunk of the address space. Allocated
+// with calloc, so only the parts actually holding code take up memory.
+#define CODE_CHUNKS_SIZE ((1ull << (32 - CODE_CHUNK_SHIFT)) / 8)
+#define CODE_CHUNK_SET(core, chunk)  ((core)->code_chunks[(chunk) >> 3] |= 1 << ((chunk) & 7))
+#define CODE_CHUNK_TEST(core, chunk) (((core)->code_chunks[(chunk) >> 3] >> ((chunk) & 7)) & 1)
+
+// Drop all decoded instructions and blocks, once pcs may map to other code.
+// The instruction asking for it is running from the cache, and other
+// threads may ask too, so the caches are only marked stale here and
+// dropped by core_sync_code in between instructions.
+static inline void core_flush_code(core_t *core)
+{
+  __atomic_fetch_or(&core->code_stale, CODE_STALE_ALL, __ATOMIC_RELEASE);
+}
+
+// Drop decoded instructions and blocks overlapping a write to code
+static void core_drop_code(core_t *core, const vaddr_t vaddr, const size_t size)
+{
+  // A 32 bit instruction may start one parcel in front of the write
+  const vaddr_t from = (vaddr & ~1) - (vaddr >= sizeof(uint16_t) ? sizeof(uint16_t) : 0);
+  if(size >= DECODE_CACHE_SIZE * sizeof(uint16_t)) {
+    for(size_t i=0; i < DECODE_CACHE_SIZE; i++) {
+      core->dcache[i].pc = DCACHE_EMPTY;
+    }
+  } else {
+    for(vaddr_t pc = from; pc < vaddr + size; pc += sizeof(uint16_t)) {
+      dinstr_t *d = &core->dcache[DCACHE_INDEX(pc)];
+      if(d->pc == pc) {
+	d->pc = DCACHE_EMPTY;
+      }
+    }
+  }
+
+  // Only scan the block cache if a chunk with blocks in it was written to
+  bool hit = false;
+  for(size_t chunk = vaddr >> CODE_CHUNK_SHIFT; chunk <= (vaddr + size - 1) >> CODE_CHUNK_SHIFT; chunk++) {
+    hit |= CODE_CHUNK_TEST(core, chunk);
+  }
+  if(!hit) {
+    return;
+  }
+  // Blocks overlapping the write can only start this far in front of it
+  const vaddr_t span = BLOCK_MAX_INSTRS*sizeof(uint32_t) - sizeof(uint16_t);
+  const vaddr_t first = vaddr > span ? (vaddr & ~1) - span : 0;
+  if((vaddr + size - first) / sizeof(uint16_t) < BLOCK_CACHE_SIZE) {
+    for(vaddr_t pc = first; pc < vaddr + size; pc += sizeof(uint16_t)) {
+      dblock_t *b = &core->blocks[BLOCK_INDEX(pc)];
+      if(b->pc == pc && b->end > vaddr) {
+	b->pc = DCACHE_EMPTY;
+      }
+    }
+    return;
+  }
+  for(size_t i=0; i < BLOCK_CACHE_SIZE; i++) {
+    dblock_t *b = &core->blocks[i];
+    if(b->pc != DCACHE_EMPTY && b->pc < vaddr + size && b->end > vaddr) {
+      b->pc = DCACHE_EMPTY;
+    }
+  }
+}
+
+// Drop what core_flush_code and core_invalidate_code asked for. The
+// caches hold virtual pcs, so with fetch translated by Sv32 the physical
+// address written to says nothing and everything goes.
+static void __attribute__((noinline)) core_drop_stale(core_t *core)
+{
+  code_write_t writes[CODE_WRITES];
+  pthread_mutex_lock(&core->code_lock);
+  const uint32_t stale = __atomic_exchange_n(&core->code_stale, 0, __ATOMIC_ACQUIRE);
+  const size_t cnt = core->code_write_cnt;
+  memcpy(writes, core->code_writes, cnt * sizeof(code_write_t));
+  core->code_write_cnt = 0;
+  pthread_mutex_unlock(&core->code_lock);
+
+  if((stale & CODE_STALE_ALL) != 0 || core->tlb->fetch) {
+    for(size_t i=0; i < DECODE_CACHE_SIZE; i++) {
+      core->dcache[i].pc = DCACHE_EMPTY;
+    }
+    for(size_t i=0; i < BLOCK_CACHE_SIZE; i++) {
+      core->blocks[i].pc = DCACHE_EMPTY;
+    }
+    core->prefetch_cnt = 0;
+    return;
+  }
+  for(size_t i=0; i < cnt; i++) {
+    core_drop_code(core, writes[i].vaddr, writes[i].size);
+  }
+}
+
+static inline void core_sync_code(core_t *core)
+{
+  if(__builtin_expect(__atomic_load_n(&core->code_stale, __ATOMIC_ACQUIRE) == 0, 1)) {
+    return;
+  }
+  core_drop_stale(core);
+}
+
+// Called by the mmu on the thread of whoever wrote to executable memory,
+// which need not be the core's own, so the write is only queued
+static void core_invalidate_code(void *user, const vaddr_t vaddr, const size_t size)
+{
+  core_t *core = (core_t *)user;
+  pthread_mutex_lock(&core->code_lock);
+  if(core->code_write_cnt < CODE_WRITES) {
+    core->code_writes[core->code_write_cnt].vaddr = vaddr;
+    core->code_writes[core->code_write_cnt].size = size;
+    core->code_write_cnt++;
+    __atomic_fetch_or(&core->code_stale, CODE_STALE_WRITES, __ATOMIC_RELEASE);
+  } else {
+    __atomic_fetch_or(&core->code_stale, CODE_STALE_ALL, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&core->code_lock);
+}
+
 core_t *core_init(RV32I_cpu_t *cpu, uint32_t core_num, uint32_t initial_pc)
 {
   assert(core_num < NUMCORES);
@@ -48,17 +177,124 @@ core_t *core_init(RV32I_cpu_t *cpu, uint32_t core_num, uint32_t initial_pc)
   core->id	     = core_num;
   core->pc	     = initial_pc;
   core->bus	     = cpu->bus;
+  core->mmu	     = cpu->mmu;
+  core->reserved_addr = RESERVATION_NONE;
   core->cycle	     = 0;
+  core->instret	     = 0;
+  core->engine	     = CPU_ENGINE;
   core->state	     = FETCH;
   core->priv_mode    = PMODE_MACHINE;
   core->prefetch_cnt = 0;
+  core->fetch_host   = NULL;
   core->halted	     = false;
+  core->code_stale   = 0;
+  core->code_write_cnt = 0;
+  pthread_mutex_init(&core->code_lock, NULL);
+  core->tlb	     = sv32_init();
+  assert(core->tlb);
   for(size_t i=0; i < NUMREGS; i++) {
     core->registers[i] = 0;
+    core->fregisters[i] = 0;
+  }
+  memset(core->vregisters, 0, sizeof(core->vregisters));
+  csr_init(&core->csr);
+  core->csr.state[mhartid] = core_num;
+  core->csr.state[vlenb] = VLENB;
+  core->csr.state[vtype] = VTYPE_VILL;
+  sv32_update(core);
+
+  core->dcache = malloc(sizeof(dinstr_t) * DECODE_CACHE_SIZE);
+  assert(core->dcache);
+  for(size_t i=0; i < DECODE_CACHE_SIZE; i++) {
+    core->dcache[i].pc = DCACHE_EMPTY;
+  }
+
+  core->blocks = malloc(sizeof(dblock_t) * BLOCK_CACHE_SIZE);
+  assert(core->blocks);
+  for(size_t i=0; i < BLOCK_CACHE_SIZE; i++) {
+    core->blocks[i].pc = DCACHE_EMPTY;
+  }
+  core->code_chunks = calloc(CODE_CHUNKS_SIZE, 1);
+  assert(core->code_chunks);
+  core->jit = core->engine == ENGINE_BLOCK ? jit_init() : NULL;
+#ifdef CPU_TIMING
+  core->timing = timing_init();
+  assert(core->timing);
+#else
+  core->timing = NULL;
+#endif
+#ifdef CPU_BPRED
+  core->bpred = bpred_init();
+  assert(core->bpred);
+#else
+  core->bpred = NULL;
+#endif
+
+  if(cpu->mmu) {
+    // A core that missed writes to code would run stale instructions
+    const bool watched = mmu_watch_code(cpu->mmu, core_invalidate_code, core);
+    assert(watched);
+    (void)watched;
   }
   return core;
 }
 
+void core_snapshot(const core_t *core, core_snapshot_t *snap)
+{
+  snap->state = core->state;
+  snap->instruction = core->instruction;
+  snap->decoded = core->decoded;
+  snap->pc = core->pc;
+  snap->aluOut = core->aluOut;
+  memcpy(snap->registers, core->registers, sizeof(snap->registers));
+  memcpy(snap->fregisters, core->fregisters, sizeof(snap->fregisters));
+  memcpy(snap->vregisters, core->vregisters, sizeof(snap->vregisters));
+  snap->cycle = core->cycle;
+  snap->instret = core->instret;
+  snap->csr = core->csr;
+  snap->trap_pc = core->trap_pc;
+  memcpy(snap->trap_regs, core->trap_regs, sizeof(snap->trap_regs));
+  snap->trap_len = core->trap_len;
+  snap->priv_mode = core->priv_mode;
+  snap->trap_state = core->trap_state;
+  snap->halted = core->halted;
+}
+
+// Go back to a snapshot, after the memory it was taken with was restored.
+// Decoded code stays unless the mapping of pcs may differ, writes to code
+// were invalidated as memory was put back.
+void core_restore(core_t *core, const core_snapshot_t *snap)
+{
+  if(core->priv_mode != snap->priv_mode || core->csr.state[satp] != snap->csr.state[satp]) {
+    core_flush_code(core);
+  }
+  core->state = snap->state;
+  core->instruction = snap->instruction;
+  core->decoded = snap->decoded;
+  core->pc = snap->pc;
+  core->aluOut = snap->aluOut;
+  memcpy(core->registers, snap->registers, sizeof(snap->registers));
+  memcpy(core->fregisters, snap->fregisters, sizeof(snap->fregisters));
+  memcpy(core->vregisters, snap->vregisters, sizeof(snap->vregisters));
+  core->cycle = snap->cycle;
+  core->instret = snap->instret;
+  core->csr = snap->csr;
+  core->trap_pc = snap->trap_pc;
+  memcpy(core->trap_regs, snap->trap_regs, sizeof(snap->trap_regs));
+  core->trap_len = snap->trap_len;
+  core->priv_mode = snap->priv_mode;
+  core->trap_state = snap->trap_state;
+  core->halted = snap->halted;
+
+  core->reserved_addr = RESERVATION_NONE;
+  core->prefetch_cnt = 0;
+  core->fetch_host = NULL;
+  sv32_update(core);
+  // Nothing of the run before on the host FPU: its flags go, the restored
+  // frm applies. cpu_thread does the same for a thread it starts the core on.
+  fpu_host_enter(&core->csr);
+}
+
 void core_dumpregs(core_t *core)
 {
   fprintf(stderr, "pc=0x%08x  priv_mode=%d\n", core->pc, core->priv_mode);
@@ -76,18 +312,140 @@ void cause_trap(core_t *core, trap_cause_t cause) {
   (void)csr_read_write32(&core->csr, mcause, cause);
 }
 
+// Host memory at pc holding up to a 32 bit instruction, or NULL to go
+// through the bus. The executable run of a page is looked up once and used
+// until pc leaves it or the mmu changes permissions.
+static inline const uint8_t *fetch_host(core_t *core, const vaddr_t pc)
+{
+  if(core->mmu == NULL) {
+    return NULL;
+  }
+  if(core->fetch_host == NULL || core->fetch_gen != core->mmu->perm_gen ||
+     pc - core->fetch_start + sizeof(uint32_t) > core->fetch_len) {
+    vaddr_t start = 0;
+    size_t len = 0;
+    core->fetch_gen = core->mmu->perm_gen;
+    core->fetch_host = mmu_exec_span(core->mmu, pc, &start, &len);
+    core->fetch_start = start;
+    core->fetch_len = len;
+    if(core->fetch_host == NULL || pc - core->fetch_start + sizeof(uint32_t) > core->fetch_len) {
+      return NULL;
+    }
+  }
+  return core->fetch_host + (pc - core->fetch_start);
+}
+
+static inline uint32_t host_instruction(const uint8_t *p)
+{
+  uint16_t parcels[2];
+  memcpy(parcels, p, sizeof(parcels));
+  return RVC_COMPRESSED(parcels[0]) ? parcels[0] : parcels[0] | (uint32_t)parcels[1] << 16;
+}
+
+// Read the instruction at pc a parcel at a time, so that a compressed
+// instruction at the very end of memory can be read. With fetch translated
+// only the TLB is used, see fetch_translate.
+static bool read_instruction(core_t *core, const vaddr_t pc, uint32_t *out)
+{
+  vaddr_t pa = pc;
+  if(core->tlb->fetch && !sv32_cached(core->tlb, pc, TLB_FETCH, &pa)) {
+    return false;
+  }
+  const uint8_t *host = fetch_host(core, pa);
+  if(host != NULL) {
+    *out = host_instruction(host);
+    return true;
+  }
+  *out = bus_read_single(core->bus, pa, HALFWORD) & 0xffff;
+  if(core->bus->status != BUS_OK) {
+    return false;
+  }
+  if(!RVC_COMPRESSED(*out)) {
+    pa += sizeof(uint16_t);
+    if(core->tlb->fetch && !sv32_cached(core->tlb, pc + sizeof(uint16_t), TLB_FETCH, &pa)) {
+      return false;
+    }
+    *out |= bus_read_single(core->bus, pa, HALFWORD) << 16;
+    return core->bus->status == BUS_OK;
+  }
+  return true;
+}
+
+// Get the pages of the instruction at pc into the TLB, trapping on a page
+// fault. A 32 bit instruction at the end of a page continues on the next.
+static bool fetch_translate(core_t *core, const vaddr_t pc)
+{
+  vaddr_t pa;
+  if(!sv32_translate(core, pc, TLB_FETCH, &pa)) {
+    return false;
+  }
+  if((pc & (SV32_PAGE_SIZE - 1)) == SV32_PAGE_SIZE - sizeof(uint16_t)) {
+    const uint32_t parcel = bus_read_single(core->bus, pa, HALFWORD);
+    if(core->bus->status == BUS_OK && !RVC_COMPRESSED(parcel)) {
+      return sv32_translate(core, pc + sizeof(uint16_t), TLB_FETCH, &pa);
+    }
+  }
+  return true;
+}
+
+// Fetch reads executable pages straight from host memory. Anywhere else it
+// works on 16 bit parcels from the prefetch buffer, so compressed and 32
+// bit instructions can be mixed. The buffer is refilled at pc when pc has
+// left it, or when a 32 bit instruction straddles its end.
 void fetch(core_t *core)
 {
-  if(core->prefetch_cnt == 0) {
-    if(bus_read_multiple(core->bus, core->pc, &core->instruction, PREFETCH_SIZE, WORD) != PREFETCH_SIZE) {
-      cause_trap(core, core->bus->status == BUS_READ_MISALIGNED ? INSTRUCTION_ADDR_MISALIGN : INSTRUCTION_ACCESS_FAULT);
-      assert(false);
+  core_sync_code(core);
+
+  // The prefetch buffer is filled by pc, translated fetch goes without it
+  if(core->tlb->fetch) {
+    uint32_t instruction;
+    if(core->pc & 1) {
+      cause_trap(core, INSTRUCTION_ADDR_MISALIGN);
+    } else if(fetch_translate(core, core->pc)) {
+      if(read_instruction(core, core->pc, &instruction)) {
+        core->instruction = instruction;
+      } else {
+        cause_trap(core, INSTRUCTION_ACCESS_FAULT);
+      }
+    }
+    return;
+  }
+
+  const uint8_t *host = (core->pc & 1) == 0 ? fetch_host(core, core->pc) : NULL;
+  if(host != NULL) {
+    core->instruction = host_instruction(host);
+#ifdef CPU_TRACE
+    fprintf(stderr, "\ncpu::fetch pc=0x%08x, host instr=0x%08x\n", core->pc, core->instruction);
+#endif
+    return;
+  }
+
+  uint32_t off = (core->pc - core->prefetch_pc) / sizeof(uint16_t);
+  if(off >= core->prefetch_cnt ||
+     (!RVC_COMPRESSED(core->prefetch[off]) && off + 1 >= core->prefetch_cnt)) {
+    if(core->pc & 1) {
+      cause_trap(core, INSTRUCTION_ADDR_MISALIGN);
       return;
     }
-    core->prefetch_cnt = PREFETCH_SIZE-1;
-  } else {
-    core->instruction = core->prefetch[PREFETCH_SIZE-1-core->prefetch_cnt];
-    core->prefetch_cnt--;
+    // Near the end of memory only a short read may succeed
+    static const uint8_t counts[] = { PREFETCH_SIZE*2, 2, 1 };
+    core->prefetch_pc = core->pc;
+    core->prefetch_cnt = 0;
+    for(size_t i=0; i < sizeof(counts) && core->prefetch_cnt == 0; i++) {
+      if(bus_read_multiple(core->bus, core->pc, core->prefetch, counts[i], HALFWORD) == counts[i]) {
+	core->prefetch_cnt = counts[i];
+      }
+    }
+    off = 0;
+    if(core->prefetch_cnt == 0 ||
+       (!RVC_COMPRESSED(core->prefetch[0]) && core->prefetch_cnt < 2)) {
+      cause_trap(core, INSTRUCTION_ACCESS_FAULT);
+      return;
+    }
+  }
+  core->instruction = core->prefetch[off];
+  if(!RVC_COMPRESSED(core->instruction)) {
+    core->instruction |= (uint32_t)core->prefetch[off + 1] << 16;
   }
 #ifdef CPU_TRACE
   fprintf(stderr, "\ncpu::fetch pc=0x%08x, core->prefetch_cnt(%d) instr=0x%08x\n", core->pc, core->prefetch_cnt, core->instruction);
@@ -97,89 +455,180 @@ void fetch(core_t *core)
 #define REG_W(x, y) (core->registers[x] = (x == 0 ? 0 : y))
 #define REG_R(x) (x == 0 ? 0 : core->registers[x])
 
-void decode(core_t *core)
-{
-  register uint32_t i = core->instruction;
-  register instr_t *dec = &core->decoded;
-
-  dec->isJump = false;
-  dec->writeRd = false;
-  dec->writeMem = false;
-  dec->readMem = false;
-  
-  dec->opcode = (i & 0x7f);
-  dec->optype = decode_type_table[dec->opcode];
+static dinstr_handler_t resolve_handler(const opcode_t op);
+static bool core_atomic(core_t *, const dinstr_t *, const vaddr_t, const uint32_t, uint32_t *);
+static bool core_csr(core_t *, const dinstr_t *, const uint32_t, uint32_t *);
+static bool core_sfence_vma(core_t *, const dinstr_t *, const vaddr_t);
 
-  dec->rs1 = (i >> 15) & 31;
-  dec->rs1v = REG_R(dec->rs1); // TODO: Register read in decode?
-  dec->rs2 = (i >> 20) & 31;
-  dec->rs2v = REG_R(dec->rs2); // TODO: Register read in decode?
+// Decode a raw instruction into its unpacked, cacheable form
+static void decode_instruction(dinstr_t *d, const vaddr_t pc, uint32_t i)
+{
+  d->len = sizeof(uint32_t);
+  if(RVC_COMPRESSED(i)) {
+    i = rvc_expand(i & 0xffff);
+    d->len = sizeof(uint16_t);
+  }
+  const uint32_t opcode = i & 0x7f;
+  const uint32_t funct3 = (i >> 12) & 7;
 
-  dec->funct3 = (i>>12) & 7;
-  dec->shamt = (i>>20) & 31;
-  dec->rd = (i>>7) & 31;
-  dec->funct7 = 0;
+  d->pc = pc;
+  d->instruction = i;
+  d->optype = decode_type_table[opcode];
+  d->rd  = (i >> 7) & 31;
+  d->rs1 = (i >> 15) & 31;
+  d->rs2 = (i >> 20) & 31;
+  d->rs3 = 0;
+  d->imm = 0;
+  d->fused = FUSE_NONE;
+  d->op  = opcode | (funct3 << 7);
 
-#ifdef CPU_TRACE
-  fprintf(stderr, "cpu::decode rs1=%hhu(0x%08x)  rs2=%hhu  rd=%hhu\n", dec->rs1, dec->rs1v, dec->rs2, dec->rd);
-#endif
+  // Vector loads and stores share LOAD-FP/STORE-FP, told apart by width
+  if((opcode == (OP_FLW & 0x7f) || opcode == (OP_FSW & 0x7f)) && (funct3 == 0 || funct3 >= 5)) {
+    d->optype = V;
+  }
 
-  switch(dec->optype) {
+  switch(d->optype) {
   case C:
-    // TODO
+    d->imm = i >> 20; // csr number
+    if(funct3 == 0 && (i >> 25) == 0b0001001) {
+      d->op = OP_SFENCE_VMA;
+    }
     break;
 
   case R:
-    dec->funct7 = (i >> 25);
+    if(opcode == (OP_LR_W & 0x7f)) {
+      d->op |= (i >> 27) << 11; // funct5, aq/rl dropped
+    } else if(opcode == (OP_FADD_S & 0x7f)) {
+      const uint32_t funct5 = i >> 27;
+      uint32_t variant = 0;
+      switch(funct5) {
+      case 0b00100: case 0b00101: case 0b10100: case 0b11100:
+	variant = funct3;
+	break;
+      case 0b11000: case 0b11010:
+	variant = d->rs2 & 1;
+	break;
+      }
+      d->op = opcode | (variant << 7) | (((i >> 25) & 1) << 10) | (funct5 << 11);
+      d->imm = funct3; // rounding mode
+    } else if((opcode & 0b1110011) == (OP_FMADD_S & 0x7f)) {
+      // FMADD/FMSUB/FNMSUB/FNMADD
+      d->op = opcode | (((i >> 25) & 1) << 10);
+      d->rs3 = i >> 27;
+      d->imm = funct3; // rounding mode
+    } else if((i >> 25) & ~FUNCT7_KEY_BITS) {
+      d->op = OP_NONE;
+    } else {
+      d->op |= FUNCT7_KEY(i >> 25) << 11;
+      if(d->op == OP_ZEXT_H && d->rs2 != 0) {
+	d->op = OP_NONE;
+      }
+    }
     break;
 
   case I:
-    dec->imm12 = (i>>20) & ((1<<12)-1);
+    d->imm = (int32_t)i >> 20;
+    if(opcode == (OP_SLLI & 0x7f) && (funct3 & 3) == 1) {
+      // Shifts and their Zbb/Zbs relatives: funct7 selects the op, imm is
+      // shamt. CLZ and friends share a funct7 and are told apart by rs2.
+      // REV8 and ORC.B fix rs2 as well, anything else there is reserved.
+      const uint32_t f7 = i >> 25;
+      if(funct3 == 1 && f7 == 0b0110000) {
+        d->op = d->rs2 > 0xf ? OP_NONE : d->op | (FUNCT7_UNARY | d->rs2) << 11;
+      } else if(f7 & ~FUNCT7_KEY_BITS) {
+        d->op = OP_NONE;
+      } else {
+        d->op |= FUNCT7_KEY(f7) << 11;
+        if((d->op == OP_REV8 && d->rs2 != 24) || (d->op == OP_ORC_B && d->rs2 != 7)) {
+          d->op = OP_NONE;
+        }
+      }
+      d->imm &= 31;
+    }
     break;
-    
+
   case S:
-    dec->imm12 = (((i >>7) & 0b11111) | ((i >> 20) & 0xffffe0));
+    d->imm = ((int32_t)(i & 0xfe000000) >> 20) | ((i >> 7) & 0x1f);
     break;
-    
-  case B: {
-    const uint32_t imm12 = (i >> 31) & 1;
-    const uint32_t imm105 = (i >> 25) & 0b111111;
-    const uint32_t imm41 = (i >> 8) & 0xf;
-    const uint32_t imm11 = (i >> 7) & 1;
-    const uint32_t bimm = (imm12 << 12) | (imm105 << 5) | (imm41 << 1) | (imm11 << 11);
-
-    //imm12 is only 12 bits in struct, but we have 13 for branches, so to preserve
-    //top bit, we need to shift down once, and then account for that when
-    // calculating jumpTarget
-    dec->imm12 = bimm>>1; 
+
+  case B:
+    d->imm = ((int32_t)(i & 0x80000000) >> 19) |
+      ((i << 4) & 0x800) |
+      ((i >> 20) & 0x7e0) |
+      ((i >> 7) & 0x1e);
     break;
-  }
-    
+
   case U:
-    dec->imm20 = (i >> 12) & 0xfffff;
+    d->op = opcode;
+    d->imm = i & 0xfffff000;
     break;
 
-  case J: {
-    const uint32_t  imm20 = (i >> 31) & 0b1;
-    const uint32_t  imm101 = (i >> 21) & 0b1111111111;
-    const uint32_t  imm11 = (i >> 20) & 0b1;
-    const uint32_t  imm1912 = (i >> 12) & 0b11111111;
-
-    const int32_t imm =
-      (imm20 << 20) |
-      (imm101 << 1) |
-      (imm11 << 11) |
-      (imm1912 << 12);
-    dec->imm20 = ((imm) << 11) >> 12;
-  }
+  case J:
+    d->op = opcode;
+    d->imm = ((int32_t)(i & 0x80000000) >> 11) |
+      (i & 0xff000) |
+      ((i >> 9) & 0x800) |
+      ((i >> 20) & 0x7fe);
+    break;
+
+  case V:
+    if(opcode != (OP_VSETVLI & 0x7f)) {
+      // mop, and for unit-stride the lumop/sumop variant in rs2
+      const uint32_t mop = (i >> 26) & 3;
+      uint32_t kind = 0;
+      if(mop == 0 && d->rs2 != 0) {
+	kind = d->rs2 == 0b01011 ? 1 : d->rs2 == 0b01000 ? 2 : 3;
+      }
+      d->op |= (mop << 11) | (kind << 13);
+    } else if(funct3 == 7) {
+      if((i >> 31) == 0) {
+	d->op = OP_VSETVLI;
+	d->imm = (i >> 20) & 0x7ff;
+      } else if((i >> 30) == 3) {
+	d->op = OP_VSETIVLI;
+	d->imm = (i >> 20) & 0x3ff;
+      } else {
+	d->op = (i >> 25) == 0b1000000 ? OP_VSETVL : OP_NONE;
+      }
+    } else {
+      d->op |= ((i >> 31) << 10) | (((i >> 26) & 0x1f) << 11);
+      d->imm = (int32_t)(i << 12) >> 27; // simm5
+    }
     break;
 
   case Unknown:
-    fprintf(stderr, "cpu:%d:decode i=0x%08x: unknown opcode=0x%08x optype=%x, pc=0x%08x\n", core->id, i, dec->opcode, dec->optype, core->pc);
-    cause_trap(core, ILLEGAL_INSTRUCTION);
+    d->op = OP_NONE;
     break;
   }
+  d->handler = resolve_handler(d->op);
+}
+
+void decode(core_t *core)
+{
+  register instr_t *dec = &core->decoded;
+  dinstr_t *d = &core->dcache[DCACHE_INDEX(core->pc)];
+
+  if(d->pc != core->pc) {
+    decode_instruction(d, core->pc, core->instruction);
+  }
 
+  dec->d = d;
+  dec->isJump = false;
+  dec->writeRd = false;
+  dec->writeMem = false;
+  dec->readMem = false;
+
+  dec->rs1v = REG_R(d->rs1); // TODO: Register read in decode?
+  dec->rs2v = REG_R(d->rs2); // TODO: Register read in decode?
+
+#ifdef CPU_TRACE
+  fprintf(stderr, "cpu::decode rs1=%hhu(0x%08x)  rs2=%hhu  rd=%hhu\n", d->rs1, dec->rs1v, d->rs2, d->rd);
+#endif
+
+  if(d->optype == Unknown) {
+    fprintf(stderr, "cpu:%d:decode i=0x%08x: unknown opcode=0x%08x optype=%x, pc=0x%08x\n", core->id, d->instruction, d->instruction & 0x7f, d->optype, core->pc);
+    cause_trap(core, ILLEGAL_INSTRUCTION);
+  }
 }
 
 
@@ -192,12 +641,20 @@ int add_wrap(int32_t x, int32_t y) {
 void execute(core_t *core)
 {
   instr_t *dec = &core->decoded;
+  const dinstr_t *d = dec->d;
 
-  switch(dec->optype) {
+  // F/D and V run whole in EX, on the handlers of the fast engines
+  switch(d->op & 0x7f) {
+  case 0b0000111: case 0b0100111: case 0b1010011: case 0b1010111:
+  case 0b1000011: case 0b1000111: case 0b1001011: case 0b1001111:
+    (void)d->handler(core, d);
+    return;
+  }
+
+  switch(d->optype) {
   case R: {
-    const uint32_t op = dec->opcode | (dec->funct3 << 7) | ((dec->funct7 >> 5)<<11);
     dec->writeRd = true;
-    switch(op) {
+    switch(d->op) {
     case OP_ADD:  core->aluOut = dec->rs1v + dec->rs2v;                            break;
     case OP_SUB:  core->aluOut = dec->rs1v - dec->rs2v;                            break;
     case OP_SLL:  core->aluOut = (uint32_t)((int32_t)dec->rs1v) << (dec->rs2v&31); break;
@@ -205,9 +662,41 @@ void execute(core_t *core)
     case OP_SLTU: core->aluOut = dec->rs1v < dec->rs2v ? 1 : 0;                    break;
     case OP_XOR:  core->aluOut = dec->rs1v ^ dec->rs2v;                            break;
     case OP_SRL:  core->aluOut = dec->rs1v >> (dec->rs2v&31);                      break;
-    case OP_SRA:  core->aluOut = (uint32_t)((int32_t)dec->rs1v) >> (dec->rs2v&31); break;
+    case OP_SRA:  core->aluOut = (uint32_t)((int32_t)dec->rs1v >> (dec->rs2v&31)); break;
     case OP_OR:   core->aluOut = dec->rs1v | dec->rs2v;                            break;
     case OP_AND:  core->aluOut = dec->rs1v & dec->rs2v;                            break;
+    case OP_MUL:    core->aluOut = dec->rs1v * dec->rs2v;                          break;
+    case OP_MULH:   core->aluOut = rv32m_mulh(dec->rs1v, dec->rs2v);               break;
+    case OP_MULHSU: core->aluOut = rv32m_mulhsu(dec->rs1v, dec->rs2v);             break;
+    case OP_MULHU:  core->aluOut = rv32m_mulhu(dec->rs1v, dec->rs2v);              break;
+    case OP_DIV:    core->aluOut = rv32m_div(dec->rs1v, dec->rs2v);                break;
+    case OP_DIVU:   core->aluOut = rv32m_divu(dec->rs1v, dec->rs2v);               break;
+    case OP_REM:    core->aluOut = rv32m_rem(dec->rs1v, dec->rs2v);                break;
+    case OP_REMU:   core->aluOut = rv32m_remu(dec->rs1v, dec->rs2v);               break;
+    case OP_SH1ADD: core->aluOut = (dec->rs1v << 1) + dec->rs2v;                   break;
+    case OP_SH2ADD: core->aluOut = (dec->rs1v << 2) + dec->rs2v;                   break;
+    case OP_SH3ADD: core->aluOut = (dec->rs1v << 3) + dec->rs2v;                   break;
+    case OP_ANDN:   core->aluOut = dec->rs1v & ~dec->rs2v;                         break;
+    case OP_ORN:    core->aluOut = dec->rs1v | ~dec->rs2v;                         break;
+    case OP_XNOR:   core->aluOut = ~(dec->rs1v ^ dec->rs2v);                       break;
+    case OP_MIN:    core->aluOut = (int32_t)dec->rs1v < (int32_t)dec->rs2v ? dec->rs1v : dec->rs2v; break;
+    case OP_MAX:    core->aluOut = (int32_t)dec->rs1v > (int32_t)dec->rs2v ? dec->rs1v : dec->rs2v; break;
+    case OP_MINU:   core->aluOut = dec->rs1v < dec->rs2v ? dec->rs1v : dec->rs2v;  break;
+    case OP_MAXU:   core->aluOut = dec->rs1v > dec->rs2v ? dec->rs1v : dec->rs2v;  break;
+    case OP_ROL:    core->aluOut = rv32b_rol(dec->rs1v, dec->rs2v);                break;
+    case OP_ROR:    core->aluOut = rv32b_ror(dec->rs1v, dec->rs2v);                break;
+    case OP_ZEXT_H: core->aluOut = dec->rs1v & 0xffff;                             break;
+    case OP_BCLR:   core->aluOut = dec->rs1v & ~(1u << (dec->rs2v & 31));          break;
+    case OP_BEXT:   core->aluOut = (dec->rs1v >> (dec->rs2v & 31)) & 1;            break;
+    case OP_BINV:   core->aluOut = dec->rs1v ^ (1u << (dec->rs2v & 31));           break;
+    case OP_BSET:   core->aluOut = dec->rs1v | (1u << (dec->rs2v & 31));           break;
+    case OP_LR_W: case OP_SC_W: case OP_AMOSWAP_W: case OP_AMOADD_W:
+    case OP_AMOXOR_W: case OP_AMOAND_W: case OP_AMOOR_W: case OP_AMOMIN_W:
+    case OP_AMOMAX_W: case OP_AMOMINU_W: case OP_AMOMAXU_W:
+    { uint32_t v;
+      if(core_atomic(core, d, dec->rs1v, dec->rs2v, &v)) core->aluOut = v;
+      break;
+    }
     default:
       cause_trap(core, ILLEGAL_INSTRUCTION);
       break;
@@ -216,45 +705,36 @@ void execute(core_t *core)
   } // R
 
   case I: {
-    const uint32_t op = dec->opcode | (dec->funct3 << 7) | ((dec->funct7 >> 5)<<11);
-    const int32_t se_imm12 = (dec->imm12<<20)>>20; // sign extend
+    const int32_t se_imm12 = d->imm;
     dec->writeRd = true;
 #ifdef CPU_TRACE
-    fprintf(stderr, "cpu::execute I-type, imm12/se=0x%08x/0x%08x\n", dec->imm12,se_imm12);
+    fprintf(stderr, "cpu::execute I-type, imm12/se=0x%08x/0x%08x\n", d->imm & 0xfff, se_imm12);
 #endif
 
-    switch(op) {
+    switch(d->op) {
     case OP_JALR:
       dec->isJump = true;
-      core->aluOut = core->pc + sizeof(uint32_t);
+      core->aluOut = core->pc + d->len;
 #ifdef CPU_TRACE
-      fprintf(stderr, "cpu::execute JALR, rs1=X%02d (0x%08x)\n", dec->rs1, dec->rs1v);
+      fprintf(stderr, "cpu::execute JALR, rs1=X%02d (0x%08x)\n", d->rs1, dec->rs1v);
 #endif
-      dec->jumpTarget = dec->rs1v + se_imm12;
+      dec->jumpTarget = (dec->rs1v + se_imm12) & ~1;
       break;
     case OP_LB:
     case OP_LBU:
       dec->memOffset = dec->rs1v + se_imm12;
       dec->memAccessWidth = BYTE;
-      core->aluOut = dec->rs2v & 0xff;
-      dec->readMem = true;
-      break;
-    case OP_LHU:
-      dec->memOffset = dec->rs1v + se_imm12;
-      dec->memAccessWidth = HALFWORD;
-      core->aluOut = dec->rs2v & 0xffff;
       dec->readMem = true;
       break;
     case OP_LH:
+    case OP_LHU:
       dec->memOffset = dec->rs1v + se_imm12;
       dec->memAccessWidth = HALFWORD;
-      core->aluOut = ((int32_t)(dec->rs2v & 0xffff)<<16)>>16;
       dec->readMem = true;
       break;
     case OP_LW:
       dec->memOffset = dec->rs1v + se_imm12;
       dec->memAccessWidth = WORD;
-      core->aluOut = dec->rs2v & 0xffffffff;
       dec->readMem = true;
       break;
     case OP_ADDI: {
@@ -264,27 +744,39 @@ void execute(core_t *core)
     case OP_SLTI:  core->aluOut = (int32_t)dec->rs1v < (int32_t)se_imm12 ? 1 : 0;  break;
     case OP_SLTIU: core->aluOut = dec->rs1v < (uint32_t)se_imm12 ? 1 : 0;          break;
     case OP_XORI:  core->aluOut = dec->rs1v ^ se_imm12;			           break;
-    case OP_ORI:   core->aluOut = dec->rs1v | (se_imm12&0xfff);		           break;
+    case OP_ORI:   core->aluOut = dec->rs1v | se_imm12;			           break;
     case OP_ANDI:  core->aluOut = dec->rs1v & se_imm12;			           break;
-    case OP_SLLI:  core->aluOut = dec->rs1v << dec->shamt;			   break;
-    case OP_SRLI:  core->aluOut = dec->rs1v >> dec->shamt;			   break;
-    case OP_SRAI:  core->aluOut = ((int32_t)dec->rs1v) >> dec->shamt;		   break;
-    default: assert(false); break;
+    case OP_SLLI:  core->aluOut = dec->rs1v << se_imm12;			   break;
+    case OP_SRLI:  core->aluOut = dec->rs1v >> se_imm12;			   break;
+    case OP_SRAI:  core->aluOut = ((int32_t)dec->rs1v) >> se_imm12;		   break;
+    case OP_RORI:  core->aluOut = rv32b_ror(dec->rs1v, se_imm12);		   break;
+    case OP_ORC_B: core->aluOut = rv32b_orcb(dec->rs1v);			   break;
+    case OP_REV8:  core->aluOut = __builtin_bswap32(dec->rs1v);		   break;
+    case OP_CLZ:   core->aluOut = rv32b_clz(dec->rs1v);			   break;
+    case OP_CTZ:   core->aluOut = rv32b_ctz(dec->rs1v);			   break;
+    case OP_CPOP:  core->aluOut = rv32b_cpop(dec->rs1v);			   break;
+    case OP_SEXT_B: core->aluOut = (int32_t)(int8_t)dec->rs1v;		   break;
+    case OP_SEXT_H: core->aluOut = (int32_t)(int16_t)dec->rs1v;		   break;
+    case OP_BCLRI: core->aluOut = dec->rs1v & ~(1u << se_imm12);		   break;
+    case OP_BEXTI: core->aluOut = (dec->rs1v >> se_imm12) & 1;		   break;
+    case OP_BINVI: core->aluOut = dec->rs1v ^ (1u << se_imm12);		   break;
+    case OP_BSETI: core->aluOut = dec->rs1v | (1u << se_imm12);		   break;
+    default:
+      cause_trap(core, ILLEGAL_INSTRUCTION);
+      break;
     }
     break;
   }
 
   case S: {
-    const uint32_t op = dec->opcode | (dec->funct3 << 7);
-    const int32_t se_imm12 = (dec->imm12<<20)>>20;
     dec->writeMem = true;
-    dec->memOffset = dec->rs1v + se_imm12;
+    dec->memOffset = dec->rs1v + d->imm;
 
 #ifdef CPU_TRACE
     fprintf(stderr, "cpu::execute S-type memOffset=0x%08x\n", dec->memOffset);
 #endif
 
-    switch(op) {
+    switch(d->op) {
     case OP_SB: {
       dec->memAccessWidth = BYTE;
       core->aluOut = dec->rs2v & 0xff;
@@ -300,25 +792,30 @@ void execute(core_t *core)
       core->aluOut = dec->rs2v & 0xffffffff; // the word to store
       break;
     }
-    default: assert(false); break;
+    default:
+      dec->writeMem = false;
+      cause_trap(core, ILLEGAL_INSTRUCTION);
+      break;
     }
     break;
   } // S
 
   case B: {
-    const uint32_t op = (dec->opcode | (dec->funct3 << 7));
-    const int32_t se_imm12 = (int32_t)((dec->imm12<<20)>>19);
     #ifdef CPU_TRACE
-    fprintf(stderr, "cpu::execute B-type: func3=0x%1x, imm12/se: 0x%04x/0x%05x\n", dec->funct3, dec->imm12, se_imm12);
+    fprintf(stderr, "cpu::execute B-type: op=0x%04x, imm/se: 0x%05x\n", d->op, d->imm);
     #endif
-    dec->jumpTarget = core->pc + se_imm12;
-    switch(op) {
+    dec->jumpTarget = core->pc + d->imm;
+    switch(d->op) {
     case OP_BEQ:  core->aluOut = dec->rs1v == dec->rs2v ? 1 : 0;                  break;
     case OP_BNE:  core->aluOut = dec->rs1v != dec->rs2v ? 1 : 0;                  break;
     case OP_BLT:  core->aluOut = (int32_t)dec->rs1v < (int32_t)dec->rs2v ? 1 : 0; break;
     case OP_BLTU: core->aluOut = dec->rs1v < dec->rs2v ? 1 : 0;                   break;
     case OP_BGE:  core->aluOut = (int32_t)dec->rs1v >= (int32_t)dec->rs2v ? 1 : 0; break;
     case OP_BGEU: core->aluOut = dec->rs1v >= dec->rs2v ? 1 : 0;                   break;
+    default:
+      core->aluOut = 0;
+      cause_trap(core, ILLEGAL_INSTRUCTION);
+      break;
     }
     dec->isJump = core->aluOut == 1;
     break;
@@ -326,17 +823,15 @@ void execute(core_t *core)
 
   case U: {
     dec->writeRd = true;
-    switch(dec->opcode) {
-    case OP_LUI & 0x7f:
-      core->aluOut = (dec->imm20 << 12);
+    switch(d->op) {
+    case OP_LUI:
+      core->aluOut = d->imm;
       break;
-    case OP_AUIPC & 0x7f: {
-      const int32_t m = 1 << (20 -1);
-      const int32_t se_imm20 = (dec->imm20 ^ m) - m;
-      core->aluOut = (se_imm20<<12) + core->pc;
+    case OP_AUIPC: {
+      core->aluOut = d->imm + core->pc;
 #ifdef CPU_TRACE
-      fprintf(stderr, "cpu::exec AUIPC  pc=0x%08x imm20/se: 0x%08x 0x%08x => 0x%08x\n",
-	      core->pc, dec->imm20, se_imm20, core->aluOut);
+      fprintf(stderr, "cpu::exec AUIPC  pc=0x%08x imm: 0x%08x => 0x%08x\n",
+	      core->pc, d->imm, core->aluOut);
 #endif
       break;
     }
@@ -350,20 +845,18 @@ void execute(core_t *core)
   case J: {
     dec->isJump = true;
     dec->writeRd = true;
-    switch(dec->opcode) {
-    case OP_JAL & 0x7f: {
-      const int32_t m = 1 << (20 -1);
-      const int32_t se_imm20 = (dec->imm20 ^ m) - m;
-      dec->jumpTarget = (se_imm20<<1) + core->pc;
+    switch(d->op) {
+    case OP_JAL: {
+      dec->jumpTarget = d->imm + core->pc;
 
-      core->aluOut = core->pc + sizeof(vaddr_t);
+      core->aluOut = core->pc + d->len;
 #ifdef CPU_TRACE
-      fprintf(stderr, "JAL jumpTarget: 0x%08x imm20/se: 0x%08x/0x%08x \n", dec->jumpTarget, dec->imm20, se_imm20);
+      fprintf(stderr, "JAL jumpTarget: 0x%08x imm: 0x%08x\n", dec->jumpTarget, d->imm);
 #endif
       break;
     }
     default:
-      assert(false == dec->opcode);
+      assert(false == d->op);
       break;
     }
     
@@ -371,11 +864,29 @@ void execute(core_t *core)
   } // J
     
   case C: { // System instruction
-    switch(dec->opcode) {
+    switch(d->op) {
     case OP_ECALL: {
       cause_trap(core, ENV_CALL_UMODE);
       break;
     }
+    case OP_SFENCE_VMA:
+      (void)core_sfence_vma(core, d, dec->rs1v);
+      break;
+    case OP_FENCE:
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      break;
+    case OP_FENCE_I:
+      core_flush_code(core);
+      break;
+    case OP_CSRRW: case OP_CSRRS: case OP_CSRRC:
+    case OP_CSRRWI: case OP_CSRRSI: case OP_CSRRCI: {
+      uint32_t v;
+      if(core_csr(core, d, dec->rs1v, &v)) {
+	core->aluOut = v;
+	dec->writeRd = true;
+      }
+      break;
+    }
     default:
       cause_trap(core, ILLEGAL_INSTRUCTION);
       break;
@@ -383,6 +894,7 @@ void execute(core_t *core)
     break;
   } // C
 
+  case V: // ran above
   case Unknown:
     // Illegal instruction trap
     cause_trap(core, ILLEGAL_INSTRUCTION);
@@ -390,48 +902,332 @@ void execute(core_t *core)
   }
 }
 
-void memory_access(core_t *core)
+// An access of size bytes at va that leaves its page is split into bytes,
+// each of them translated on its own
+static inline bool crosses_page(const vaddr_t va, const size_t size)
 {
-  const instr_t *dec = &core->decoded;
-  if(dec->readMem) {
+  return (va & (SV32_PAGE_SIZE - 1)) > SV32_PAGE_SIZE - size;
+}
+
+// A load or store that hits a TLB entry with host memory, within one page,
+// while the mmu permissions it was checked against still hold, touches
+// RAM directly. Everything else takes the bus.
+static inline const tlb_entry_t *host_entry(const core_t *core, const vaddr_t addr, const size_t size,
+					     const tlb_access_t access)
+{
+  const tlb_entry_t *e = &core->tlb->entries[TLB_INDEX(addr)];
+  const uint8_t *host = access == TLB_LOAD ? e->load : e->store;
+  if(e->tag[access] != addr >> SV32_PAGE_SHIFT || host == NULL ||
+     crosses_page(addr, size) || core->tlb->gen != core->mmu->perm_gen) {
+    return NULL;
+  }
+  return e;
+}
+
+#ifdef MMU_GUARD
+// In guard mode only the checked path fills bare mode TLB entries, so a
+// hit marks a page that faulted before. Going to the checked path
+// straight away saves a host fault per access to pages with mixed
+// permissions, like a stack that is still partly read after write.
+static inline bool guard_slow(const core_t *core, const vaddr_t addr, const tlb_access_t access)
+{
+  return core->tlb->entries[TLB_INDEX(addr)].tag[access] == addr >> SV32_PAGE_SHIFT;
+}
+#endif
+
+// Load through the bus, raising the matching trap on failure
+static bool __attribute__((noinline)) load_bus(core_t *core, const vaddr_t addr, const memory_access_width_t aw,
+					       uint32_t *out)
+{
+  const size_t size = 1u << aw;
+  vaddr_t pa = addr;
+  if(core->tlb->data && crosses_page(addr, size)) {
+    uint32_t v = 0, b;
+    for(size_t i=0; i < size; i++) {
+      if(!core_load(core, addr + i, BYTE, &b)) {
+	return false;
+      }
+      v |= b << (8 * i);
+    }
+    *out = v;
+    return true;
+  }
+  if(!sv32_translate(core, addr, TLB_LOAD, &pa)) {
+    return false;
+  }
 #ifdef MEM_TRACE
-    fprintf(stderr, "cpu::memory_access::readMem at 0x%08x (%hhu) => ", dec->memOffset, dec->memAccessWidth);
+  fprintf(stderr, "cpu::load at 0x%08x (%hhu) => ", pa, aw);
 #endif
-    core->aluOut = bus_read_single(core->bus, dec->memOffset, dec->memAccessWidth);
-    if(core->bus->status != BUS_OK) {
+  *out = bus_read_single(core->bus, pa, aw);
+  if(core->bus->status != BUS_OK) {
 #ifdef MEM_TRACE
-      fprintf(stderr, " ERROR\n");
+    fprintf(stderr, " ERROR\n");
 #endif
-      switch(core->bus->status) {
-      case BUS_READ_MISALIGNED:		cause_trap(core, LOAD_ADDR_MISALIGNED); return;
-      case BUS_ADDRESS_NOT_FOUND:	cause_trap(core, LOAD_ACCESS_FAULT); return;
-      default:				cause_trap(core, LOAD_PAGE_FAULT); return;
-      }
+    switch(core->bus->status) {
+    case BUS_READ_MISALIGNED:		cause_trap(core, LOAD_ADDR_MISALIGNED); return false;
+    case BUS_ADDRESS_NOT_FOUND:	cause_trap(core, LOAD_ACCESS_FAULT); return false;
+    default:				cause_trap(core, LOAD_PAGE_FAULT); return false;
     }
+  }
 #ifdef MEM_TRACE
-    fprintf(stderr, "0x%08x\n", core->aluOut);
+  fprintf(stderr, "0x%08x\n", *out);
 #endif
-  } else if(dec->writeMem) {
+  return true;
+}
+
+// Store through the bus, raising the matching trap on failure
+static bool __attribute__((noinline)) store_bus(core_t *core, const vaddr_t addr, const uint32_t value,
+						const memory_access_width_t aw)
+{
+  const size_t size = 1u << aw;
+  vaddr_t pa = addr;
+  if(core->tlb->data && crosses_page(addr, size)) {
+    for(size_t i=0; i < size; i++) {
+      if(!core_store(core, addr + i, (value >> (8 * i)) & 0xff, BYTE)) {
+	return false;
+      }
+    }
+    return true;
+  }
+  if(!sv32_translate(core, addr, TLB_STORE, &pa)) {
+    return false;
+  }
 #ifdef MEM_TRACE
-    fprintf(stderr, "cpu::memory_access::writeMem at 0x%08x (%hhu): 0x%08x\n", dec->memOffset, dec->memAccessWidth, core->aluOut);
-#endif
-    bus_write_single(core->bus, dec->memOffset, core->aluOut, dec->memAccessWidth);
-    if(core->bus->status != BUS_OK) {
-      switch(core->bus->status) {
-      case BUS_WRITE_MISALIGNED:	cause_trap(core, STORE_ADDR_MISALIGNED); return;
-      case BUS_ADDRESS_NOT_FOUND:	cause_trap(core, STORE_ACCESS_FAULT); return;
-      default:				cause_trap(core, STORE_PAGE_FAULT); return;
+  fprintf(stderr, "cpu::store at 0x%08x (%hhu): 0x%08x\n", pa, aw, value);
+#endif
+  bus_write_single(core->bus, pa, value, aw);
+  if(core->bus->status != BUS_OK) {
+    switch(core->bus->status) {
+    case BUS_WRITE_MISALIGNED:	cause_trap(core, STORE_ADDR_MISALIGNED); return false;
+    case BUS_ADDRESS_NOT_FOUND:	cause_trap(core, STORE_ACCESS_FAULT); return false;
+    default:				cause_trap(core, STORE_PAGE_FAULT); return false;
+    }
+  }
+  return true;
+}
+
+// Load from guest memory, raising the matching trap on failure
+bool core_load(core_t *core, const vaddr_t addr, const memory_access_width_t aw, uint32_t *out)
+{
+#ifdef MMU_GUARD
+  if(__builtin_expect(!core->tlb->data && !guard_slow(core, addr, TLB_LOAD), 1)) {
+    return guard_load(core->mmu->guard + addr, aw, out) || load_bus(core, addr, aw, out);
+  }
+#endif
+  const size_t size = 1u << aw;
+  const tlb_entry_t *e = host_entry(core, addr, size, TLB_LOAD);
+  if(__builtin_expect(e == NULL, 0)) {
+    return load_bus(core, addr, aw, out);
+  }
+  const uint8_t *p = e->load + (addr & (SV32_PAGE_SIZE - 1));
+  switch(aw) {
+  case BYTE:     *out = *p; break;
+  case HALFWORD: { uint16_t h; memcpy(&h, p, sizeof(h)); *out = h; break; }
+  default:       memcpy(out, p, sizeof(uint32_t)); break;
+  }
+  return true;
+}
+
+// Store to guest memory, raising the matching trap on failure
+bool core_store(core_t *core, const vaddr_t addr, const uint32_t value, const memory_access_width_t aw)
+{
+#ifdef MMU_GUARD
+  if(__builtin_expect(!core->tlb->data && !guard_slow(core, addr, TLB_STORE), 1)) {
+    if(!guard_store(core->mmu->guard + addr, aw, value)) {
+      return store_bus(core, addr, value, aw);
+    }
+    mmu_dirty(core->mmu, addr, 1u << aw);
+    return true;
+  }
+#endif
+  const size_t size = 1u << aw;
+  const tlb_entry_t *e = host_entry(core, addr, size, TLB_STORE);
+  if(__builtin_expect(e == NULL, 0)) {
+    return store_bus(core, addr, value, aw);
+  }
+  memcpy(e->store + (addr & (SV32_PAGE_SIZE - 1)), &value, size);
+  mmu_dirty(core->mmu, e->page | (addr & (SV32_PAGE_SIZE - 1)), size);
+  return true;
+}
+
+// RV32A on host atomics, directly on guest RAM and without the bus lock.
+// A reservation is the address LR.W loaded from and the value it saw; SC.W
+// is a compare and swap against that value, so harts share no reservation
+// state.
+static bool core_atomic(core_t *core, const dinstr_t *d, const vaddr_t addr, const uint32_t src, uint32_t *out)
+{
+  const bool lr = d->op == OP_LR_W;
+  if((addr & 3) != 0) {
+    cause_trap(core, lr ? LOAD_ADDR_MISALIGNED : STORE_ADDR_MISALIGNED);
+    return false;
+  }
+  vaddr_t pa = addr;
+  if(core->tlb->data && !sv32_translate(core, addr, lr ? TLB_LOAD : TLB_STORE, &pa)) {
+    core->reserved_addr = RESERVATION_NONE;
+    return false;
+  }
+  uint32_t *p = core->mmu ? mmu_atomic_word(core->mmu, pa, lr ? MPERM_READ : MPERM_WRITE) : NULL;
+  if(p == NULL) {
+    core->reserved_addr = RESERVATION_NONE;
+    cause_trap(core, lr ? LOAD_ACCESS_FAULT : STORE_ACCESS_FAULT);
+    return false;
+  }
+
+  uint32_t old, val;
+  switch(d->op) {
+  case OP_LR_W:
+    *out = __atomic_load_n(p, __ATOMIC_SEQ_CST);
+    core->reserved_addr = addr;
+    core->reserved_value = *out;
+    return true;
+
+  case OP_SC_W: {
+    const bool held = core->reserved_addr == addr;
+    old = core->reserved_value;
+    core->reserved_addr = RESERVATION_NONE;
+    if(!held || !__atomic_compare_exchange_n(p, &old, src, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+      *out = 1;
+      return true;
+    }
+    *out = 0;
+    mmu_written(core->mmu, pa, sizeof(uint32_t));
+    return true;
+  }
+
+  case OP_AMOSWAP_W: old = __atomic_exchange_n(p, src, __ATOMIC_SEQ_CST);  break;
+  case OP_AMOADD_W:  old = __atomic_fetch_add(p, src, __ATOMIC_SEQ_CST);   break;
+  case OP_AMOXOR_W:  old = __atomic_fetch_xor(p, src, __ATOMIC_SEQ_CST);   break;
+  case OP_AMOAND_W:  old = __atomic_fetch_and(p, src, __ATOMIC_SEQ_CST);   break;
+  case OP_AMOOR_W:   old = __atomic_fetch_or(p, src, __ATOMIC_SEQ_CST);    break;
+
+  case OP_AMOMIN_W:
+  case OP_AMOMAX_W:
+  case OP_AMOMINU_W:
+  case OP_AMOMAXU_W:
+    old = __atomic_load_n(p, __ATOMIC_RELAXED);
+    do {
+      switch(d->op) {
+      case OP_AMOMIN_W:  val = (int32_t)src < (int32_t)old ? src : old; break;
+      case OP_AMOMAX_W:  val = (int32_t)src > (int32_t)old ? src : old; break;
+      case OP_AMOMINU_W: val = src < old ? src : old;                   break;
+      default:           val = src > old ? src : old;                   break;
       }
+    } while(!__atomic_compare_exchange_n(p, &old, val, true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+    break;
+
+  default:
+    cause_trap(core, ILLEGAL_INSTRUCTION);
+    return false;
+  }
+  *out = old;
+  mmu_written(core->mmu, pa, sizeof(uint32_t));
+  return true;
+}
+
+// Zicsr. fflags, frm and fcsr are views of fcsr and go through fpu.c,
+// vxsat, vxrm and vcsr likewise through vector.c. Everything else is plain
+// state in core->csr.
+static bool core_csr(core_t *core, const dinstr_t *d, const uint32_t src, uint32_t *out)
+{
+  const uint32_t addr = d->imm & 0xfff;
+  const uint32_t v = (d->op >> 7) & 4 ? d->rs1 : src; // CSRR*I: rs1 is uimm
+  const bool rw = d->op == OP_CSRRW || d->op == OP_CSRRWI;
+  if((rw || d->rs1 != 0) && (addr >> 10) == 3) {
+    cause_trap(core, ILLEGAL_INSTRUCTION); // read-only
+    return false;
+  }
+
+  uint32_t (*view_read)(csr_t *, const uint32_t) = NULL;
+  void (*view_write)(csr_t *, const uint32_t, const uint32_t) = NULL;
+  if(addr >= fflags && addr <= fcsr) {
+    view_read = fpu_csr_read;
+    view_write = fpu_csr_write;
+  } else if(addr == vxsat || addr == vxrm || addr == vcsr) {
+    view_read = vector_csr_read;
+    view_write = vector_csr_write;
+  }
+  if(view_read != NULL) {
+    *out = view_read(&core->csr, addr);
+    if(rw) {
+      view_write(&core->csr, addr, v);
+    } else if(d->rs1 != 0) {
+      const bool set = d->op == OP_CSRRS || d->op == OP_CSRRSI;
+      view_write(&core->csr, addr, set ? *out | v : *out & ~v);
     }
+    return true;
   }
+
+  switch(d->op) {
+  case OP_CSRRW: case OP_CSRRWI: *out = csr_read_write32(&core->csr, addr, v); break;
+  case OP_CSRRS: case OP_CSRRSI: *out = csr_read_set32(&core->csr, addr, v);   break;
+  default:                       *out = csr_read_clear32(&core->csr, addr, v); break;
+  }
+
+  // Translation follows satp and mstatus, and a new satp maps pcs anew
+  if((rw || d->rs1 != 0) && (addr == satp || addr == mstatus)) {
+    const bool fetch = core->tlb->fetch;
+    sv32_update(core);
+    if(addr == satp && (fetch || core->tlb->fetch)) {
+      core_flush_code(core);
+    }
+  }
+  return true;
+}
+
+// SFENCE.VMA, for the page at va or everything when rs1 is x0. Cached
+// translations are not tagged with an ASID, so rs2 is not looked at.
+static bool core_sfence_vma(core_t *core, const dinstr_t *d, const vaddr_t va)
+{
+  if(core->priv_mode == PMODE_USER) {
+    cause_trap(core, ILLEGAL_INSTRUCTION);
+    return false;
+  }
+  sv32_flush(core, va, d->rs1 == 0);
+  if(core->tlb->fetch) {
+    core_flush_code(core);
+  }
+  return true;
 }
 
+void memory_access(core_t *core)
+{
+  const instr_t *dec = &core->decoded;
+  if(dec->readMem) {
+    uint32_t v;
+    if(!core_load(core, dec->memOffset, dec->memAccessWidth, &v)) {
+      return;
+    }
+    switch(dec->d->op) {
+    case OP_LB:  core->aluOut = (int32_t)(int8_t)v;  break;
+    case OP_LH:  core->aluOut = (int32_t)(int16_t)v; break;
+    default:     core->aluOut = v;                   break;
+    }
+  } else if(dec->writeMem) {
+    (void)core_store(core, dec->memOffset, core->aluOut, dec->memAccessWidth);
+  }
+}
+
+#ifdef CPU_RETIRE_HOOKS
+// Called with every retired instruction and the pc following it
+static inline void core_retired(core_t *core, const dinstr_t *d, const vaddr_t next)
+{
+#ifdef CPU_TIMING
+  timing_retire(core->timing, d, next);
+#endif
+#ifdef CPU_BPRED
+  if(d->optype == B || d->optype == J || d->op == OP_JALR) {
+    bpred_update(core->bpred, d, next);
+  }
+#endif
+}
+#endif
+
 void writeback(core_t *core)
 {
   const instr_t *dec = &core->decoded;
   //  assert(core->state == WRITEBACK);
   if(dec->writeRd) {
-    REG_W(core->decoded.rd, core->aluOut);
+    REG_W(dec->d->rd, core->aluOut);
   }
 
   if(dec->isJump) {
@@ -441,14 +1237,31 @@ void writeback(core_t *core)
     core->pc = dec->jumpTarget;
     core->prefetch_cnt = 0; // flush prefetch cache
   } else {
-    core->pc += sizeof(uint32_t);
+    core->pc += dec->d->len;
   }
+  core->instret++;
+#ifdef CPU_RETIRE_HOOKS
+  core_retired(core, dec->d, core->pc);
+#endif
 
 #ifdef CPU_TRACE
   core_dumpregs(core);
 #endif
 }
 
+// Length of the instruction at pc, which just trapped. It is normally
+// still decoded; 4 when it can not be read either, as on a fault fetching
+// it.
+static uint8_t trap_instruction_len(core_t *core, const vaddr_t pc)
+{
+  const dinstr_t *d = &core->dcache[DCACHE_INDEX(pc)];
+  if(d->pc == pc) {
+    return d->len;
+  }
+  uint32_t instruction;
+  return read_instruction(core, pc, &instruction) && RVC_COMPRESSED(instruction) ? 2 : 4;
+}
+
 void trap(core_t *core)
 {
 #ifdef CPU_TRACE
@@ -461,6 +1274,7 @@ void trap(core_t *core)
     memcpy(core->trap_regs, core->registers, NUMREGS*sizeof(uint32_t));
     core->prefetch_cnt = 0;  // flush prefetch cache, since pc changed
     core->trap_pc = core->pc;
+    core->trap_len = trap_instruction_len(core, core->pc);
     (void)csr_read_write32(&core->csr, mepc, core->pc);
     core->state = TRAP;
     core->trap_state = HANDLE;
@@ -474,7 +1288,8 @@ void trap(core_t *core)
     // TODO: Unsure if all registers should be restored..
     memcpy(core->registers, core->trap_regs, NUMREGS*sizeof(uint32_t));
 
-    core->pc = csr_read_clear32(&core->csr, mepc, 0) + 4;
+    // Past the trapping instruction, C.EBREAK included
+    core->pc = csr_read_clear32(&core->csr, mepc, 0) + core->trap_len;
 
     core->trap_state = NONE;
     core->state = FETCH;
@@ -484,9 +1299,16 @@ void trap(core_t *core)
 }
 
 // All stages, except TRAP, can set TRAP state
+#ifdef CPU_TIMING
+// core->cycle comes from the timing model
+#define _stage(stage, next) stage(core); \
+  core->cycle = timing_cycles(core->timing); \
+  core->state = core->state != TRAP ? next : core->state;
+#else
 #define _stage(stage, next) stage(core); \
   core->cycle++; \
   core->state = core->state != TRAP ? next : core->state;
+#endif
 
 void core_cycle(core_t *core)
 {
@@ -510,3 +1332,731 @@ void core_cycle(core_t *core)
 
 }
 #undef _stage
+
+// Fetch and decode the instruction at pc, unless it is already cached
+static inline const dinstr_t *core_decoded(core_t *core, const vaddr_t pc)
+{
+  dinstr_t *d = &core->dcache[DCACHE_INDEX(pc)];
+  if(__builtin_expect(d->pc == pc, 1)) {
+    return d;
+  }
+
+  if((pc & 1) != 0) {
+    cause_trap(core, INSTRUCTION_ADDR_MISALIGN);
+    return NULL;
+  }
+  uint32_t instruction;
+  if(core->tlb->fetch && !fetch_translate(core, pc)) {
+    return NULL;
+  }
+  if(!read_instruction(core, pc, &instruction)) {
+    cause_trap(core, INSTRUCTION_ACCESS_FAULT);
+    return NULL;
+  }
+  decode_instruction(d, pc, instruction);
+#ifdef CPU_TRACE
+  fprintf(stderr, "cpu::decode pc=0x%08x instr=0x%08x op=0x%04x\n", pc, instruction, d->op);
+#endif
+  return d;
+}
+
+#define RS1 REG_R(d->rs1)
+#define RS2 REG_R(d->rs2)
+
+// Each handler executes a whole instruction (execute, memory and
+// writeback), returning the pc of the next one. On a trap, the pc of the
+// trapping instruction is returned.
+#define OP_HANDLER(name) static vaddr_t op_##name(core_t *core, const dinstr_t *d)
+#define NEXT (d->pc + d->len)
+
+OP_HANDLER(add)   { REG_W(d->rd, RS1 + RS2);                             return NEXT; }
+OP_HANDLER(sub)   { REG_W(d->rd, RS1 - RS2);                             return NEXT; }
+OP_HANDLER(sll)   { REG_W(d->rd, RS1 << (RS2&31));                       return NEXT; }
+OP_HANDLER(slt)   { REG_W(d->rd, (int32_t)RS1 < (int32_t)RS2 ? 1 : 0);   return NEXT; }
+OP_HANDLER(sltu)  { REG_W(d->rd, RS1 < RS2 ? 1 : 0);                     return NEXT; }
+OP_HANDLER(xor)   { REG_W(d->rd, RS1 ^ RS2);                             return NEXT; }
+OP_HANDLER(srl)   { REG_W(d->rd, RS1 >> (RS2&31));                       return NEXT; }
+OP_HANDLER(sra)   { REG_W(d->rd, (uint32_t)((int32_t)RS1 >> (RS2&31))); return NEXT; }
+OP_HANDLER(or)    { REG_W(d->rd, RS1 | RS2);                             return NEXT; }
+OP_HANDLER(and)   { REG_W(d->rd, RS1 & RS2);                             return NEXT; }
+
+OP_HANDLER(mul)    { REG_W(d->rd, RS1 * RS2);                    return NEXT; }
+OP_HANDLER(mulh)   { REG_W(d->rd, rv32m_mulh(RS1, RS2));         return NEXT; }
+OP_HANDLER(mulhsu) { REG_W(d->rd, rv32m_mulhsu(RS1, RS2));       return NEXT; }
+OP_HANDLER(mulhu)  { REG_W(d->rd, rv32m_mulhu(RS1, RS2));        return NEXT; }
+OP_HANDLER(div)    { REG_W(d->rd, rv32m_div(RS1, RS2));          return NEXT; }
+OP_HANDLER(divu)   { REG_W(d->rd, rv32m_divu(RS1, RS2));         return NEXT; }
+OP_HANDLER(rem)    { REG_W(d->rd, rv32m_rem(RS1, RS2));          return NEXT; }
+OP_HANDLER(remu)   { REG_W(d->rd, rv32m_remu(RS1, RS2));         return NEXT; }
+
+OP_HANDLER(sh1add) { REG_W(d->rd, (RS1 << 1) + RS2);                  return NEXT; }
+OP_HANDLER(sh2add) { REG_W(d->rd, (RS1 << 2) + RS2);                  return NEXT; }
+OP_HANDLER(sh3add) { REG_W(d->rd, (RS1 << 3) + RS2);                  return NEXT; }
+OP_HANDLER(andn)   { REG_W(d->rd, RS1 & ~RS2);                        return NEXT; }
+OP_HANDLER(orn)    { REG_W(d->rd, RS1 | ~RS2);                        return NEXT; }
+OP_HANDLER(xnor)   { REG_W(d->rd, ~(RS1 ^ RS2));                      return NEXT; }
+OP_HANDLER(min)    { REG_W(d->rd, (int32_t)RS1 < (int32_t)RS2 ? RS1 : RS2); return NEXT; }
+OP_HANDLER(max)    { REG_W(d->rd, (int32_t)RS1 > (int32_t)RS2 ? RS1 : RS2); return NEXT; }
+OP_HANDLER(minu)   { REG_W(d->rd, RS1 < RS2 ? RS1 : RS2);             return NEXT; }
+OP_HANDLER(maxu)   { REG_W(d->rd, RS1 > RS2 ? RS1 : RS2);             return NEXT; }
+OP_HANDLER(rol)    { REG_W(d->rd, rv32b_rol(RS1, RS2));               return NEXT; }
+OP_HANDLER(ror)    { REG_W(d->rd, rv32b_ror(RS1, RS2));               return NEXT; }
+OP_HANDLER(zext_h) { REG_W(d->rd, RS1 & 0xffff);                      return NEXT; }
+OP_HANDLER(rori)   { REG_W(d->rd, rv32b_ror(RS1, d->imm));            return NEXT; }
+OP_HANDLER(orc_b)  { REG_W(d->rd, rv32b_orcb(RS1));                   return NEXT; }
+OP_HANDLER(rev8)   { REG_W(d->rd, __builtin_bswap32(RS1));            return NEXT; }
+OP_HANDLER(clz)    { REG_W(d->rd, rv32b_clz(RS1));                    return NEXT; }
+OP_HANDLER(ctz)    { REG_W(d->rd, rv32b_ctz(RS1));                    return NEXT; }
+OP_HANDLER(cpop)   { REG_W(d->rd, rv32b_cpop(RS1));                   return NEXT; }
+OP_HANDLER(sext_b) { REG_W(d->rd, (int32_t)(int8_t)RS1);              return NEXT; }
+OP_HANDLER(sext_h) { REG_W(d->rd, (int32_t)(int16_t)RS1);             return NEXT; }
+OP_HANDLER(bclr)   { REG_W(d->rd, RS1 & ~(1u << (RS2 & 31)));         return NEXT; }
+OP_HANDLER(bext)   { REG_W(d->rd, (RS1 >> (RS2 & 31)) & 1);           return NEXT; }
+OP_HANDLER(binv)   { REG_W(d->rd, RS1 ^ (1u << (RS2 & 31)));          return NEXT; }
+OP_HANDLER(bset)   { REG_W(d->rd, RS1 | (1u << (RS2 & 31)));          return NEXT; }
+OP_HANDLER(bclri)  { REG_W(d->rd, RS1 & ~(1u << d->imm));             return NEXT; }
+OP_HANDLER(bexti)  { REG_W(d->rd, (RS1 >> d->imm) & 1);               return NEXT; }
+OP_HANDLER(binvi)  { REG_W(d->rd, RS1 ^ (1u << d->imm));              return NEXT; }
+OP_HANDLER(bseti)  { REG_W(d->rd, RS1 | (1u << d->imm));              return NEXT; }
+
+OP_HANDLER(addi)  { REG_W(d->rd, RS1 + d->imm);                          return NEXT; }
+OP_HANDLER(slti)  { REG_W(d->rd, (int32_t)RS1 < d->imm ? 1 : 0);         return NEXT; }
+OP_HANDLER(sltiu) { REG_W(d->rd, RS1 < (uint32_t)d->imm ? 1 : 0);        return NEXT; }
+OP_HANDLER(xori)  { REG_W(d->rd, RS1 ^ d->imm);                          return NEXT; }
+OP_HANDLER(ori)   { REG_W(d->rd, RS1 | d->imm);                          return NEXT; }
+OP_HANDLER(andi)  { REG_W(d->rd, RS1 & d->imm);                          return NEXT; }
+OP_HANDLER(slli)  { REG_W(d->rd, RS1 << d->imm);                         return NEXT; }
+OP_HANDLER(srli)  { REG_W(d->rd, RS1 >> d->imm);                         return NEXT; }
+OP_HANDLER(srai)  { REG_W(d->rd, (uint32_t)((int32_t)RS1 >> d->imm));   return NEXT; }
+
+OP_HANDLER(lui)   { REG_W(d->rd, d->imm);                                return NEXT; }
+OP_HANDLER(auipc) { REG_W(d->rd, d->pc + d->imm);                        return NEXT; }
+
+#define LOAD(width, ext) uint32_t v;					\
+  if(!core_load(core, RS1 + d->imm, width, &v)) return d->pc;		\
+  REG_W(d->rd, ext);							\
+  return NEXT;
+
+OP_HANDLER(amo) {
+  uint32_t v;
+  if(!core_atomic(core, d, RS1, RS2, &v)) return d->pc;
+  REG_W(d->rd, v);
+  return NEXT;
+}
+
+OP_HANDLER(lb)    { LOAD(BYTE, (int32_t)(int8_t)v) }
+OP_HANDLER(lh)    { LOAD(HALFWORD, (int32_t)(int16_t)v) }
+OP_HANDLER(lw)    { LOAD(WORD, v) }
+OP_HANDLER(lbu)   { LOAD(BYTE, v & 0xff) }
+OP_HANDLER(lhu)   { LOAD(HALFWORD, v & 0xffff) }
+#undef LOAD
+
+#define STORE(width, value)						\
+  if(!core_store(core, RS1 + d->imm, value, width)) return d->pc;	\
+  return NEXT;
+
+OP_HANDLER(sb)    { STORE(BYTE, RS2 & 0xff) }
+OP_HANDLER(sh)    { STORE(HALFWORD, RS2 & 0xffff) }
+OP_HANDLER(sw)    { STORE(WORD, RS2) }
+#undef STORE
+
+OP_HANDLER(beq)   { return RS1 == RS2 ? d->pc + d->imm : NEXT; }
+OP_HANDLER(bne)   { return RS1 != RS2 ? d->pc + d->imm : NEXT; }
+OP_HANDLER(blt)   { return (int32_t)RS1 < (int32_t)RS2 ? d->pc + d->imm : NEXT; }
+OP_HANDLER(bge)   { return (int32_t)RS1 >= (int32_t)RS2 ? d->pc + d->imm : NEXT; }
+OP_HANDLER(bltu)  { return RS1 < RS2 ? d->pc + d->imm : NEXT; }
+OP_HANDLER(bgeu)  { return RS1 >= RS2 ? d->pc + d->imm : NEXT; }
+
+OP_HANDLER(jal)   { REG_W(d->rd, NEXT); return d->pc + d->imm; }
+OP_HANDLER(jalr) {
+  const vaddr_t target = (RS1 + d->imm) & ~1;
+  REG_W(d->rd, NEXT);
+  return target;
+}
+
+OP_HANDLER(ecall) {
+  cause_trap(core, ENV_CALL_UMODE);
+  return d->pc;
+}
+
+// Other harts see memory in order, but the host may reorder plain stores
+// and loads
+OP_HANDLER(fence) {
+  (void)core;
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return NEXT;
+}
+
+// The caches are dropped before the next instruction, see core_sync_code
+OP_HANDLER(fence_i) {
+  core_flush_code(core);
+  return NEXT;
+}
+
+OP_HANDLER(sfence_vma) {
+  if(!core_sfence_vma(core, d, RS1)) return d->pc;
+  return NEXT;
+}
+
+OP_HANDLER(csr) {
+  uint32_t v;
+  if(!core_csr(core, d, RS1, &v)) return d->pc;
+  REG_W(d->rd, v);
+  return NEXT;
+}
+
+// F and D. Registers hold raw bits, see fpu.h for boxing and flags.
+#define FR(x) (core->fregisters[x])
+#define FS(x) fpu_s(FR(d->x))
+#define FD(x) fpu_d(FR(d->x))
+
+// Evaluate expr in the rounding mode of the instruction
+#define FP_ROUNDED(T, expr)						\
+  int restore;								\
+  if(!fpu_round_begin(&core->csr, d->imm, &restore)) {			\
+    cause_trap(core, ILLEGAL_INSTRUCTION);				\
+    return d->pc;							\
+  }									\
+  T r = (expr);								\
+  fpu_round_end(restore, r);
+
+#define FP_OP_S(name, expr) OP_HANDLER(name) { FP_ROUNDED(float, expr) FR(d->rd) = fpu_result_s(r); return NEXT; }
+#define FP_OP_D(name, expr) OP_HANDLER(name) { FP_ROUNDED(double, expr) FR(d->rd) = fpu_result_d(r); return NEXT; }
+
+OP_HANDLER(flw) {
+  uint32_t v;
+  if(!core_load(core, RS1 + d->imm, WORD, &v)) return d->pc;
+  FR(d->rd) = fpu_box_s(v);
+  return NEXT;
+}
+
+OP_HANDLER(fld) {
+  const vaddr_t addr = RS1 + d->imm;
+  uint32_t lo, hi;
+  if(!core_load(core, addr, WORD, &lo) || !core_load(core, addr + 4, WORD, &hi)) return d->pc;
+  FR(d->rd) = ((uint64_t)hi << 32) | lo;
+  return NEXT;
+}
+
+OP_HANDLER(fsw) {
+  if(!core_store(core, RS1 + d->imm, (uint32_t)FR(d->rs2), WORD)) return d->pc;
+  return NEXT;
+}
+
+OP_HANDLER(fsd) {
+  const vaddr_t addr = RS1 + d->imm;
+  if(!core_store(core, addr, (uint32_t)FR(d->rs2), WORD) ||
+     !core_store(core, addr + 4, (uint32_t)(FR(d->rs2) >> 32), WORD)) return d->pc;
+  return NEXT;
+}
+
+FP_OP_S(fadd_s,  FS(rs1) + FS(rs2))
+FP_OP_S(fsub_s,  FS(rs1) - FS(rs2))
+FP_OP_S(fmul_s,  FS(rs1) * FS(rs2))
+FP_OP_S(fdiv_s,  FS(rs1) / FS(rs2))
+FP_OP_S(fsqrt_s, sqrtf(FS(rs1)))
+FP_OP_S(fmadd_s,  fpu_fma_s(&core->csr, FS(rs1), FS(rs2), FS(rs3)))
+FP_OP_S(fmsub_s,  fpu_fma_s(&core->csr, FS(rs1), FS(rs2), -FS(rs3)))
+FP_OP_S(fnmsub_s, fpu_fma_s(&core->csr, -FS(rs1), FS(rs2), FS(rs3)))
+FP_OP_S(fnmadd_s, fpu_fma_s(&core->csr, -FS(rs1), FS(rs2), -FS(rs3)))
+FP_OP_S(fcvt_s_d,  (float)FD(rs1))
+FP_OP_S(fcvt_s_w,  (float)(int32_t)RS1)
+FP_OP_S(fcvt_s_wu, (float)RS1)
+
+FP_OP_D(fadd_d,  FD(rs1) + FD(rs2))
+FP_OP_D(fsub_d,  FD(rs1) - FD(rs2))
+FP_OP_D(fmul_d,  FD(rs1) * FD(rs2))
+FP_OP_D(fdiv_d,  FD(rs1) / FD(rs2))
+FP_OP_D(fsqrt_d, sqrt(FD(rs1)))
+FP_OP_D(fmadd_d,  fpu_fma_d(&core->csr, FD(rs1), FD(rs2), FD(rs3)))
+FP_OP_D(fmsub_d,  fpu_fma_d(&core->csr, FD(rs1), FD(rs2), -FD(rs3)))
+FP_OP_D(fnmsub_d, fpu_fma_d(&core->csr, -FD(rs1), FD(rs2), FD(rs3)))
+FP_OP_D(fnmadd_d, fpu_fma_d(&core->csr, -FD(rs1), FD(rs2), -FD(rs3)))
+FP_OP_D(fcvt_d_s,  (double)FS(rs1))
+FP_OP_D(fcvt_d_w,  (double)(int32_t)RS1)
+FP_OP_D(fcvt_d_wu, (double)RS1)
+
+#define FSGNJ_S(expr) const uint32_t a = fpu_bits_s(FR(d->rs1)), b = fpu_bits_s(FR(d->rs2)); \
+  FR(d->rd) = fpu_box_s((a & 0x7fffffff) | ((expr) & 0x80000000)); return NEXT;
+#define FSGNJ_D(expr) const uint64_t a = FR(d->rs1), b = FR(d->rs2);	\
+  FR(d->rd) = (a & 0x7fffffffffffffffull) | ((expr) & 0x8000000000000000ull); return NEXT;
+
+OP_HANDLER(fsgnj_s)  { FSGNJ_S(b) }
+OP_HANDLER(fsgnjn_s) { FSGNJ_S(~b) }
+OP_HANDLER(fsgnjx_s) { FSGNJ_S(a ^ b) }
+OP_HANDLER(fsgnj_d)  { FSGNJ_D(b) }
+OP_HANDLER(fsgnjn_d) { FSGNJ_D(~b) }
+OP_HANDLER(fsgnjx_d) { FSGNJ_D(a ^ b) }
+#undef FSGNJ_S
+#undef FSGNJ_D
+
+OP_HANDLER(fmin_s) { FR(d->rd) = fpu_min_s(&core->csr, FR(d->rs1), FR(d->rs2), false); return NEXT; }
+OP_HANDLER(fmax_s) { FR(d->rd) = fpu_min_s(&core->csr, FR(d->rs1), FR(d->rs2), true);  return NEXT; }
+OP_HANDLER(fmin_d) { FR(d->rd) = fpu_min_d(&core->csr, FR(d->rs1), FR(d->rs2), false); return NEXT; }
+OP_HANDLER(fmax_d) { FR(d->rd) = fpu_min_d(&core->csr, FR(d->rs1), FR(d->rs2), true);  return NEXT; }
+
+// funct3 of the compares is bits 7-9 of the key
+OP_HANDLER(fcmp_s) { REG_W(d->rd, fpu_cmp_s(&core->csr, FR(d->rs1), FR(d->rs2), (d->op >> 7) & 7)); return NEXT; }
+OP_HANDLER(fcmp_d) { REG_W(d->rd, fpu_cmp_d(&core->csr, FR(d->rs1), FR(d->rs2), (d->op >> 7) & 7)); return NEXT; }
+OP_HANDLER(fclass_s) { REG_W(d->rd, fpu_class_s(FR(d->rs1))); return NEXT; }
+OP_HANDLER(fclass_d) { REG_W(d->rd, fpu_class_d(FR(d->rs1))); return NEXT; }
+OP_HANDLER(fmv_x_w)  { REG_W(d->rd, (uint32_t)FR(d->rs1));    return NEXT; }
+OP_HANDLER(fmv_w_x)  { FR(d->rd) = fpu_box_s(RS1);            return NEXT; }
+
+// FCVT.W[U]: bit 0 of the key funct3 is unsigned
+#define FCVT_W(value)							\
+  const int rm = fpu_rm(&core->csr, d->imm);				\
+  if(rm < 0) {								\
+    cause_trap(core, ILLEGAL_INSTRUCTION);				\
+    return d->pc;							\
+  }									\
+  REG_W(d->rd, fpu_to_int(&core->csr, value, rm, !((d->op >> 7) & 1))); \
+  return NEXT;
+
+OP_HANDLER(fcvt_w_s) { FCVT_W(FS(rs1)) }
+OP_HANDLER(fcvt_w_d) { FCVT_W(FD(rs1)) }
+#undef FCVT_W
+#undef FP_OP_S
+#undef FP_OP_D
+#undef FP_ROUNDED
+#undef FS
+#undef FD
+#undef FR
+
+// V, see vector.c. The vector unit traps by itself, the handlers only
+// move x registers in and out.
+OP_HANDLER(vsetvl) { REG_W(d->rd, vector_setvl(core, d, RS1, RS2)); return NEXT; }
+OP_HANDLER(varith) { return vector_arith(core, d, RS1) ? NEXT : d->pc; }
+OP_HANDLER(vload)  { return vector_load(core, d, RS1, RS2) ? NEXT : d->pc; }
+OP_HANDLER(vstore) { return vector_store(core, d, RS1, RS2) ? NEXT : d->pc; }
+
+OP_HANDLER(vmv_x) {
+  uint32_t v;
+  if(!vector_to_x(core, d, &v)) return d->pc;
+  REG_W(d->rd, v);
+  return NEXT;
+}
+
+OP_HANDLER(illegal) {
+  fprintf(stderr, "cpu:%d:step i=0x%08x: unknown opcode=0x%08x optype=%x, pc=0x%08x\n", core->id, d->instruction, d->instruction & 0x7f, d->optype, d->pc);
+  cause_trap(core, ILLEGAL_INSTRUCTION);
+  return d->pc;
+}
+
+#ifndef CPU_RETIRE_HOOKS
+// Fused pairs, see fusion_t, which only the block engine makes. D2 is
+// the second half, which has its own pc, so a trap in it is reported there
+// with the first half retired.
+#define D2 (&d[1])
+#define NEXT2 (D2->pc + D2->len)
+
+OP_HANDLER(fuse_li) { REG_W(d->rd, d->imm + D2->imm); return NEXT2; }
+
+OP_HANDLER(fuse_call) {
+  const vaddr_t t = d->pc + d->imm;
+  REG_W(d->rd, t);
+  REG_W(D2->rd, NEXT2);
+  return (t + D2->imm) & ~1;
+}
+
+OP_HANDLER(fuse_loadpc) {
+  const vaddr_t t = d->pc + d->imm;
+  uint32_t v;
+  REG_W(d->rd, t);
+  if(!core_load(core, t + D2->imm, WORD, &v)) return D2->pc;
+  REG_W(D2->rd, v);
+  return NEXT2;
+}
+
+OP_HANDLER(fuse_zext) { REG_W(d->rd, (RS1 << d->imm) >> D2->imm); return NEXT2; }
+OP_HANDLER(fuse_sext) { REG_W(d->rd, (uint32_t)((int32_t)(RS1 << d->imm) >> D2->imm)); return NEXT2; }
+
+#define CMP_BRANCH(cmp)							\
+  (void)op_##cmp(core, d);						\
+  return (REG_R(d->rd) != 0) == (D2->op == OP_BNE) ? D2->pc + D2->imm : NEXT2;
+
+OP_HANDLER(fuse_slt)   { CMP_BRANCH(slt) }
+OP_HANDLER(fuse_sltu)  { CMP_BRANCH(sltu) }
+OP_HANDLER(fuse_slti)  { CMP_BRANCH(slti) }
+OP_HANDLER(fuse_sltiu) { CMP_BRANCH(sltiu) }
+#undef CMP_BRANCH
+
+#undef NEXT2
+#undef D2
+#endif
+#undef NEXT
+#undef OP_HANDLER
+#undef RS1
+#undef RS2
+
+// opcode_t -> handler, shared by the switch and the threaded dispatch
+#define CPU_OPS(X)							\
+  X(OP_ADD, add) X(OP_SUB, sub) X(OP_SLL, sll) X(OP_SLT, slt)		\
+  X(OP_SLTU, sltu) X(OP_XOR, xor) X(OP_SRL, srl) X(OP_SRA, sra)	\
+  X(OP_OR, or) X(OP_AND, and)						\
+  X(OP_MUL, mul) X(OP_MULH, mulh) X(OP_MULHSU, mulhsu) X(OP_MULHU, mulhu) \
+  X(OP_DIV, div) X(OP_DIVU, divu) X(OP_REM, rem) X(OP_REMU, remu)	\
+  X(OP_LR_W, amo) X(OP_SC_W, amo) X(OP_AMOSWAP_W, amo) X(OP_AMOADD_W, amo) \
+  X(OP_AMOXOR_W, amo) X(OP_AMOAND_W, amo) X(OP_AMOOR_W, amo)		\
+  X(OP_AMOMIN_W, amo) X(OP_AMOMAX_W, amo) X(OP_AMOMINU_W, amo)		\
+  X(OP_AMOMAXU_W, amo)							\
+  X(OP_SH1ADD, sh1add) X(OP_SH2ADD, sh2add) X(OP_SH3ADD, sh3add)	\
+  X(OP_ANDN, andn) X(OP_ORN, orn) X(OP_XNOR, xnor)			\
+  X(OP_MIN, min) X(OP_MAX, max) X(OP_MINU, minu) X(OP_MAXU, maxu)	\
+  X(OP_ROL, rol) X(OP_ROR, ror) X(OP_ZEXT_H, zext_h) X(OP_RORI, rori)	\
+  X(OP_ORC_B, orc_b) X(OP_REV8, rev8)					\
+  X(OP_CLZ, clz) X(OP_CTZ, ctz) X(OP_CPOP, cpop)			\
+  X(OP_SEXT_B, sext_b) X(OP_SEXT_H, sext_h)				\
+  X(OP_BCLR, bclr) X(OP_BEXT, bext) X(OP_BINV, binv) X(OP_BSET, bset)	\
+  X(OP_BCLRI, bclri) X(OP_BEXTI, bexti) X(OP_BINVI, binvi) X(OP_BSETI, bseti) \
+  X(OP_ADDI, addi) X(OP_SLTI, slti) X(OP_SLTIU, sltiu) X(OP_XORI, xori)	\
+  X(OP_ORI, ori) X(OP_ANDI, andi) X(OP_SLLI, slli) X(OP_SRLI, srli)	\
+  X(OP_SRAI, srai)							\
+  X(OP_LUI, lui) X(OP_AUIPC, auipc)					\
+  X(OP_LB, lb) X(OP_LH, lh) X(OP_LW, lw) X(OP_LBU, lbu) X(OP_LHU, lhu)	\
+  X(OP_SB, sb) X(OP_SH, sh) X(OP_SW, sw)				\
+  X(OP_BEQ, beq) X(OP_BNE, bne) X(OP_BLT, blt) X(OP_BGE, bge)		\
+  X(OP_BLTU, bltu) X(OP_BGEU, bgeu)					\
+  X(OP_JAL, jal) X(OP_JALR, jalr)					\
+  X(OP_FLW, flw) X(OP_FLD, fld) X(OP_FSW, fsw) X(OP_FSD, fsd)		\
+  X(OP_FADD_S, fadd_s) X(OP_FSUB_S, fsub_s) X(OP_FMUL_S, fmul_s)	\
+  X(OP_FDIV_S, fdiv_s) X(OP_FSQRT_S, fsqrt_s)				\
+  X(OP_FMADD_S, fmadd_s) X(OP_FMSUB_S, fmsub_s)				\
+  X(OP_FNMSUB_S, fnmsub_s) X(OP_FNMADD_S, fnmadd_s)			\
+  X(OP_FSGNJ_S, fsgnj_s) X(OP_FSGNJN_S, fsgnjn_s) X(OP_FSGNJX_S, fsgnjx_s) \
+  X(OP_FMIN_S, fmin_s) X(OP_FMAX_S, fmax_s)				\
+  X(OP_FEQ_S, fcmp_s) X(OP_FLT_S, fcmp_s) X(OP_FLE_S, fcmp_s)		\
+  X(OP_FCLASS_S, fclass_s) X(OP_FMV_X_W, fmv_x_w) X(OP_FMV_W_X, fmv_w_x) \
+  X(OP_FCVT_W_S, fcvt_w_s) X(OP_FCVT_WU_S, fcvt_w_s)			\
+  X(OP_FCVT_S_W, fcvt_s_w) X(OP_FCVT_S_WU, fcvt_s_wu) X(OP_FCVT_S_D, fcvt_s_d) \
+  X(OP_FADD_D, fadd_d) X(OP_FSUB_D, fsub_d) X(OP_FMUL_D, fmul_d)	\
+  X(OP_FDIV_D, fdiv_d) X(OP_FSQRT_D, fsqrt_d)				\
+  X(OP_FMADD_D, fmadd_d) X(OP_FMSUB_D, fmsub_d)				\
+  X(OP_FNMSUB_D, fnmsub_d) X(OP_FNMADD_D, fnmadd_d)			\
+  X(OP_FSGNJ_D, fsgnj_d) X(OP_FSGNJN_D, fsgnjn_d) X(OP_FSGNJX_D, fsgnjx_d) \
+  X(OP_FMIN_D, fmin_d) X(OP_FMAX_D, fmax_d)				\
+  X(OP_FEQ_D, fcmp_d) X(OP_FLT_D, fcmp_d) X(OP_FLE_D, fcmp_d)		\
+  X(OP_FCLASS_D, fclass_d)						\
+  X(OP_FCVT_W_D, fcvt_w_d) X(OP_FCVT_WU_D, fcvt_w_d)			\
+  X(OP_FCVT_D_W, fcvt_d_w) X(OP_FCVT_D_WU, fcvt_d_wu) X(OP_FCVT_D_S, fcvt_d_s) \
+  X(OP_VSETVLI, vsetvl) X(OP_VSETIVLI, vsetvl) X(OP_VSETVL, vsetvl)	\
+  X(OP_VLE8, vload) X(OP_VLE16, vload) X(OP_VLE32, vload) X(OP_VLM, vload) \
+  X(OP_VL8R, vload) X(OP_VL16R, vload) X(OP_VL32R, vload)		\
+  X(OP_VLSE8, vload) X(OP_VLSE16, vload) X(OP_VLSE32, vload)		\
+  X(OP_VSE8, vstore) X(OP_VSE16, vstore) X(OP_VSE32, vstore)		\
+  X(OP_VSM, vstore) X(OP_VSR, vstore)					\
+  X(OP_VSSE8, vstore) X(OP_VSSE16, vstore) X(OP_VSSE32, vstore)	\
+  X(OP_VADD_VV, varith) X(OP_VADD_VX, varith) X(OP_VADD_VI, varith)	\
+  X(OP_VSUB_VV, varith) X(OP_VSUB_VX, varith)				\
+  X(OP_VRSUB_VX, varith) X(OP_VRSUB_VI, varith)			\
+  X(OP_VMINU_VV, varith) X(OP_VMINU_VX, varith)			\
+  X(OP_VMIN_VV, varith) X(OP_VMIN_VX, varith)				\
+  X(OP_VMAXU_VV, varith) X(OP_VMAXU_VX, varith)			\
+  X(OP_VMAX_VV, varith) X(OP_VMAX_VX, varith)				\
+  X(OP_VAND_VV, varith) X(OP_VAND_VX, varith) X(OP_VAND_VI, varith)	\
+  X(OP_VOR_VV, varith) X(OP_VOR_VX, varith) X(OP_VOR_VI, varith)	\
+  X(OP_VXOR_VV, varith) X(OP_VXOR_VX, varith) X(OP_VXOR_VI, varith)	\
+  X(OP_VMERGE_VV, varith) X(OP_VMERGE_VX, varith) X(OP_VMERGE_VI, varith) \
+  X(OP_VMSEQ_VV, varith) X(OP_VMSEQ_VX, varith) X(OP_VMSEQ_VI, varith)	\
+  X(OP_VMSNE_VV, varith) X(OP_VMSNE_VX, varith) X(OP_VMSNE_VI, varith)	\
+  X(OP_VMSLTU_VV, varith) X(OP_VMSLTU_VX, varith)			\
+  X(OP_VMSLT_VV, varith) X(OP_VMSLT_VX, varith)			\
+  X(OP_VMSLEU_VV, varith) X(OP_VMSLEU_VX, varith) X(OP_VMSLEU_VI, varith) \
+  X(OP_VMSLE_VV, varith) X(OP_VMSLE_VX, varith) X(OP_VMSLE_VI, varith)	\
+  X(OP_VMSGTU_VX, varith) X(OP_VMSGTU_VI, varith)			\
+  X(OP_VMSGT_VX, varith) X(OP_VMSGT_VI, varith)			\
+  X(OP_VSADDU_VV, varith) X(OP_VSADDU_VX, varith) X(OP_VSADDU_VI, varith) \
+  X(OP_VSADD_VV, varith) X(OP_VSADD_VX, varith) X(OP_VSADD_VI, varith)	\
+  X(OP_VSSUBU_VV, varith) X(OP_VSSUBU_VX, varith)			\
+  X(OP_VSSUB_VV, varith) X(OP_VSSUB_VX, varith)			\
+  X(OP_VSLL_VV, varith) X(OP_VSLL_VX, varith) X(OP_VSLL_VI, varith)	\
+  X(OP_VSRL_VV, varith) X(OP_VSRL_VX, varith) X(OP_VSRL_VI, varith)	\
+  X(OP_VSRA_VV, varith) X(OP_VSRA_VX, varith) X(OP_VSRA_VI, varith)	\
+  X(OP_VMVR, varith)							\
+  X(OP_VREDSUM, varith) X(OP_VREDAND, varith) X(OP_VREDOR, varith)	\
+  X(OP_VREDXOR, varith) X(OP_VREDMINU, varith) X(OP_VREDMIN, varith)	\
+  X(OP_VREDMAXU, varith) X(OP_VREDMAX, varith)				\
+  X(OP_VWXUNARY0, vmv_x) X(OP_VRXUNARY0, varith) X(OP_VMUNARY0, varith) \
+  X(OP_VMANDN, varith) X(OP_VMAND, varith) X(OP_VMOR, varith)		\
+  X(OP_VMXOR, varith) X(OP_VMORN, varith) X(OP_VMNAND, varith)		\
+  X(OP_VMNOR, varith) X(OP_VMXNOR, varith)				\
+  X(OP_VDIVU_VV, varith) X(OP_VDIVU_VX, varith)			\
+  X(OP_VDIV_VV, varith) X(OP_VDIV_VX, varith)				\
+  X(OP_VREMU_VV, varith) X(OP_VREMU_VX, varith)			\
+  X(OP_VREM_VV, varith) X(OP_VREM_VX, varith)				\
+  X(OP_VMULHU_VV, varith) X(OP_VMULHU_VX, varith)			\
+  X(OP_VMUL_VV, varith) X(OP_VMUL_VX, varith)				\
+  X(OP_VMULHSU_VV, varith) X(OP_VMULHSU_VX, varith)			\
+  X(OP_VMULH_VV, varith) X(OP_VMULH_VX, varith)			\
+  X(OP_VMADD_VV, varith) X(OP_VMADD_VX, varith)			\
+  X(OP_VNMSUB_VV, varith) X(OP_VNMSUB_VX, varith)			\
+  X(OP_VMACC_VV, varith) X(OP_VMACC_VX, varith)			\
+  X(OP_VNMSAC_VV, varith) X(OP_VNMSAC_VX, varith)			\
+  X(OP_CSRRW, csr) X(OP_CSRRS, csr) X(OP_CSRRC, csr)			\
+  X(OP_CSRRWI, csr) X(OP_CSRRSI, csr) X(OP_CSRRCI, csr)		\
+  X(OP_ECALL, ecall) X(OP_SFENCE_VMA, sfence_vma)			\
+  X(OP_FENCE, fence) X(OP_FENCE_I, fence_i)
+
+// fusion_t -> handler
+#define CPU_FUSED_OPS(X)						\
+  X(FUSE_LI, fuse_li) X(FUSE_CALL, fuse_call) X(FUSE_LOADPC, fuse_loadpc) \
+  X(FUSE_ZEXT, fuse_zext) X(FUSE_SEXT, fuse_sext)			\
+  X(FUSE_SLT, fuse_slt) X(FUSE_SLTU, fuse_sltu)				\
+  X(FUSE_SLTI, fuse_slti) X(FUSE_SLTIU, fuse_sltiu)
+
+// Resolved once per decode, so threaded dispatch is a single indirect call
+static dinstr_handler_t resolve_handler(const opcode_t op)
+{
+  switch(op) {
+#define X(op, name) case op: return op_##name;
+    CPU_OPS(X)
+#undef X
+  default: return op_illegal;
+  }
+}
+
+#ifndef CPU_THREADED_DISPATCH
+// Switch based dispatch, every handler inlined into one jump table
+static inline vaddr_t core_step(core_t *core, const dinstr_t *d)
+{
+#ifndef CPU_RETIRE_HOOKS
+  switch(d->fused) {
+  case FUSE_NONE: break;
+#define X(f, name) case f: return op_##name(core, d);
+    CPU_FUSED_OPS(X)
+#undef X
+  }
+#endif
+  switch(d->op) {
+#define X(op, name) case op: return op_##name(core, d);
+    CPU_OPS(X)
+#undef X
+  default: return op_illegal(core, d);
+  }
+}
+#endif
+
+#ifdef CPU_THREADED_DISPATCH
+#define DISPATCH(core, d) (d)->handler(core, d)
+#else
+#define DISPATCH(core, d) core_step(core, d)
+#endif
+
+// Run whole instructions until a trap or until budget instructions have
+// retired. Returns the number of retired instructions.
+static uint64_t core_run_instructions(core_t *core, const uint64_t budget)
+{
+  vaddr_t pc = core->pc;
+  uint64_t n = 0;
+
+  while(n < budget) {
+    core_sync_code(core);
+    const dinstr_t *d = core_decoded(core, pc);
+    if(d == NULL) {
+      break;
+    }
+    const vaddr_t next = DISPATCH(core, d);
+    if(core->state == TRAP) {
+      break;
+    }
+#ifdef CPU_RETIRE_HOOKS
+    core_retired(core, d, next);
+#endif
+    pc = next;
+    n++;
+  }
+
+  core->pc = pc;
+  core->instret += n;
+#ifdef CPU_TIMING
+  core->cycle = timing_cycles(core->timing);
+#else
+  core->cycle += n * 5; // five stages per instruction, as in core_cycle()
+#endif
+  return n;
+}
+
+#ifndef CPU_RETIRE_HOOKS
+// Does this instruction end a basic block?
+static inline bool block_terminator(const dinstr_t *d)
+{
+  return d->optype == B || d->optype == J || (d->optype == C && d->op != OP_FENCE) ||
+    d->optype == Unknown || d->op == OP_JALR;
+}
+
+// Can a and the instruction following it run as one fused pair?
+static fusion_t fuse_pair(const dinstr_t *a, const dinstr_t *b)
+{
+  if(a->rd == 0 || b->rs1 != a->rd) {
+    return FUSE_NONE;
+  }
+  switch(a->op) {
+  case OP_LUI:
+    return b->op == OP_ADDI && b->rd == a->rd ? FUSE_LI : FUSE_NONE;
+  case OP_AUIPC:
+    return b->op == OP_JALR ? FUSE_CALL : b->op == OP_LW ? FUSE_LOADPC : FUSE_NONE;
+  case OP_SLLI:
+    if(b->rd != a->rd) {
+      return FUSE_NONE;
+    }
+    return b->op == OP_SRLI ? FUSE_ZEXT : b->op == OP_SRAI ? FUSE_SEXT : FUSE_NONE;
+  case OP_SLT:
+  case OP_SLTU:
+  case OP_SLTI:
+  case OP_SLTIU:
+    if((b->op != OP_BEQ && b->op != OP_BNE) || b->rs2 != 0) {
+      return FUSE_NONE;
+    }
+    return a->op == OP_SLT ? FUSE_SLT : a->op == OP_SLTU ? FUSE_SLTU :
+      a->op == OP_SLTI ? FUSE_SLTI : FUSE_SLTIU;
+  default:
+    return FUSE_NONE;
+  }
+}
+
+static dinstr_handler_t fused_handler(const fusion_t f)
+{
+  switch(f) {
+#define X(f, name) case f: return op_##name;
+    CPU_FUSED_OPS(X)
+#undef X
+  default: return NULL;
+  }
+}
+
+// Translate the basic block starting at pc into the block cache
+static dblock_t *block_translate(core_t *core, const vaddr_t pc)
+{
+  const dinstr_t *d = core_decoded(core, pc);
+  if(d == NULL) {
+    return NULL; // trap on the very first instruction
+  }
+
+  dblock_t *b = &core->blocks[BLOCK_INDEX(pc)];
+  b->pc = pc;
+  b->count = 0;
+  b->next[0] = b->next[1] = NULL;
+  b->native = NULL;
+  b->native_count = 0;
+  b->hits = 0;
+
+  vaddr_t next = pc;
+  while(true) {
+    b->instrs[b->count++] = *d;
+    next += d->len;
+    if(block_terminator(d) ||
+       b->count == BLOCK_MAX_INSTRS ||
+       (next >> CODE_PAGE_SHIFT) != (pc >> CODE_PAGE_SHIFT)) {
+      break;
+    }
+    // Peek without trapping, a fault ends the block instead
+    dinstr_t *nd = &core->dcache[DCACHE_INDEX(next)];
+    if(nd->pc != next) {
+      uint32_t instruction;
+      if(!read_instruction(core, next, &instruction)) {
+	break;
+      }
+      decode_instruction(nd, next, instruction);
+    }
+    d = nd;
+  }
+  b->end = next;
+  for(uint32_t i=0; i+1 < b->count; i++) {
+    dinstr_t *f = &b->instrs[i];
+    f->fused = fuse_pair(f, f + 1);
+    if(f->fused != FUSE_NONE) {
+      f->handler = fused_handler(f->fused);
+      i++;
+    }
+  }
+  for(vaddr_t chunk = pc >> CODE_CHUNK_SHIFT; chunk <= (next - 1) >> CODE_CHUNK_SHIFT; chunk++) {
+    CODE_CHUNK_SET(core, chunk);
+  }
+
+#ifdef CPU_TRACE
+  fprintf(stderr, "cpu::block_translate pc=0x%08x count=%u\n", pc, b->count);
+#endif
+  return b;
+}
+
+static inline dblock_t *block_lookup(core_t *core, const vaddr_t pc)
+{
+  dblock_t *b = &core->blocks[BLOCK_INDEX(pc)];
+  if(__builtin_expect(b->pc == pc, 1)) {
+    return b;
+  }
+  return block_translate(core, pc);
+}
+
+// Run cached basic blocks, chaining from each block directly to its
+// successor. Counters, pc and the budget are only updated per block.
+static uint64_t core_run_blocks(core_t *core, const uint64_t budget)
+{
+  uint64_t n = 0;
+  vaddr_t pc = core->pc;
+  core_sync_code(core);
+  dblock_t *b = block_lookup(core, pc);
+
+  while(b != NULL) {
+    const dinstr_t *d = b->instrs;
+    const dinstr_t *last = d + b->count - 1;
+
+#ifdef CPU_JIT
+    if(b->native == NULL && b->hits++ == JIT_THRESHOLD) {
+      (void)jit_translate(core, b);
+    }
+    if(b->native != NULL) {
+      // Native code either runs the whole block, stops before an
+      // instruction it left to us, or returns the pc of a trapping one
+      pc = b->native(core);
+      if(core->state != TRAP && b->native_count < b->count) {
+	pc = DISPATCH(core, last);
+      }
+    } else
+#endif
+    {
+      // Everything but the last instruction (or fused pair) falls
+      // through, anything else means the instruction trapped
+      do {
+	pc = DISPATCH(core, d);
+	d += 1 + (d->fused != FUSE_NONE);
+      } while(d <= last && __builtin_expect(pc == d->pc, 1));
+    }
+    if(core->state == TRAP) {
+      for(d = b->instrs; d < last && d->pc != pc; d++) {
+	n++; // retired in front of the trapping instruction
+      }
+      break;
+    }
+    n += b->count;
+    if(n >= budget) {
+      break;
+    }
+
+    core_sync_code(core);
+    const int taken = pc != b->end;
+    dblock_t *next = b->next[taken];
+    if(next == NULL || next->pc != pc) {
+      next = block_lookup(core, pc);
+      b->next[taken] = next;
+    }
+    b = next;
+  }
+
+  core->pc = pc;
+  core->instret += n;
+  core->cycle += n * 5; // five stages per instruction, as in core_cycle()
+  return n;
+}
+#endif
+
+uint64_t core_run(core_t *core, const uint64_t budget)
+{
+  assert(core->state == FETCH);
+#ifndef CPU_RETIRE_HOOKS
+  if(core->engine == ENGINE_BLOCK) {
+    return core_run_blocks(core, budget);
+  }
+#endif
+  return core_run_instructions(core, budget);
+}
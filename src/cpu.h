@@ -28,6 +28,8 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "config.h"
 #include "bus.h"
 #include "csr.h"
+#include "mmu.h"
+#include "vector.h"
 
 typedef enum __attribute__((packed)) _optype_t {
   Unknown = 0,
@@ -37,7 +39,8 @@ typedef enum __attribute__((packed)) _optype_t {
   B = 4,
   U = 5,
   J = 6,
-  C = 7    // System (CSR*)
+  C = 7,   // System (CSR*)
+  V = 8    // OP-V, and vector loads/stores
 } optype_t;
 
 typedef enum _csr_instruction_type_t {
@@ -57,7 +60,7 @@ static const optype_t decode_type_table[128] = {
   /*0000100 */ Unknown,
   /*0000101 */ Unknown,
   /*0000110 */ Unknown,
-  /*0000111 */ Unknown,
+  /*0000111 = FLW/FLD */ I,
   /*0001000 */ Unknown,
   /*0001001 */ Unknown,
   /*0001010 */ Unknown,
@@ -65,7 +68,7 @@ static const optype_t decode_type_table[128] = {
   /*0001100 */ Unknown,
   /*0001101 */ Unknown,
   /*0001110 */ Unknown,
-  /*0001111 */ Unknown,
+  /*0001111 = FENCE/FENCE.I */ C,
   /*0010000 */ Unknown,
   /*0010001 */ Unknown,
   /*0010010 */ Unknown,
@@ -89,7 +92,7 @@ static const optype_t decode_type_table[128] = {
   /*0100100 */ Unknown,
   /*0100101 */ Unknown,
   /*0100110 */ Unknown,
-  /*0100111 */ Unknown,
+  /*0100111 = FSW/FSD */ S,
   /*0101000 */ Unknown,
   /*0101001 */ Unknown,
   /*0101010 */ Unknown,
@@ -97,7 +100,7 @@ static const optype_t decode_type_table[128] = {
   /*0101100 */ Unknown,
   /*0101101 */ Unknown,
   /*0101110 */ Unknown,
-  /*0101111 */ Unknown,
+  /*0101111 AMO */ R,
   /*0110000 */ Unknown,
   /*0110001 */ Unknown,
   /*0110010 */ Unknown,
@@ -117,27 +120,27 @@ static const optype_t decode_type_table[128] = {
   /*1000000 */ Unknown,
   /*1000001 */ Unknown,
   /*1000010 */ Unknown,
-  /*1000011 */ Unknown,
+  /*1000011 = FMADD */ R,
   /*1000100 */ Unknown,
   /*1000101 */ Unknown,
   /*1000110 */ Unknown,
-  /*1000111 */ Unknown,
+  /*1000111 = FMSUB */ R,
   /*1001000 */ Unknown,
   /*1001001 */ Unknown,
   /*1001010 */ Unknown,
-  /*1001011 */ Unknown,
+  /*1001011 = FNMSUB */ R,
   /*1001100 */ Unknown,
   /*1001101 */ Unknown,
   /*1001110 */ Unknown,
-  /*1001111 */ Unknown,
+  /*1001111 = FNMADD */ R,
   /*1010000 */ Unknown,
   /*1010001 */ Unknown,
   /*1010010 */ Unknown,
-  /*1010011 */ Unknown,
+  /*1010011 = OP-FP */ R,
   /*1010100 */ Unknown,
   /*1010101 */ Unknown,
   /*1010110 */ Unknown,
-  /*1010111 */ Unknown,
+  /*1010111 = OP-V */ V,
   /*1011000 */ Unknown,
   /*1011001 */ Unknown,
   /*1011010 */ Unknown,
@@ -183,9 +186,32 @@ static const optype_t decode_type_table[128] = {
 // RV32I Base Instruction Set
 
 // bits  0-6:  opcode
-// bits  7-10: func3
-// bit   11: bit 5 of func7
-#define _OP(opcode, funct3, funct7) ((opcode | (funct3 << 7) | (funct7 << 11)))
+// bits  7-9:  func3
+// bit   10:   fmt, set for D
+// bits 11-14: func7 bits 5, 0, 4 and 2, see FUNCT7_KEY
+// bit   15: Zbb unary op (CLZ, CTZ, CPOP, SEXT), bits 11-14 then hold rs2
+// bits 11-15: funct5 for AMO
+#define _OP(opcode, funct3, funct7) ((opcode | (funct3 << 7) | ((funct7) << 11)))
+
+// The func7 bits that tell the base set, M, Zba, Zbb and Zbs apart. Bit 5
+// alone is SUB/SRA, bit 0 alone is M.
+#define FUNCT7_KEY(f7) ((((f7) >> 5) & 1) | (((f7) & 1) << 1) | ((((f7) >> 4) & 1) << 2) | ((((f7) >> 2) & 1) << 3))
+#define FUNCT7_UNARY   0x10
+// Every funct7 that the key tells apart sits in these bits. One with any
+// other bit set is reserved and must not alias a defined op.
+#define FUNCT7_KEY_BITS 0b0110101
+
+// F/D: funct3 is the rounding mode, and only part of the key where it picks
+// a variant (FSGNJ*, FMIN/FMAX, compares, FMV/FCLASS). For conversions to
+// and from integers it holds bit 0 of rs2, unsigned.
+#define _FP(opcode, funct3, fmt, funct5) ((opcode | (funct3 << 7) | (fmt << 10) | (funct5 << 11)))
+
+// V: funct3 picks the operand form (OPIVV, OPMVX, ...), bit 10 is the top
+// bit of funct6 and bits 11-15 the rest. Vector loads and stores share
+// LOAD-FP/STORE-FP with their width in funct3, mop in bits 11-12 and the
+// unit-stride variant (0 plain, 1 mask, 2 whole register) in bits 13-14.
+#define _V(funct3, funct6) ((0b1010111 | (funct3 << 7) | (((funct6) >> 5) << 10) | (((funct6) & 0x1f) << 11)))
+#define _VMEM(opcode, width, mop, kind) ((opcode | (width << 7) | (mop << 11) | (kind << 13)))
 
 typedef enum __attribute((packed)) _opcode_t {
   OP_NONE = 0,
@@ -235,8 +261,196 @@ typedef enum __attribute((packed)) _opcode_t {
     OP_OR = _OP(0b0110011, 0b110, 0),
     OP_AND = _OP(0b0110011, 0b111, 0),
 
+    // RV32M
+    OP_MUL = _OP(0b0110011, 0b000, 0b10),
+    OP_MULH = _OP(0b0110011, 0b001, 0b10),
+    OP_MULHSU = _OP(0b0110011, 0b010, 0b10),
+    OP_MULHU = _OP(0b0110011, 0b011, 0b10),
+    OP_DIV = _OP(0b0110011, 0b100, 0b10),
+    OP_DIVU = _OP(0b0110011, 0b101, 0b10),
+    OP_REM = _OP(0b0110011, 0b110, 0b10),
+    OP_REMU = _OP(0b0110011, 0b111, 0b10),
+
+    // Zba
+    OP_SH1ADD = _OP(0b0110011, 0b010, FUNCT7_KEY(0b0010000)),
+    OP_SH2ADD = _OP(0b0110011, 0b100, FUNCT7_KEY(0b0010000)),
+    OP_SH3ADD = _OP(0b0110011, 0b110, FUNCT7_KEY(0b0010000)),
+
+    // Zbb
+    OP_ANDN = _OP(0b0110011, 0b111, FUNCT7_KEY(0b0100000)),
+    OP_ORN = _OP(0b0110011, 0b110, FUNCT7_KEY(0b0100000)),
+    OP_XNOR = _OP(0b0110011, 0b100, FUNCT7_KEY(0b0100000)),
+    OP_MIN = _OP(0b0110011, 0b100, FUNCT7_KEY(0b0000101)),
+    OP_MINU = _OP(0b0110011, 0b101, FUNCT7_KEY(0b0000101)),
+    OP_MAX = _OP(0b0110011, 0b110, FUNCT7_KEY(0b0000101)),
+    OP_MAXU = _OP(0b0110011, 0b111, FUNCT7_KEY(0b0000101)),
+    OP_ROL = _OP(0b0110011, 0b001, FUNCT7_KEY(0b0110000)),
+    OP_ROR = _OP(0b0110011, 0b101, FUNCT7_KEY(0b0110000)),
+    OP_ZEXT_H = _OP(0b0110011, 0b100, FUNCT7_KEY(0b0000100)),
+    OP_RORI = _OP(0b0010011, 0b101, FUNCT7_KEY(0b0110000)),
+    OP_ORC_B = _OP(0b0010011, 0b101, FUNCT7_KEY(0b0010100)),
+    OP_REV8 = _OP(0b0010011, 0b101, FUNCT7_KEY(0b0110100)),
+    OP_CLZ = _OP(0b0010011, 0b001, FUNCT7_UNARY | 0),
+    OP_CTZ = _OP(0b0010011, 0b001, FUNCT7_UNARY | 1),
+    OP_CPOP = _OP(0b0010011, 0b001, FUNCT7_UNARY | 2),
+    OP_SEXT_B = _OP(0b0010011, 0b001, FUNCT7_UNARY | 4),
+    OP_SEXT_H = _OP(0b0010011, 0b001, FUNCT7_UNARY | 5),
+
+    // Zbs
+    OP_BCLR = _OP(0b0110011, 0b001, FUNCT7_KEY(0b0100100)),
+    OP_BEXT = _OP(0b0110011, 0b101, FUNCT7_KEY(0b0100100)),
+    OP_BINV = _OP(0b0110011, 0b001, FUNCT7_KEY(0b0110100)),
+    OP_BSET = _OP(0b0110011, 0b001, FUNCT7_KEY(0b0010100)),
+    OP_BCLRI = _OP(0b0010011, 0b001, FUNCT7_KEY(0b0100100)),
+    OP_BEXTI = _OP(0b0010011, 0b101, FUNCT7_KEY(0b0100100)),
+    OP_BINVI = _OP(0b0010011, 0b001, FUNCT7_KEY(0b0110100)),
+    OP_BSETI = _OP(0b0010011, 0b001, FUNCT7_KEY(0b0010100)),
+
+    // RV32A, aq/rl are ignored: every access is sequentially consistent
+    OP_LR_W = _OP(0b0101111, 0b010, 0b00010),
+    OP_SC_W = _OP(0b0101111, 0b010, 0b00011),
+    OP_AMOSWAP_W = _OP(0b0101111, 0b010, 0b00001),
+    OP_AMOADD_W = _OP(0b0101111, 0b010, 0b00000),
+    OP_AMOXOR_W = _OP(0b0101111, 0b010, 0b00100),
+    OP_AMOAND_W = _OP(0b0101111, 0b010, 0b01100),
+    OP_AMOOR_W = _OP(0b0101111, 0b010, 0b01000),
+    OP_AMOMIN_W = _OP(0b0101111, 0b010, 0b10000),
+    OP_AMOMAX_W = _OP(0b0101111, 0b010, 0b10100),
+    OP_AMOMINU_W = _OP(0b0101111, 0b010, 0b11000),
+    OP_AMOMAXU_W = _OP(0b0101111, 0b010, 0b11100),
+
+    // F and D
+    OP_FLW = _OP(0b0000111, 0b010, 0),
+    OP_FLD = _OP(0b0000111, 0b011, 0),
+    OP_FSW = _OP(0b0100111, 0b010, 0),
+    OP_FSD = _OP(0b0100111, 0b011, 0),
+    OP_FMADD_S = _FP(0b1000011, 0, 0, 0),
+    OP_FMSUB_S = _FP(0b1000111, 0, 0, 0),
+    OP_FNMSUB_S = _FP(0b1001011, 0, 0, 0),
+    OP_FNMADD_S = _FP(0b1001111, 0, 0, 0),
+    OP_FMADD_D = _FP(0b1000011, 0, 1, 0),
+    OP_FMSUB_D = _FP(0b1000111, 0, 1, 0),
+    OP_FNMSUB_D = _FP(0b1001011, 0, 1, 0),
+    OP_FNMADD_D = _FP(0b1001111, 0, 1, 0),
+    OP_FADD_S = _FP(0b1010011, 0, 0, 0b00000),
+    OP_FSUB_S = _FP(0b1010011, 0, 0, 0b00001),
+    OP_FMUL_S = _FP(0b1010011, 0, 0, 0b00010),
+    OP_FDIV_S = _FP(0b1010011, 0, 0, 0b00011),
+    OP_FSQRT_S = _FP(0b1010011, 0, 0, 0b01011),
+    OP_FSGNJ_S = _FP(0b1010011, 0b000, 0, 0b00100),
+    OP_FSGNJN_S = _FP(0b1010011, 0b001, 0, 0b00100),
+    OP_FSGNJX_S = _FP(0b1010011, 0b010, 0, 0b00100),
+    OP_FMIN_S = _FP(0b1010011, 0b000, 0, 0b00101),
+    OP_FMAX_S = _FP(0b1010011, 0b001, 0, 0b00101),
+    OP_FCVT_S_D = _FP(0b1010011, 0, 0, 0b01000),
+    OP_FLE_S = _FP(0b1010011, 0b000, 0, 0b10100),
+    OP_FLT_S = _FP(0b1010011, 0b001, 0, 0b10100),
+    OP_FEQ_S = _FP(0b1010011, 0b010, 0, 0b10100),
+    OP_FCVT_W_S = _FP(0b1010011, 0, 0, 0b11000),
+    OP_FCVT_WU_S = _FP(0b1010011, 1, 0, 0b11000),
+    OP_FCVT_S_W = _FP(0b1010011, 0, 0, 0b11010),
+    OP_FCVT_S_WU = _FP(0b1010011, 1, 0, 0b11010),
+    OP_FMV_X_W = _FP(0b1010011, 0b000, 0, 0b11100),
+    OP_FCLASS_S = _FP(0b1010011, 0b001, 0, 0b11100),
+    OP_FMV_W_X = _FP(0b1010011, 0b000, 0, 0b11110),
+    OP_FADD_D = _FP(0b1010011, 0, 1, 0b00000),
+    OP_FSUB_D = _FP(0b1010011, 0, 1, 0b00001),
+    OP_FMUL_D = _FP(0b1010011, 0, 1, 0b00010),
+    OP_FDIV_D = _FP(0b1010011, 0, 1, 0b00011),
+    OP_FSQRT_D = _FP(0b1010011, 0, 1, 0b01011),
+    OP_FSGNJ_D = _FP(0b1010011, 0b000, 1, 0b00100),
+    OP_FSGNJN_D = _FP(0b1010011, 0b001, 1, 0b00100),
+    OP_FSGNJX_D = _FP(0b1010011, 0b010, 1, 0b00100),
+    OP_FMIN_D = _FP(0b1010011, 0b000, 1, 0b00101),
+    OP_FMAX_D = _FP(0b1010011, 0b001, 1, 0b00101),
+    OP_FCVT_D_S = _FP(0b1010011, 0, 1, 0b01000),
+    OP_FLE_D = _FP(0b1010011, 0b000, 1, 0b10100),
+    OP_FLT_D = _FP(0b1010011, 0b001, 1, 0b10100),
+    OP_FEQ_D = _FP(0b1010011, 0b010, 1, 0b10100),
+    OP_FCVT_W_D = _FP(0b1010011, 0, 1, 0b11000),
+    OP_FCVT_WU_D = _FP(0b1010011, 1, 1, 0b11000),
+    OP_FCVT_D_W = _FP(0b1010011, 0, 1, 0b11010),
+    OP_FCVT_D_WU = _FP(0b1010011, 1, 1, 0b11010),
+    OP_FCLASS_D = _FP(0b1010011, 0b001, 1, 0b11100),
+
+    // Zve32x. Ops that exist in several operand forms are named after
+    // their funct6 and told apart by funct3 (VV, VX or VI).
+    OP_VSETVLI = _V(7, 0),
+    OP_VSETIVLI = _V(7, 0b110000),
+    OP_VSETVL = _V(7, 0b100000),
+    OP_VLE8 = _VMEM(0b0000111, 0b000, 0, 0),
+    OP_VLE16 = _VMEM(0b0000111, 0b101, 0, 0),
+    OP_VLE32 = _VMEM(0b0000111, 0b110, 0, 0),
+    OP_VLM = _VMEM(0b0000111, 0b000, 0, 1),
+    OP_VL8R = _VMEM(0b0000111, 0b000, 0, 2),
+    OP_VL16R = _VMEM(0b0000111, 0b101, 0, 2),
+    OP_VL32R = _VMEM(0b0000111, 0b110, 0, 2),
+    OP_VLSE8 = _VMEM(0b0000111, 0b000, 2, 0),
+    OP_VLSE16 = _VMEM(0b0000111, 0b101, 2, 0),
+    OP_VLSE32 = _VMEM(0b0000111, 0b110, 2, 0),
+    OP_VSE8 = _VMEM(0b0100111, 0b000, 0, 0),
+    OP_VSE16 = _VMEM(0b0100111, 0b101, 0, 0),
+    OP_VSE32 = _VMEM(0b0100111, 0b110, 0, 0),
+    OP_VSM = _VMEM(0b0100111, 0b000, 0, 1),
+    OP_VSR = _VMEM(0b0100111, 0b000, 0, 2),
+    OP_VSSE8 = _VMEM(0b0100111, 0b000, 2, 0),
+    OP_VSSE16 = _VMEM(0b0100111, 0b101, 2, 0),
+    OP_VSSE32 = _VMEM(0b0100111, 0b110, 2, 0),
+    OP_VADD_VV = _V(0, 0b000000), OP_VADD_VX = _V(4, 0b000000), OP_VADD_VI = _V(3, 0b000000),
+    OP_VSUB_VV = _V(0, 0b000010), OP_VSUB_VX = _V(4, 0b000010),
+    OP_VRSUB_VX = _V(4, 0b000011), OP_VRSUB_VI = _V(3, 0b000011),
+    OP_VMINU_VV = _V(0, 0b000100), OP_VMINU_VX = _V(4, 0b000100),
+    OP_VMIN_VV = _V(0, 0b000101), OP_VMIN_VX = _V(4, 0b000101),
+    OP_VMAXU_VV = _V(0, 0b000110), OP_VMAXU_VX = _V(4, 0b000110),
+    OP_VMAX_VV = _V(0, 0b000111), OP_VMAX_VX = _V(4, 0b000111),
+    OP_VAND_VV = _V(0, 0b001001), OP_VAND_VX = _V(4, 0b001001), OP_VAND_VI = _V(3, 0b001001),
+    OP_VOR_VV = _V(0, 0b001010), OP_VOR_VX = _V(4, 0b001010), OP_VOR_VI = _V(3, 0b001010),
+    OP_VXOR_VV = _V(0, 0b001011), OP_VXOR_VX = _V(4, 0b001011), OP_VXOR_VI = _V(3, 0b001011),
+    OP_VMERGE_VV = _V(0, 0b010111), OP_VMERGE_VX = _V(4, 0b010111), OP_VMERGE_VI = _V(3, 0b010111),
+    OP_VMSEQ_VV = _V(0, 0b011000), OP_VMSEQ_VX = _V(4, 0b011000), OP_VMSEQ_VI = _V(3, 0b011000),
+    OP_VMSNE_VV = _V(0, 0b011001), OP_VMSNE_VX = _V(4, 0b011001), OP_VMSNE_VI = _V(3, 0b011001),
+    OP_VMSLTU_VV = _V(0, 0b011010), OP_VMSLTU_VX = _V(4, 0b011010),
+    OP_VMSLT_VV = _V(0, 0b011011), OP_VMSLT_VX = _V(4, 0b011011),
+    OP_VMSLEU_VV = _V(0, 0b011100), OP_VMSLEU_VX = _V(4, 0b011100), OP_VMSLEU_VI = _V(3, 0b011100),
+    OP_VMSLE_VV = _V(0, 0b011101), OP_VMSLE_VX = _V(4, 0b011101), OP_VMSLE_VI = _V(3, 0b011101),
+    OP_VMSGTU_VX = _V(4, 0b011110), OP_VMSGTU_VI = _V(3, 0b011110),
+    OP_VMSGT_VX = _V(4, 0b011111), OP_VMSGT_VI = _V(3, 0b011111),
+    OP_VSADDU_VV = _V(0, 0b100000), OP_VSADDU_VX = _V(4, 0b100000), OP_VSADDU_VI = _V(3, 0b100000),
+    OP_VSADD_VV = _V(0, 0b100001), OP_VSADD_VX = _V(4, 0b100001), OP_VSADD_VI = _V(3, 0b100001),
+    OP_VSSUBU_VV = _V(0, 0b100010), OP_VSSUBU_VX = _V(4, 0b100010),
+    OP_VSSUB_VV = _V(0, 0b100011), OP_VSSUB_VX = _V(4, 0b100011),
+    OP_VSLL_VV = _V(0, 0b100101), OP_VSLL_VX = _V(4, 0b100101), OP_VSLL_VI = _V(3, 0b100101),
+    OP_VMVR = _V(3, 0b100111),
+    OP_VSRL_VV = _V(0, 0b101000), OP_VSRL_VX = _V(4, 0b101000), OP_VSRL_VI = _V(3, 0b101000),
+    OP_VSRA_VV = _V(0, 0b101001), OP_VSRA_VX = _V(4, 0b101001), OP_VSRA_VI = _V(3, 0b101001),
+    OP_VREDSUM = _V(2, 0b000000), OP_VREDAND = _V(2, 0b000001),
+    OP_VREDOR = _V(2, 0b000010), OP_VREDXOR = _V(2, 0b000011),
+    OP_VREDMINU = _V(2, 0b000100), OP_VREDMIN = _V(2, 0b000101),
+    OP_VREDMAXU = _V(2, 0b000110), OP_VREDMAX = _V(2, 0b000111),
+    OP_VWXUNARY0 = _V(2, 0b010000), // vmv.x.s, vcpop.m, vfirst.m
+    OP_VRXUNARY0 = _V(6, 0b010000), // vmv.s.x
+    OP_VMUNARY0 = _V(2, 0b010100),  // vid.v
+    OP_VMANDN = _V(2, 0b011000), OP_VMAND = _V(2, 0b011001),
+    OP_VMOR = _V(2, 0b011010), OP_VMXOR = _V(2, 0b011011),
+    OP_VMORN = _V(2, 0b011100), OP_VMNAND = _V(2, 0b011101),
+    OP_VMNOR = _V(2, 0b011110), OP_VMXNOR = _V(2, 0b011111),
+    OP_VDIVU_VV = _V(2, 0b100000), OP_VDIVU_VX = _V(6, 0b100000),
+    OP_VDIV_VV = _V(2, 0b100001), OP_VDIV_VX = _V(6, 0b100001),
+    OP_VREMU_VV = _V(2, 0b100010), OP_VREMU_VX = _V(6, 0b100010),
+    OP_VREM_VV = _V(2, 0b100011), OP_VREM_VX = _V(6, 0b100011),
+    OP_VMULHU_VV = _V(2, 0b100100), OP_VMULHU_VX = _V(6, 0b100100),
+    OP_VMUL_VV = _V(2, 0b100101), OP_VMUL_VX = _V(6, 0b100101),
+    OP_VMULHSU_VV = _V(2, 0b100110), OP_VMULHSU_VX = _V(6, 0b100110),
+    OP_VMULH_VV = _V(2, 0b100111), OP_VMULH_VX = _V(6, 0b100111),
+    OP_VMADD_VV = _V(2, 0b101001), OP_VMADD_VX = _V(6, 0b101001),
+    OP_VNMSUB_VV = _V(2, 0b101011), OP_VNMSUB_VX = _V(6, 0b101011),
+    OP_VMACC_VV = _V(2, 0b101101), OP_VMACC_VX = _V(6, 0b101101),
+    OP_VNMSAC_VV = _V(2, 0b101111), OP_VNMSAC_VX = _V(6, 0b101111),
+
     OP_FENCE = _OP(0b0001111, 0b000, 0),
+    OP_FENCE_I = _OP(0b0001111, 0b001, 0),
     OP_ECALL = _OP(0b1110011, 0b000, 0),
+    OP_SFENCE_VMA = _OP(0b1110011, 0b000, 0b0001001),
 
 
     OP_CSRRW = _OP(0b1110011, 0b001, 0),
@@ -250,9 +464,95 @@ typedef enum __attribute((packed)) _opcode_t {
     OP_EBREAK = _OP(0b1110011, 0b000, 0)
 } opcode_t;
 #undef _OP
+#undef _FP
+#undef _V
+#undef _VMEM
 
 #define NUMREGS 32
 
+// RV32M arithmetic. Division by zero and overflow do not trap, they
+// return the results fixed by the spec.
+static inline uint32_t rv32m_mulh(const uint32_t a, const uint32_t b)
+{
+  return (uint32_t)(((int64_t)(int32_t)a * (int64_t)(int32_t)b) >> 32);
+}
+
+static inline uint32_t rv32m_mulhsu(const uint32_t a, const uint32_t b)
+{
+  return (uint32_t)(((int64_t)(int32_t)a * (int64_t)(uint64_t)b) >> 32);
+}
+
+static inline uint32_t rv32m_mulhu(const uint32_t a, const uint32_t b)
+{
+  return (uint32_t)(((uint64_t)a * (uint64_t)b) >> 32);
+}
+
+static inline uint32_t rv32m_div(const uint32_t a, const uint32_t b)
+{
+  if(b == 0) {
+    return 0xffffffff;
+  }
+  if(a == 0x80000000 && b == 0xffffffff) {
+    return a; // overflow
+  }
+  return (uint32_t)((int32_t)a / (int32_t)b);
+}
+
+static inline uint32_t rv32m_divu(const uint32_t a, const uint32_t b)
+{
+  return b == 0 ? 0xffffffff : a / b;
+}
+
+static inline uint32_t rv32m_rem(const uint32_t a, const uint32_t b)
+{
+  if(b == 0) {
+    return a;
+  }
+  if(a == 0x80000000 && b == 0xffffffff) {
+    return 0; // overflow
+  }
+  return (uint32_t)((int32_t)a % (int32_t)b);
+}
+
+static inline uint32_t rv32m_remu(const uint32_t a, const uint32_t b)
+{
+  return b == 0 ? a : a % b;
+}
+
+// Zbb, on the host bit instructions where the compiler has them
+static inline uint32_t rv32b_clz(const uint32_t a)
+{
+  return a == 0 ? 32 : (uint32_t)__builtin_clz(a);
+}
+
+static inline uint32_t rv32b_ctz(const uint32_t a)
+{
+  return a == 0 ? 32 : (uint32_t)__builtin_ctz(a);
+}
+
+static inline uint32_t rv32b_cpop(const uint32_t a)
+{
+  return (uint32_t)__builtin_popcount(a);
+}
+
+static inline uint32_t rv32b_rol(const uint32_t a, const uint32_t n)
+{
+  return (a << (n & 31)) | (a >> (-n & 31));
+}
+
+static inline uint32_t rv32b_ror(const uint32_t a, const uint32_t n)
+{
+  return (a >> (n & 31)) | (a << (-n & 31));
+}
+
+// Each byte to 0xff if any of its bits are set, 0 otherwise
+static inline uint32_t rv32b_orcb(const uint32_t a)
+{
+  const uint32_t low7 = a & 0x7f7f7f7f;
+  const uint32_t high = (((low7 + 0x7f7f7f7f) | a) & 0x80808080) >> 7;
+  return high * 0xff;
+}
+
 // MAYBE: Add register aliases?
 typedef enum __attribute((packed)) _regn_t {
   ZERO = 0,
@@ -263,19 +563,85 @@ typedef enum __attribute((packed)) _regn_t {
 } regn_t;
     
 
+struct _core_t;
+struct _dinstr_t;
+
+// Executes one decoded instruction, returns the pc of the next one
+typedef vaddr_t (*dinstr_handler_t)(struct _core_t *, const struct _dinstr_t *);
+
+// Adjacent instruction pairs run as one superinstruction. Only formed in
+// dblock_t, where the second half stays in place right after the first.
+typedef enum __attribute((packed)) _fusion_t {
+  FUSE_NONE = 0,
+  FUSE_LI,     // lui rd; addi rd, rd, imm
+  FUSE_CALL,   // auipc rd; jalr rd2, imm(rd)
+  FUSE_LOADPC, // auipc rd; lw rd2, imm(rd)
+  FUSE_ZEXT,   // slli rd, rs1, n; srli rd, rd, m
+  FUSE_SEXT,   // slli rd, rs1, n; srai rd, rd, m
+  FUSE_SLT,    // slt/sltu/slti/sltiu rd, ...; beqz/bnez rd
+  FUSE_SLTU,
+  FUSE_SLTI,
+  FUSE_SLTIU
+} fusion_t;
+
+// Fully decoded instruction, cached per pc in core_t.dcache. All fields are
+// unpacked and the immediate is sign extended once, at decode time, so the
+// execute stage never has to look at the raw instruction bits again.
+// Compressed instructions are expanded, instruction holds the expansion.
+typedef struct _dinstr_t {
+  vaddr_t   pc;          // cache tag, DCACHE_EMPTY if the slot is unused
+  uint32_t  instruction;
+  int32_t   imm;         // sign extended immediate, shamt for shifts
+  opcode_t  op;          // opcode | funct3 | funct7 key, see _OP
+  optype_t  optype;
+  uint8_t   rd;
+  uint8_t   rs1;
+  uint8_t   rs2;
+  uint8_t   rs3;         // FMADD and friends only
+  fusion_t  fused;       // FUSE_NONE unless fused with the next instruction
+  uint8_t   len;         // 2 for compressed instructions, 4 otherwise
+  dinstr_handler_t handler; // resolved from op at decode time
+} dinstr_t;
+
+// Translated block, returns the pc to continue at
+typedef vaddr_t (*jit_fn_t)(struct _core_t *);
+
+#define DCACHE_EMPTY       0xffffffff
+#define RESERVATION_NONE   0xffffffff // misaligned, never an LR.W address
+#define DCACHE_INDEX(pc)   (((pc) >> 1) & (DECODE_CACHE_SIZE-1))
+
+// Straight-line run of decoded instructions ending at a branch, jump or
+// system instruction. Blocks are chained to their successors so that
+// ENGINE_BLOCK can go from one block to the next without a lookup.
+typedef struct _dblock_t {
+  vaddr_t   pc;          // start pc, DCACHE_EMPTY if the slot is unused
+  vaddr_t   end;         // pc following the last instruction
+  uint32_t  count;
+  struct _dblock_t *next[2]; // successor when falling through / jumping
+  jit_fn_t  native;      // translated code, NULL until the block gets hot
+  uint32_t  native_count; // leading instructions covered by native
+  uint32_t  hits;
+  dinstr_t  instrs[BLOCK_MAX_INSTRS];
+} dblock_t;
+
+#define BLOCK_INDEX(pc)    (((pc) >> 1) & (BLOCK_CACHE_SIZE-1))
+#define CODE_PAGE_SHIFT    12
+#define CODE_CHUNK_SHIFT   6
+
+// A write to code, queued for a core to drop the decoded instructions it
+// overlaps, see core_sync_code. Writes past CODE_WRITES drop them all.
+#define CODE_WRITES        16
+typedef struct _code_write_t {
+  vaddr_t   vaddr;
+  uint32_t  size;
+} code_write_t;
+
+#define CODE_STALE_ALL     1 // code_stale: drop all decoded code
+#define CODE_STALE_WRITES  2 // code_stale: drop what code_writes overlap
+
 // Passed through the pipeline of a core
 typedef struct __attribute((packed)) _instr_t {
-  optype_t optype:3;
-  opcode_t opcode:8;
-  uint8_t  rs1:5;
-  uint8_t  rs2:5;
-  uint8_t  rd:5;
-  uint8_t  funct7:7;
-  uint8_t  funct3:3;
-  uint8_t  shamt:5;
-  uint8_t  imm5:5;
-  uint32_t imm12:12;
-  uint32_t imm20:20;
+  const dinstr_t *d;
   uint32_t rs1v;
   uint32_t rs2v;
 
@@ -300,6 +666,16 @@ typedef enum __attribute((packed)) _trap_state_t {
 
 struct _core_thread_args_t;
 
+// How a core steps through instructions. ENGINE_STAGED runs one pipeline
+// stage per core_cycle() call, ENGINE_FAST executes whole instructions in a
+// tight loop (core_run) until a trap or the budget runs out, ENGINE_BLOCK
+// does the same one cached basic block at a time.
+typedef enum _core_engine_t {
+  ENGINE_STAGED,
+  ENGINE_FAST,
+  ENGINE_BLOCK
+} core_engine_t;
+
 typedef enum _priv_mode_t {
   PMODE_MACHINE,
   PMODE_SUPERVISOR,
@@ -311,42 +687,97 @@ typedef struct __attribute((packed)) _core_t {
   core_state_t state;
   
   uint32_t    instruction;
-  uint32_t    prefetch[PREFETCH_SIZE-1];
+  uint16_t    prefetch[PREFETCH_SIZE*2]; // instruction parcels from prefetch_pc
+  vaddr_t     prefetch_pc;
+  const uint8_t *fetch_host; // host memory of the executable run at fetch_start
+  vaddr_t     fetch_start;
+  uint32_t    fetch_len;
+  uint32_t    fetch_gen;     // mmu->perm_gen when fetch_host was looked up
   instr_t     decoded;
+  dinstr_t   *dcache;
+  dblock_t   *blocks;
+  uint8_t    *code_chunks; // bitmap of memory chunks holding cached blocks
+  // Any thread may queue writes to code or mark all of it stale, only the
+  // core's own drops it; code_stale is atomic, code_lock guards the queue
+  pthread_mutex_t code_lock __attribute__((aligned));
+  code_write_t code_writes[CODE_WRITES];
+  uint32_t    code_write_cnt;
+  uint32_t    code_stale __attribute__((aligned(4))); // CODE_STALE_ bits
+  struct _jit_t *jit;
+  struct _timing_t *timing; // CPU_TIMING only
+  struct _bpred_t *bpred;   // CPU_BPRED only
+  struct _tlb_t *tlb;       // Sv32 translations, see sv32.h
   
   uint32_t    pc; // pc, pcNext
   uint32_t    aluOut;
 
   uint32_t    registers[NUMREGS];
+  uint64_t    fregisters[NUMREGS]; // F/D, singles NaN-boxed
+  uint8_t     vregisters[NUMREGS][VLENB]; // V, elements in memory order
   uint64_t     cycle;
+  uint64_t     instret;
 
   bus_t       *bus;
+  mmu_t       *mmu;
+  vaddr_t      reserved_addr;  // LR.W reservation, RESERVATION_NONE if not held
+  uint32_t     reserved_value; // the value LR.W loaded
   csr_t        csr __attribute__((aligned));
 
   uint32_t     trap_pc;
   uint32_t     trap_regs[NUMREGS];
+  uint8_t      trap_len; // of the instruction at trap_pc, returned past at EXIT
 
-  uint8_t      prefetch_cnt:4; // for alignment/packing purposes
+  uint8_t      prefetch_cnt; // parcels in prefetch
   uint8_t      id:4;
   priv_mode_t  priv_mode:4;
   trap_state_t trap_state:4;
   bool         halted:1;
+  core_engine_t engine:4;
 
   bool       (*trap_handler )(struct _core_thread_args_t *args);
 } core_t;
 
+// The architectural state of a core, for core_snapshot and core_restore
+typedef struct _core_snapshot_t {
+  core_state_t state;
+  uint32_t    instruction;
+  instr_t     decoded;
+  uint32_t    pc;
+  uint32_t    aluOut;
+  uint32_t    registers[NUMREGS];
+  uint64_t    fregisters[NUMREGS];
+  uint8_t     vregisters[NUMREGS][VLENB];
+  uint64_t    cycle;
+  uint64_t    instret;
+  csr_t       csr;
+  uint32_t    trap_pc;
+  uint32_t    trap_regs[NUMREGS];
+  uint8_t     trap_len;
+  priv_mode_t  priv_mode;
+  trap_state_t trap_state;
+  bool         halted;
+} core_snapshot_t;
+
 typedef struct _core_thread_args_t {
   struct _emulator_t *emulator;
   core_t *core;
 } core_thread_args_t;
 
-typedef struct __attribute((packed)) _RV32I_t {
+// Not packed, so that &cores[i] can be handed out; core_t already is
+typedef struct _RV32I_t {
   core_t      cores[NUMCORES];
   bus_t       *bus;
+  mmu_t       *mmu;
 } RV32I_cpu_t;
 
-RV32I_cpu_t	*cpu_init(bus_t *);
+RV32I_cpu_t	*cpu_init(bus_t *, mmu_t *);
 core_t *	 core_init(RV32I_cpu_t *, uint32_t, uint32_t);
 void		 core_cycle(core_t *);
+uint64_t	 core_run(core_t *, const uint64_t);
 void             core_dumpregs(core_t *);
+void		 cause_trap(core_t *, trap_cause_t);
+bool		 core_load(core_t *, const vaddr_t, const memory_access_width_t, uint32_t *);
+bool		 core_store(core_t *, const vaddr_t, const uint32_t, const memory_access_width_t);
+void		 core_snapshot(const core_t *, core_snapshot_t *);
+void		 core_restore(core_t *, const core_snapshot_t *);
 #endif
@@ -87,7 +87,7 @@ uint64_t csr_read_clear64(csr_t *csr, uint32_t addr, uint64_t mask)
 void csr_init(csr_t *csr)
 {
   // Encodes CPU capabilities, top 2 bits encode width (XLEN), bottom 26 encode extensions
-  csr->state[misa]      = 0x40000100;
+  csr->state[misa]      = 0x4000112f; // RV32IMAFDCB
   // JEDEC manufacturer ID
   csr->state[mvendorid] = 0x1337;
   // Microarchitecture ID
@@ -15,6 +15,14 @@ typedef enum _csr_perm_t {
 } csr_perm_t;
 
 typedef enum _csr_address_t {
+  fflags	= 0x001,
+  frm		= 0x002,
+  fcsr		= 0x003,
+  vstart	= 0x008,
+  vxsat		= 0x009,
+  vxrm		= 0x00a,
+  vcsr		= 0x00f,
+  satp		= 0x180,
   mstatus	= 0x300,
   misa		= 0x301,
   mie		= 0x304,
@@ -27,6 +35,9 @@ typedef enum _csr_address_t {
   mcycle	= 0xb00,
   mcycleh	= 0xb80,
   mtime		= 0xc01,
+  vl		= 0xc20,
+  vtype		= 0xc21,
+  vlenb		= 0xc22,
   mtimeh	= 0xc81,
   mvendorid	= 0xF11,
   marchid	= 0xF12,
@@ -6,7 +6,9 @@
 #include <sys/types.h>
 #include "elf32.h"
 
-Elf32 *elf_load (const uint8_t *elf_start, mmu_t *mmu)
+// Load the ELF at elf_start. With the file it came from open as fd, the
+// segments are mapped from it rather than copied, see mmu_write_from_file.
+Elf32 *elf_load (const uint8_t *elf_start, const int fd, mmu_t *mmu)
 {
   Elf32 *elf = malloc(sizeof(Elf32));
   if(!elf) {
@@ -28,10 +30,17 @@ Elf32 *elf_load (const uint8_t *elf_start, mmu_t *mmu)
 	return NULL;
       }
 
-      mmu_write_from(mmu,
-		     (void *)(elf_start + phdr[i].p_offset),
-		     phdr[i].p_vaddr,
-		     phdr[i].p_filesz);
+      const size_t written = fd >= 0 ?
+	mmu_write_from_file(mmu, fd, phdr[i].p_offset, phdr[i].p_vaddr, phdr[i].p_filesz) :
+	mmu_write_from(mmu,
+		       (void *)(elf_start + phdr[i].p_offset),
+		       phdr[i].p_vaddr,
+		       phdr[i].p_filesz);
+      if(written < phdr[i].p_filesz) {
+	fprintf(stderr, "elf: could not load segment at 0x%08x size 0x%08x\n", phdr[i].p_vaddr, phdr[i].p_filesz);
+	free(elf);
+	return NULL;
+      }
 
       const Elf32_Word f = phdr[i].p_flags;
       const mperm_t perm = ((f&4) != 0 ? MPERM_READ : 0) | 
@@ -137,6 +137,6 @@ typedef struct _Elf32 {
   vaddr_t entry;
 } Elf32;
 
-Elf32 *elf_load(const unsigned char *elf_start, mmu_t *emu);
+Elf32 *elf_load(const unsigned char *elf_start, const int fd, mmu_t *emu);
 
 #endif
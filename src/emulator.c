@@ -3,6 +3,10 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "config.h"
 #include "emulator.h"
 #include "memory.h"
@@ -10,14 +14,20 @@
 #include "syscall.h"
 #include "video.h"
 #include "csr.h"
+#include "timing.h"
+#include "bpred.h"
+#include "fpu.h"
 
+// RAM answers wherever the mmu has memory, so it goes after the fixed
+// mmio windows on the bus
 mmio_device_t ram_device = {
-  .next         = &csr_mmio_device,
-  .base_address = RAM_START,
-  .size		= RAM_SIZE,
+  .next         = NULL,
+  .base_address = 0,
+  .size		= 0xffffffff,
   .state        = READY,
   .perm         = READ|WRITE,
   .init		= init_ram,
+  .contains	= ram_contains,
   .read         = read_ram,
   .read_single	= read_ram_single,
   .write         = write_ram,
@@ -25,7 +35,7 @@ mmio_device_t ram_device = {
 };
 
 bus_t main_bus = {
-  .mmio_devices = &ram_device // RAM first, most accessed
+  .mmio_devices = &csr_mmio_device // RAM is linked behind it at init
 };
 
 
@@ -67,13 +77,46 @@ uint8_t *load_file(const char *filename, size_t *osize)
   return (uint8_t *)ptr;
 }
 
+// Guest RAM size: RAM_SIZE, or CRISCV_RAM_SIZE from the environment, in
+// bytes with an optional k, m or g suffix. RAM is mapped sparsely, so a
+// large size costs nothing until the guest touches it.
+static size_t ram_size(void)
+{
+  const char *env = getenv("CRISCV_RAM_SIZE");
+  if(env == NULL || *env == '\0') {
+    return RAM_SIZE;
+  }
+  char *end;
+  unsigned long long size = strtoull(env, &end, 0);
+  switch(*end) {
+  case 'k': case 'K': size <<= 10; break;
+  case 'm': case 'M': size <<= 20; break;
+  case 'g': case 'G': size <<= 30; break;
+  }
+  const unsigned long long max = 0x100000000ull - RAM_START;
+  if(size == 0 || size > max) {
+    fprintf(stderr, "emu::ram_size: CRISCV_RAM_SIZE=%s out of range, using %s\n", env, size == 0 ? "RAM_SIZE" : "all");
+    return size == 0 ? RAM_SIZE : max;
+  }
+  return size;
+}
+
 emulator_t *emulator_init()
 {
   emulator_t *emu = malloc(sizeof(emulator_t));
   assert(emu);
   emu->bus = &main_bus;
-  emu->mmu = mmu_init(RAM_START, RAM_SIZE);
+  const size_t ram = ram_size();
+  emu->mmu = mmu_init(RAM_START, ram);
+  assert(emu->mmu);
   ram_device.user = (void *)emu->mmu;
+  csr_mmio_device.next = &ram_device;
+
+  // RAM beyond the default window runs over the CSR window behind it,
+  // which keeps its address and gets no memory access
+  if(RAM_START + ram > CSR_MMAP_BASE_ADDR) {
+    mmu_setperm(emu->mmu, CSR_MMAP_BASE_ADDR, csr_mmio_device.size, 0);
+  }
 
   // Allocate space for ISR ptr
   //  vaddr_t isr_addr = mmu_allocate_raw(emu->mmu, sizeof(vaddr_t)*64);
@@ -92,16 +135,32 @@ emulator_t *emulator_init()
 
 bool emulator_load_elf(emulator_t *emu, const char *filename)
 {
-  size_t elf_size;
   fprintf(stderr, "Load ELF file %s into RAM\n", filename);
-  uint8_t *file = load_file(filename, &elf_size);
-  if(!file) {
+  // The file is mapped rather than read, and its segments are mapped on
+  // into guest memory, so instances of the same ELF share them
+  const int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if(fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+    fprintf(stderr, "ERROR: Could not load ELF file %s\n", filename);
+    if(fd >= 0) {
+      close(fd);
+    }
+    return false;
+  }
+  uint8_t *file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(file == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+  emu->elf = elf_load(file, fd, emu->mmu);
+  munmap(file, st.st_size);
+  close(fd);
+  if(emu->elf == NULL) {
+    fprintf(stderr, "ERROR: Could not load ELF file %s\n", filename);
     return false;
   }
-  emu->elf = elf_load(file, emu->mmu);
   fprintf(stderr, "- entry point: 0x%08x\n", emu->elf->entry);
   assert(emu->elf->entry);
-  free(file);
 
   return true;
 }
@@ -171,17 +230,34 @@ void * cpu_thread(void *arg)
   core_t *core = args->core;
   assert(core);
 
+  // Guest F/D runs on this thread's host FPU, so no host floating point
+  // here: the timing below is done in integers
+  fpu_host_enter(&core->csr);
+
   struct timespec spec;
   clock_gettime(CLOCK_REALTIME, &spec);
   uint64_t lastc = 0;
-  uint64_t start = spec.tv_sec * 1000 + spec.tv_nsec/1.0e6;
+  uint64_t start = spec.tv_sec * 1000 + spec.tv_nsec / 1000000;
   while(true) {
-    core_cycle(core);
+    if(core->engine != ENGINE_STAGED && core->state != TRAP) {
+      core_run(core, CPU_RUN_BUDGET);
+    } else {
+      core_cycle(core);
+    }
     if(core->state == TRAP && core->trap_state == HANDLE) {
       // Call from usermode (ECALL);
       if(core->trap_handler != NULL) {
 	if(!core->trap_handler(args)) {
+	  if(args->emulator->snapshot_point) {
+	    break; // stopped for a snapshot, see sys_snapshot
+	  }
 	  fprintf(stderr, "cpu core: trap_handler returned false, core exiting\n");
+#ifdef CPU_TIMING
+	  timing_report(core->timing, core->id);
+#endif
+#ifdef CPU_BPRED
+	  bpred_report(core->bpred, core->id);
+#endif
 	  break; // stop cpu loop
 	}
       } else {
@@ -190,18 +266,20 @@ void * cpu_thread(void *arg)
       }
     }
 
-    if(core->cycle % (uint64_t)1e8 == 0) {
+    if(core->instret - lastc >= (uint64_t)1e8) {
       struct timespec spec;
-      uint64_t cycles = core->cycle / 5;
+      uint64_t cycles = core->instret;
 
       clock_gettime(CLOCK_REALTIME, &spec);
-      uint64_t end = spec.tv_sec * 1000 + spec.tv_nsec/1.0e6;
-      float mips = (float)(cycles-lastc) / ((float)(end-start));
-      fprintf(stderr, "mip/s: %2f\n", (mips/1e3));
+      uint64_t end = spec.tv_sec * 1000 + spec.tv_nsec / 1000000;
+      const uint64_t per_ms = (cycles - lastc) / (end > start ? end - start : 1);
+      fprintf(stderr, "mip/s: %lu.%03lu\n", (unsigned long)(per_ms / 1000), (unsigned long)(per_ms % 1000));
       start = end;
       lastc = cycles;
     }
   }
+  // Flags still pending on the host go with the thread
+  fpu_sync_flags(&core->csr);
   return NULL;
 }
 
@@ -223,10 +301,11 @@ void core_join(emulator_t *emu, uint32_t core_num)
 }
 
 
-void emulator_run(emulator_t *emu, const char *argv1)
+// Set up the cores to start the loaded ELF with argv1, without running them
+void emulator_setup(emulator_t *emu, const char *argv1)
 {
   fprintf(stderr, "initializing CPU\n");
-  emu->cpu = cpu_init(emu->bus);
+  emu->cpu = cpu_init(emu->bus, emu->mmu);
 
   fprintf(stderr, "Initializing %d cores with pc 0x%08x\n", NUMCORES, emu->elf->entry);
   for(size_t i=0; i < NUMCORES; i++) {
@@ -258,11 +337,191 @@ void emulator_run(emulator_t *emu, const char *argv1)
     // add argv[..]
     push(42); // argc 
 #undef push    
-    
-    core_start(emu, i);
   }
+}
 
+// Run all cores until they exit, true when the guest stopped at a
+// snapshot point instead and can go on with the next call
+bool emulator_execute(emulator_t *emu)
+{
+  emu->snapshot_point = false;
+  for(size_t i=0; i < NUMCORES; i++) {
+    core_start(emu, i);
+  }
   for(size_t i=0; i < NUMCORES; i++) {
     core_join(emu, i);
   }
+  return emu->snapshot_point;
+}
+
+void emulator_run(emulator_t *emu, const char *argv1)
+{
+  emulator_setup(emu, argv1);
+  while(emulator_execute(emu)) {
+  }
+}
+
+// Remember the guest as it is, typically right after emulator_setup, so
+// that emulator_restore can start it over again and again without loading
+// the ELF. Host side state, such as files the guest opened, is not part of
+// it.
+bool emulator_snapshot(emulator_t *emu)
+{
+  if(!mmu_snapshot(emu->mmu)) {
+    return false;
+  }
+  for(size_t i=0; i < NUMCORES; i++) {
+    core_snapshot(&emu->cpu->cores[i], &emu->snapshot[i]);
+  }
+  return true;
+}
+
+// Go back to the snapshot, with no cores running
+void emulator_restore(emulator_t *emu)
+{
+  mmu_restore(emu->mmu);
+  for(size_t i=0; i < NUMCORES; i++) {
+    core_restore(&emu->cpu->cores[i], &emu->snapshot[i]);
+  }
+}
+
+// Snapshot files hold this header, the cores, the state of each device on
+// the bus and then the memory image of mmu_save. key is a hash of the ELF
+// and the arguments the guest was set up with, so that a file for anything
+// else is never used.
+#define SNAPSHOT_MAGIC   0x50414e5356524363ull // "cCRVSNAP"
+#define SNAPSHOT_VERSION 3
+
+typedef struct _snapshot_header_t {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t cores;
+  uint32_t core_size;
+  uint32_t devices;
+  uint64_t key;
+  vaddr_t  entry;
+} snapshot_header_t;
+
+// FNV-1a, over the ELF file and then argv1
+static uint64_t snapshot_key(const char *filename, const char *argv1)
+{
+  size_t size;
+  uint8_t *file = load_file(filename, &size);
+  if(file == NULL) {
+    return 0;
+  }
+  uint64_t h = 0xcbf29ce484222325ull;
+  for(size_t i=0; i < size; i++) {
+    h = (h ^ file[i]) * 0x100000001b3ull;
+  }
+  for(size_t i=0; i <= strlen(argv1); i++) {
+    h = (h ^ (uint8_t)argv1[i]) * 0x100000001b3ull;
+  }
+  free(file);
+  return h;
+}
+
+static uint32_t bus_devices(const bus_t *bus)
+{
+  uint32_t n = 0;
+  for(const mmio_device_t *dev = bus->mmio_devices; dev != NULL; dev = dev->next) {
+    n++;
+  }
+  return n;
+}
+
+// Save the stopped guest, set up from filename and argv1, to path. The
+// file is written next to it and renamed into place, so that whoever
+// loads it never sees half of it.
+bool emulator_save_snapshot(emulator_t *emu, const char *path, const char *filename, const char *argv1)
+{
+  snapshot_header_t hdr = {
+    .magic = SNAPSHOT_MAGIC,
+    .version = SNAPSHOT_VERSION,
+    .cores = NUMCORES,
+    .core_size = sizeof(core_snapshot_t),
+    .devices = bus_devices(emu->bus),
+    .key = snapshot_key(filename, argv1),
+    .entry = emu->elf->entry
+  };
+  core_snapshot_t cores[NUMCORES];
+  for(size_t i=0; i < NUMCORES; i++) {
+    core_snapshot(&emu->cpu->cores[i], &cores[i]);
+    // The pipeline of a stopped core is empty, and its decoded
+    // instruction points into the decode cache
+    if(cores[i].state != FETCH && cores[i].state != TRAP) {
+      fprintf(stderr, "emu::save_snapshot: core %zu is running\n", i);
+      return false;
+    }
+    memset(&cores[i].decoded, 0, sizeof(cores[i].decoded));
+  }
+
+  char *tmp = malloc(strlen(path) + 16);
+  assert(tmp);
+  sprintf(tmp, "%s.%d", path, (int)getpid());
+  const int fd = open(tmp, O_RDWR|O_CREAT|O_TRUNC, 0644);
+  bool ok = fd >= 0 && write(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+    write(fd, cores, sizeof(cores)) == sizeof(cores);
+  for(mmio_device_t *dev = emu->bus->mmio_devices; ok && dev != NULL; dev = dev->next) {
+    ok = write(fd, &dev->state, sizeof(dev->state)) == sizeof(dev->state);
+  }
+  ok = ok && mmu_save(emu->mmu, fd);
+  if(fd >= 0) {
+    ok = close(fd) == 0 && ok;
+  }
+  ok = ok && rename(tmp, path) == 0;
+  if(!ok) {
+    fprintf(stderr, "emu::save_snapshot: could not write %s\n", path);
+    unlink(tmp);
+  } else {
+    fprintf(stderr, "emu::save_snapshot: saved %s\n", path);
+  }
+  free(tmp);
+  return ok;
+}
+
+// Start from the snapshot at path instead of loading filename and setting
+// it up with argv1, false when there is none for them or it is damaged.
+// The emulator is unchanged then, see mmu_load.
+bool emulator_load_snapshot(emulator_t *emu, const char *path, const char *filename, const char *argv1)
+{
+  const int fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    return false;
+  }
+  snapshot_header_t hdr;
+  core_snapshot_t cores[NUMCORES];
+  device_state_t states[bus_devices(emu->bus)];
+  if(read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+     hdr.magic != SNAPSHOT_MAGIC || hdr.version != SNAPSHOT_VERSION ||
+     hdr.cores != NUMCORES || hdr.core_size != sizeof(core_snapshot_t) ||
+     hdr.devices != bus_devices(emu->bus) || hdr.key != snapshot_key(filename, argv1) ||
+     read(fd, cores, sizeof(cores)) != sizeof(cores) ||
+     read(fd, states, sizeof(states)) != (ssize_t)sizeof(states)) {
+    fprintf(stderr, "emu::load_snapshot: %s does not match, ignored\n", path);
+    close(fd);
+    return false;
+  }
+  if(!mmu_load(emu->mmu, fd)) {
+    fprintf(stderr, "emu::load_snapshot: bad memory image in %s, ignored\n", path);
+    close(fd);
+    return false;
+  }
+  close(fd);
+
+  emu->elf = malloc(sizeof(Elf32));
+  assert(emu->elf);
+  emu->elf->entry = hdr.entry;
+  size_t i = 0;
+  for(mmio_device_t *dev = emu->bus->mmio_devices; dev != NULL; dev = dev->next) {
+    dev->state = states[i++];
+  }
+  emu->cpu = cpu_init(emu->bus, emu->mmu);
+  for(i=0; i < NUMCORES; i++) {
+    core_t *core = core_init(emu->cpu, i, hdr.entry);
+    core->trap_handler = trap_handler;
+    core_restore(core, &cores[i]);
+  }
+  fprintf(stderr, "emu::load_snapshot: loaded %s\n", path);
+  return true;
 }
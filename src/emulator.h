@@ -15,10 +15,18 @@ typedef struct _emulator_t {
   pthread_t   core_threads[NUMCORES];
   struct _core_thread_args_t core_thread_args[NUMCORES];
   struct _Elf32 *elf;
+  core_snapshot_t snapshot[NUMCORES];
+  bool        snapshot_point; // the guest stopped for a snapshot, see sys_snapshot
 } emulator_t;
 
 emulator_t *emulator_init();
 bool emulator_load_elf(emulator_t *emu, const char *filename);
 void emulator_run(emulator_t *emu, const char *argv1);
+void emulator_setup(emulator_t *emu, const char *argv1);
+bool emulator_execute(emulator_t *emu);
+bool emulator_snapshot(emulator_t *emu);
+void emulator_restore(emulator_t *emu);
+bool emulator_save_snapshot(emulator_t *emu, const char *path, const char *filename, const char *argv1);
+bool emulator_load_snapshot(emulator_t *emu, const char *path, const char *filename, const char *argv1);
 
 #endif
@@ -0,0 +1,235 @@
+/**
+Copyright 2022 orIgo <mrorigo@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include "fpu.h"
+
+// The host has no ties-away mode, RMM rounds arithmetic to nearest even.
+// Conversions to integer, done in fpu_to_int, honour it exactly.
+int fpu_host_round(const uint32_t rm)
+{
+  switch(rm) {
+  case RM_RTZ: return FE_TOWARDZERO;
+  case RM_RDN: return FE_DOWNWARD;
+  case RM_RUP: return FE_UPWARD;
+  default:     return FE_TONEAREST;
+  }
+}
+
+// Fold the host exception flags into fcsr
+void fpu_sync_flags(csr_t *csr)
+{
+  const int host = fetestexcept(FE_ALL_EXCEPT);
+  uint32_t flags = 0;
+  if(host & FE_INEXACT)   flags |= FFLAG_NX;
+  if(host & FE_UNDERFLOW) flags |= FFLAG_UF;
+  if(host & FE_OVERFLOW)  flags |= FFLAG_OF;
+  if(host & FE_DIVBYZERO) flags |= FFLAG_DZ;
+  if(host & FE_INVALID)   flags |= FFLAG_NV;
+  csr->state[fcsr] |= flags;
+  feclearexcept(FE_ALL_EXCEPT);
+}
+
+// The host FPU state is per thread: a thread about to run a core starts
+// from no flags and the core's frm
+void fpu_host_enter(const csr_t *csr)
+{
+  feclearexcept(FE_ALL_EXCEPT);
+  fesetround(fpu_host_round((csr->state[fcsr] >> FRM_SHIFT) & 7));
+}
+
+uint32_t fpu_csr_read(csr_t *csr, const uint32_t addr)
+{
+  fpu_sync_flags(csr);
+  const uint32_t v = csr->state[fcsr] & FCSR_MASK;
+  switch(addr) {
+  case fflags: return v & FFLAGS_MASK;
+  case frm:    return v >> FRM_SHIFT;
+  default:     return v;
+  }
+}
+
+void fpu_csr_write(csr_t *csr, const uint32_t addr, const uint32_t value)
+{
+  fpu_sync_flags(csr);
+  uint32_t v = csr->state[fcsr] & FCSR_MASK;
+  switch(addr) {
+  case fflags: v = (v & ~FFLAGS_MASK) | (value & FFLAGS_MASK);       break;
+  case frm:    v = (v & FFLAGS_MASK) | ((value & 7) << FRM_SHIFT);   break;
+  default:     v = value & FCSR_MASK;                                break;
+  }
+  csr->state[fcsr] = v;
+  fesetround(fpu_host_round(v >> FRM_SHIFT));
+}
+
+// Integer part of x by clearing fraction bits, so that no host flag is
+// raised. x - fpu_trunc(x) is then exact as well.
+static double fpu_trunc(const double x)
+{
+  uint64_t b;
+  memcpy(&b, &x, sizeof(b));
+  const int e = (int)((b >> 52) & 0x7ff) - 1023;
+  if(e >= 52) {
+    return x;
+  }
+  b &= e < 0 ? 1ull << 63 : ~((1ull << (52 - e)) - 1);
+  double t;
+  memcpy(&t, &b, sizeof(t));
+  return t;
+}
+
+// FCVT.W[U].[SD]: round in the given mode, saturate and raise only NV when
+// out of range. Singles convert to double exactly, so one version serves
+// both. All of it is exact arithmetic, the host flags are left alone.
+uint32_t fpu_to_int(csr_t *csr, const double x, const int rm, const bool sign)
+{
+  if(fpu_isnan_d(fpu_bits_d(x))) {
+    fpu_raise(csr, FFLAG_NV);
+    return sign ? 0x7fffffff : 0xffffffff;
+  }
+
+  const double t = fpu_trunc(x), frac = x - t;
+  double r = t;
+  if(frac != 0) {
+    const double away = frac > 0 ? t + 1 : t - 1;
+    const double half = frac > 0 ? frac : -frac;
+    switch(rm) {
+    case RM_RTZ: break;
+    case RM_RDN: r = frac < 0 ? away : t; break;
+    case RM_RUP: r = frac > 0 ? away : t; break;
+    case RM_RMM: r = half >= 0.5 ? away : t; break;
+    default:     r = half > 0.5 || (half == 0.5 && ((int64_t)t & 1)) ? away : t; break;
+    }
+  }
+
+  if(sign) {
+    if(r < -2147483648.0 || r > 2147483647.0) {
+      fpu_raise(csr, FFLAG_NV);
+      return r < 0 ? 0x80000000 : 0x7fffffff;
+    }
+  } else if(r < 0 || r > 4294967295.0) { // -0.x rounded to -0 is fine
+    fpu_raise(csr, FFLAG_NV);
+    return r < 0 ? 0 : 0xffffffff;
+  }
+  if(frac != 0) {
+    fpu_raise(csr, FFLAG_NX);
+  }
+  return sign ? (uint32_t)(int32_t)r : (uint32_t)(int64_t)r;
+}
+
+// FMIN/FMAX: a single NaN operand gives the other, -0 orders below +0, and
+// only signaling NaNs raise NV
+uint64_t fpu_min_s(csr_t *csr, const uint64_t a, const uint64_t b, const bool max)
+{
+  const uint32_t x = fpu_bits_s(a), y = fpu_bits_s(b);
+  if(fpu_issnan_s(x) || fpu_issnan_s(y)) {
+    fpu_raise(csr, FFLAG_NV);
+  }
+  if(fpu_isnan_s(x)) {
+    return fpu_box_s(fpu_isnan_s(y) ? FPU_NAN_S : y);
+  } else if(fpu_isnan_s(y)) {
+    return fpu_box_s(x);
+  }
+  const float fx = fpu_s(a), fy = fpu_s(b);
+  const bool pick_x = fx == fy ? (bool)(x >> 31) != max : (max ? fx > fy : fx < fy);
+  return fpu_box_s(pick_x ? x : y);
+}
+
+uint64_t fpu_min_d(csr_t *csr, const uint64_t a, const uint64_t b, const bool max)
+{
+  if(fpu_issnan_d(a) || fpu_issnan_d(b)) {
+    fpu_raise(csr, FFLAG_NV);
+  }
+  if(fpu_isnan_d(a)) {
+    return fpu_isnan_d(b) ? FPU_NAN_D : b;
+  } else if(fpu_isnan_d(b)) {
+    return a;
+  }
+  const double fx = fpu_d(a), fy = fpu_d(b);
+  const bool pick_x = fx == fy ? (bool)(a >> 63) != max : (max ? fx > fy : fx < fy);
+  return pick_x ? a : b;
+}
+
+// FLE (funct3 0), FLT (1) and FEQ (2). FLT and FLE raise NV on any NaN,
+// FEQ only on signaling ones.
+uint32_t fpu_cmp_s(csr_t *csr, const uint64_t a, const uint64_t b, const uint32_t funct3)
+{
+  const uint32_t x = fpu_bits_s(a), y = fpu_bits_s(b);
+  if(fpu_isnan_s(x) || fpu_isnan_s(y)) {
+    if(funct3 != 0b010 || fpu_issnan_s(x) || fpu_issnan_s(y)) {
+      fpu_raise(csr, FFLAG_NV);
+    }
+    return 0;
+  }
+  const float fx = fpu_s(a), fy = fpu_s(b);
+  switch(funct3) {
+  case 0b000: return fx <= fy;
+  case 0b001: return fx < fy;
+  default:    return fx == fy;
+  }
+}
+
+uint32_t fpu_cmp_d(csr_t *csr, const uint64_t a, const uint64_t b, const uint32_t funct3)
+{
+  if(fpu_isnan_d(a) || fpu_isnan_d(b)) {
+    if(funct3 != 0b010 || fpu_issnan_d(a) || fpu_issnan_d(b)) {
+      fpu_raise(csr, FFLAG_NV);
+    }
+    return 0;
+  }
+  const double fx = fpu_d(a), fy = fpu_d(b);
+  switch(funct3) {
+  case 0b000: return fx <= fy;
+  case 0b001: return fx < fy;
+  default:    return fx == fy;
+  }
+}
+
+// FCLASS: one bit of -inf, -normal, -subnormal, -0, +0, +subnormal,
+// +normal, +inf, signaling NaN, quiet NaN
+static uint32_t fpu_class(const bool neg, const bool exp_zero, const bool exp_ones, const bool frac_zero, const bool quiet)
+{
+  if(exp_ones) {
+    if(frac_zero) {
+      return neg ? 1 << 0 : 1 << 7;
+    }
+    return quiet ? 1 << 9 : 1 << 8;
+  }
+  if(exp_zero) {
+    if(frac_zero) {
+      return neg ? 1 << 3 : 1 << 4;
+    }
+    return neg ? 1 << 2 : 1 << 5;
+  }
+  return neg ? 1 << 1 : 1 << 6;
+}
+
+uint32_t fpu_class_s(const uint64_t r)
+{
+  const uint32_t b = fpu_bits_s(r);
+  const uint32_t exp = (b >> 23) & 0xff, frac = b & 0x7fffff;
+  return fpu_class(b >> 31, exp == 0, exp == 0xff, frac == 0, (b >> 22) & 1);
+}
+
+uint32_t fpu_class_d(const uint64_t b)
+{
+  const uint32_t exp = (b >> 52) & 0x7ff;
+  const uint64_t frac = b & 0xfffffffffffffull;
+  return fpu_class(b >> 63, exp == 0, exp == 0x7ff, frac == 0, (b >> 51) & 1);
+}
@@ -0,0 +1,200 @@
+/**
+Copyright 2022 orIgo <mrorigo@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef __FPU_H__
+#define __FPU_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fenv.h>
+#include <math.h>
+#include "csr.h"
+
+// F and D on the host FPU. Floating point registers hold doubles, singles
+// are NaN-boxed in the low half. The exception flags accumulate in the host
+// FPU status register of the core thread and are folded into fcsr when the
+// guest reads it, and the host rounding mode follows frm, so an instruction
+// with the dynamic rounding mode runs as a single host instruction.
+
+// fcsr: fflags in bits 0-4, frm in bits 5-7
+#define FFLAG_NX	0x01 // inexact
+#define FFLAG_UF	0x02 // underflow
+#define FFLAG_OF	0x04 // overflow
+#define FFLAG_DZ	0x08 // divide by zero
+#define FFLAG_NV	0x10 // invalid operation
+#define FFLAGS_MASK	0x1f
+#define FRM_SHIFT	5
+#define FCSR_MASK	0xff
+
+typedef enum _fpu_rm_t {
+  RM_RNE = 0, // to nearest, ties to even
+  RM_RTZ = 1, // towards zero
+  RM_RDN = 2, // down
+  RM_RUP = 3, // up
+  RM_RMM = 4, // to nearest, ties away from zero
+  RM_DYN = 7  // frm
+} fpu_rm_t;
+
+#define FPU_NAN_S	0x7fc00000u
+#define FPU_NAN_D	0x7ff8000000000000ull
+#define FPU_BOX		0xffffffff00000000ull
+
+// Raw register bits. An improperly boxed single reads as the canonical NaN.
+static inline uint32_t fpu_bits_s(const uint64_t r)
+{
+  return (r & FPU_BOX) == FPU_BOX ? (uint32_t)r : FPU_NAN_S;
+}
+
+static inline float fpu_s(const uint64_t r)
+{
+  const uint32_t b = fpu_bits_s(r);
+  float f;
+  memcpy(&f, &b, sizeof(f));
+  return f;
+}
+
+static inline uint64_t fpu_bits_d(const double f)
+{
+  uint64_t b;
+  memcpy(&b, &f, sizeof(b));
+  return b;
+}
+
+static inline double fpu_d(const uint64_t r)
+{
+  double f;
+  memcpy(&f, &r, sizeof(f));
+  return f;
+}
+
+static inline uint64_t fpu_box_s(const uint32_t b)
+{
+  return FPU_BOX | b;
+}
+
+static inline bool fpu_isnan_s(const uint32_t b)
+{
+  return (b & 0x7fffffff) > 0x7f800000;
+}
+
+static inline bool fpu_isnan_d(const uint64_t b)
+{
+  return (b & 0x7fffffffffffffffull) > 0x7ff0000000000000ull;
+}
+
+static inline bool fpu_issnan_s(const uint32_t b)
+{
+  return fpu_isnan_s(b) && !(b & 0x00400000);
+}
+
+static inline bool fpu_issnan_d(const uint64_t b)
+{
+  return fpu_isnan_d(b) && !(b & 0x0008000000000000ull);
+}
+
+// Arithmetic results, with NaNs made canonical
+static inline uint64_t fpu_result_s(const float f)
+{
+  uint32_t b;
+  memcpy(&b, &f, sizeof(b));
+  return fpu_box_s(fpu_isnan_s(b) ? FPU_NAN_S : b);
+}
+
+static inline uint64_t fpu_result_d(const double f)
+{
+  const uint64_t b = fpu_bits_d(f);
+  return fpu_isnan_d(b) ? FPU_NAN_D : b;
+}
+
+static inline void fpu_raise(csr_t *csr, const uint32_t flags)
+{
+  csr->state[fcsr] |= flags;
+}
+
+// Rounding mode of an instruction, RM_DYN resolved, or -1 if reserved
+static inline int fpu_rm(const csr_t *csr, const uint32_t rm)
+{
+  const uint32_t r = rm == RM_DYN ? (csr->state[fcsr] >> FRM_SHIFT) & 7 : rm;
+  return r <= RM_RMM ? (int)r : -1;
+}
+
+// The fused multiply-adds must raise NV for infinity times zero even with a
+// quiet NaN addend
+static inline float fpu_fma_s(csr_t *csr, const float a, const float b, const float c)
+{
+  if((isinf(a) && b == 0) || (a == 0 && isinf(b))) {
+    fpu_raise(csr, FFLAG_NV);
+  }
+  return fmaf(a, b, c);
+}
+
+static inline double fpu_fma_d(csr_t *csr, const double a, const double b, const double c)
+{
+  if((isinf(a) && b == 0) || (a == 0 && isinf(b))) {
+    fpu_raise(csr, FFLAG_NV);
+  }
+  return fma(a, b, c);
+}
+
+int  fpu_host_round(const uint32_t rm);
+
+// Switch the host to the static rounding mode of an instruction, if it is
+// not frm already. restore is the host mode to put back, -1 for none.
+// False for a reserved rounding mode.
+static inline bool fpu_round_begin(const csr_t *csr, const uint32_t rm, int *restore)
+{
+  const uint32_t frm = (csr->state[fcsr] >> FRM_SHIFT) & 7;
+  *restore = -1;
+  if(rm == RM_DYN || rm == frm) {
+    return frm <= RM_RMM;
+  }
+  if(rm > RM_RMM) {
+    return false;
+  }
+  *restore = fpu_host_round(frm);
+  fesetround(fpu_host_round(rm));
+  return true;
+}
+
+// Put the host rounding mode back after computing r in a static one. The
+// empty asm pins r in memory first, as the compiler is otherwise free to
+// sink the arithmetic below fesetround(), -frounding-math or not.
+#define fpu_round_end(restore, r) do {			\
+    if((restore) >= 0) {				\
+      __asm__ volatile("" : "+m"(r));			\
+      fesetround(restore);				\
+    }							\
+  } while(0)
+
+void	 fpu_sync_flags(csr_t *);
+void	 fpu_host_enter(const csr_t *);
+uint32_t fpu_csr_read(csr_t *, const uint32_t addr);
+void	 fpu_csr_write(csr_t *, const uint32_t addr, const uint32_t value);
+
+uint32_t fpu_to_int(csr_t *, const double, const int rm, const bool sign);
+uint64_t fpu_min_s(csr_t *, const uint64_t, const uint64_t, const bool max);
+uint64_t fpu_min_d(csr_t *, const uint64_t, const uint64_t, const bool max);
+uint32_t fpu_cmp_s(csr_t *, const uint64_t, const uint64_t, const uint32_t funct3);
+uint32_t fpu_cmp_d(csr_t *, const uint64_t, const uint64_t, const uint32_t funct3);
+uint32_t fpu_class_s(const uint64_t);
+uint32_t fpu_class_d(const uint64_t);
+
+#endif
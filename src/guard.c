@@ -0,0 +1,155 @@
+/**
+Copyright 2022 orIgo <mrorigo@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#define _GNU_SOURCE // memfd_create, REG_RIP
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "config.h"
+#include "guard.h"
+
+#ifdef MMU_GUARD
+#include <signal.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+// Guest memory is a sparse memfd, mapped twice: the chunks' data, always
+// readable and writable for the checked paths, and the guard range with
+// per page protections. One page past 4 GiB keeps probes of the last
+// bytes from running out of the range.
+#define GUARD_SIZE (MMU_SPACE_SIZE + MMU_PAGE_SIZE)
+
+// The probes. A fault can only happen on their first instruction, which
+// the handler then skips to guard_probe_fail.
+__asm__(
+  ".text\n"
+  "guard_probe_start:\n"
+  ".globl guard_load8\n"
+  ".type guard_load8, @function\n"
+  "guard_load8:\n"
+  "  movzbl (%rdi), %eax\n"
+  "  movl %eax, (%rsi)\n"
+  "  movl $1, %eax\n"
+  "  ret\n"
+  ".globl guard_load16\n"
+  ".type guard_load16, @function\n"
+  "guard_load16:\n"
+  "  movzwl (%rdi), %eax\n"
+  "  movl %eax, (%rsi)\n"
+  "  movl $1, %eax\n"
+  "  ret\n"
+  ".globl guard_load32\n"
+  ".type guard_load32, @function\n"
+  "guard_load32:\n"
+  "  movl (%rdi), %eax\n"
+  "  movl %eax, (%rsi)\n"
+  "  movl $1, %eax\n"
+  "  ret\n"
+  ".globl guard_store8\n"
+  ".type guard_store8, @function\n"
+  "guard_store8:\n"
+  "  movb %sil, (%rdi)\n"
+  "  movl $1, %eax\n"
+  "  ret\n"
+  ".globl guard_store16\n"
+  ".type guard_store16, @function\n"
+  "guard_store16:\n"
+  "  movw %si, (%rdi)\n"
+  "  movl $1, %eax\n"
+  "  ret\n"
+  ".globl guard_store32\n"
+  ".type guard_store32, @function\n"
+  "guard_store32:\n"
+  "  movl %esi, (%rdi)\n"
+  "  movl $1, %eax\n"
+  "  ret\n"
+  "guard_probe_end:\n"
+  "guard_probe_fail:\n"
+  "  xorl %eax, %eax\n"
+  "  ret\n"
+);
+
+extern const char guard_probe_start[], guard_probe_end[], guard_probe_fail[];
+
+static struct sigaction previous;
+
+static void guard_fault(int sig, siginfo_t *info, void *context)
+{
+  ucontext_t *uc = (ucontext_t *)context;
+  const uintptr_t rip = uc->uc_mcontext.gregs[REG_RIP];
+  if(rip >= (uintptr_t)guard_probe_start && rip < (uintptr_t)guard_probe_end) {
+    uc->uc_mcontext.gregs[REG_RIP] = (greg_t)(uintptr_t)guard_probe_fail;
+    return;
+  }
+  // Not a probe: a host bug, let it take its usual course
+  (void)info;
+  sigaction(sig, &previous, NULL);
+}
+
+bool guard_init(mmu_t *mmu)
+{
+  static bool installed = false;
+  if(!installed) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = guard_fault;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    if(sigaction(SIGSEGV, &sa, &previous) != 0) {
+      return false;
+    }
+    installed = true;
+  }
+
+  mmu->guard_fd = memfd_create("guest", MFD_CLOEXEC);
+  if(mmu->guard_fd < 0 || ftruncate(mmu->guard_fd, MMU_SPACE_SIZE) != 0) {
+    fprintf(stderr, "guard::init: no memfd for guest memory\n");
+    return false;
+  }
+  void *p = mmap(NULL, GUARD_SIZE, PROT_NONE, MAP_SHARED|MAP_NORESERVE, mmu->guard_fd, 0);
+  if(p == MAP_FAILED) {
+    fprintf(stderr, "guard::init: could not reserve the guard region\n");
+    close(mmu->guard_fd);
+    return false;
+  }
+  mmu->guard = p;
+  return true;
+}
+
+// The checked view of the chunk at first
+uint8_t *guard_map_chunk(mmu_t *mmu, const size_t first)
+{
+  void *p = mmap(NULL, MMU_CHUNK_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_NORESERVE, mmu->guard_fd, first);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+// Give the page at vaddr the host protection for access, MPERM_READ and
+// MPERM_WRITE
+void guard_protect(mmu_t *mmu, const vaddr_t vaddr, const mperm_t access)
+{
+  const int prot = ((access & MPERM_READ) ? PROT_READ : 0) | ((access & MPERM_WRITE) ? PROT_WRITE : 0);
+  if(mprotect(mmu->guard + vaddr, MMU_PAGE_SIZE, prot) != 0) {
+    fprintf(stderr, "guard::protect: mprotect of 0x%08x failed\n", vaddr);
+  }
+}
+
+#endif
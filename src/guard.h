@@ -0,0 +1,66 @@
+/**
+Copyright 2022 orIgo <mrorigo@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef __GUARD_H__
+#define __GUARD_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include "mmio.h"
+#include "mmu.h"
+
+// Guard region mode (MMU_GUARD): all of guest memory is also mapped into
+// one 4 GiB host range, mmu->guard, so that guest address a is host
+// address mmu->guard + a. Each page there gets the host protection of the
+// accesses it allows without any bookkeeping (see mmu_host_page), the rest
+// stays inaccessible. Bare mode loads and stores try the host access
+// through the probes below first; a fault in a probe is caught by a
+// SIGSEGV handler that makes the probe return false, and the access is
+// redone by the checked path, which raises the trap if it is one.
+bool	 guard_init(mmu_t *);
+uint8_t	*guard_map_chunk(mmu_t *, const size_t);
+void	 guard_protect(mmu_t *, const vaddr_t, const mperm_t);
+
+bool	 guard_load8(const uint8_t *, uint32_t *);
+bool	 guard_load16(const uint8_t *, uint32_t *);
+bool	 guard_load32(const uint8_t *, uint32_t *);
+bool	 guard_store8(uint8_t *, const uint32_t);
+bool	 guard_store16(uint8_t *, const uint32_t);
+bool	 guard_store32(uint8_t *, const uint32_t);
+
+static inline bool guard_load(const uint8_t *host, const memory_access_width_t aw, uint32_t *out)
+{
+  switch(aw) {
+  case BYTE:     return guard_load8(host, out);
+  case HALFWORD: return guard_load16(host, out);
+  default:       return guard_load32(host, out);
+  }
+}
+
+static inline bool guard_store(uint8_t *host, const memory_access_width_t aw, const uint32_t value)
+{
+  switch(aw) {
+  case BYTE:     return guard_store8(host, value);
+  case HALFWORD: return guard_store16(host, value);
+  default:       return guard_store32(host, value);
+  }
+}
+
+#endif
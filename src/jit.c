@@ -0,0 +1,746 @@
+/**
+Copyright 2022 orIgo <mrorigo@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+#include "jit.h"
+
+#ifdef CPU_JIT
+#include <unistd.h>
+#include <sys/mman.h>
+
+// Host registers, in x86-64 encoding order
+typedef enum _hreg_t {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15
+} hreg_t;
+
+// Condition codes for setcc/jcc
+typedef enum _cc_t {
+  CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7,
+  CC_L = 0xc, CC_GE = 0xd, CC_G = 0xf
+} cc_t;
+
+// Group 1 ALU operations, as the /r opcode and the /digit of 0x81
+typedef enum _alu_t {
+  ALU_ADD = 0, ALU_OR = 1, ALU_AND = 4, ALU_SUB = 5, ALU_XOR = 6, ALU_CMP = 7
+} alu_t;
+
+// Group 2 shift operations, the /digit of 0xc1 and 0xd3
+typedef enum _shift_t {
+  SHIFT_ROL = 0, SHIFT_ROR = 1, SHIFT_SHL = 4, SHIFT_SHR = 5, SHIFT_SAR = 7
+} shift_t;
+
+#define JIT_CORE     R15	// core_t *, for the whole block
+#define JIT_CACHED   5		// guest registers kept in host registers
+#define JIT_NOREG    -1
+
+static const hreg_t cache_regs[JIT_CACHED] = { RBX, RBP, R12, R13, R14 };
+
+#define REG_OFFSET(x)  ((int32_t)(offsetof(core_t, registers) + (x) * sizeof(uint32_t)))
+#define STATE_OFFSET   ((int32_t)offsetof(core_t, state))
+
+// Worst case code size, generous
+#define JIT_MAX_INSTR_SIZE 128
+#define JIT_MAX_EXIT_SIZE  (16 + JIT_CACHED * 8)
+#define JIT_BLOCK_SIZE     (64 + BLOCK_MAX_INSTRS * (JIT_MAX_INSTR_SIZE + JIT_MAX_EXIT_SIZE) + 2 * JIT_MAX_EXIT_SIZE)
+
+typedef struct _emit_t {
+  uint8_t *p;
+  uint8_t *end;			// nothing is written from here on
+  bool     full;		// the code did not fit before end
+  int8_t   host[NUMREGS];	// guest -> host register, or JIT_NOREG
+  bool     dirty[NUMREGS];	// cached and written in the block
+} emit_t;
+
+static inline void emit8(emit_t *e, const uint8_t b)
+{
+  if(e->p == e->end) {
+    e->full = true;
+    return;
+  }
+  *e->p++ = b;
+}
+
+static inline void emit32(emit_t *e, const uint32_t v)
+{
+  if(e->end - e->p < (ptrdiff_t)sizeof(v)) {
+    e->full = true;
+    return;
+  }
+  memcpy(e->p, &v, sizeof(v));
+  e->p += sizeof(v);
+}
+
+static inline void emit64(emit_t *e, const uint64_t v)
+{
+  if(e->end - e->p < (ptrdiff_t)sizeof(v)) {
+    e->full = true;
+    return;
+  }
+  memcpy(e->p, &v, sizeof(v));
+  e->p += sizeof(v);
+}
+
+// REX prefix, only emitted when needed
+static inline void emit_rex(emit_t *e, const bool w, const int reg, const int rm)
+{
+  const uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+  if(rex != 0x40) {
+    emit8(e, rex);
+  }
+}
+
+static inline void emit_modrm_rr(emit_t *e, const int reg, const int rm)
+{
+  emit8(e, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// [r15 + disp32]
+static inline void emit_modrm_core(emit_t *e, const int reg, const int32_t disp)
+{
+  emit8(e, 0x80 | ((reg & 7) << 3) | (JIT_CORE & 7));
+  emit32(e, disp);
+}
+
+static void mov_rr(emit_t *e, const hreg_t dst, const hreg_t src)
+{
+  if(dst == src) {
+    return;
+  }
+  emit_rex(e, false, src, dst);
+  emit8(e, 0x89);
+  emit_modrm_rr(e, src, dst);
+}
+
+static void mov_ri(emit_t *e, const hreg_t dst, const uint32_t imm)
+{
+  emit_rex(e, false, 0, dst);
+  emit8(e, 0xb8 + (dst & 7));
+  emit32(e, imm);
+}
+
+static void mov_r_core(emit_t *e, const hreg_t dst, const int32_t disp)
+{
+  emit_rex(e, false, dst, JIT_CORE);
+  emit8(e, 0x8b);
+  emit_modrm_core(e, dst, disp);
+}
+
+static void mov_core_r(emit_t *e, const int32_t disp, const hreg_t src)
+{
+  emit_rex(e, false, src, JIT_CORE);
+  emit8(e, 0x89);
+  emit_modrm_core(e, src, disp);
+}
+
+static void alu_rr(emit_t *e, const alu_t op, const hreg_t dst, const hreg_t src)
+{
+  emit_rex(e, false, src, dst);
+  emit8(e, (op << 3) | 0x01);
+  emit_modrm_rr(e, src, dst);
+}
+
+static void alu_ri(emit_t *e, const alu_t op, const hreg_t dst, const int32_t imm)
+{
+  emit_rex(e, false, 0, dst);
+  if(imm >= -128 && imm <= 127) {
+    emit8(e, 0x83);
+    emit_modrm_rr(e, op, dst);
+    emit8(e, (uint8_t)imm);
+  } else {
+    emit8(e, 0x81);
+    emit_modrm_rr(e, op, dst);
+    emit32(e, (uint32_t)imm);
+  }
+}
+
+static void shift_rcl(emit_t *e, const shift_t op, const hreg_t dst)
+{
+  emit_rex(e, false, 0, dst);
+  emit8(e, 0xd3);
+  emit_modrm_rr(e, op, dst);
+}
+
+static void shift_ri(emit_t *e, const shift_t op, const hreg_t dst, const uint8_t imm)
+{
+  emit_rex(e, false, 0, dst);
+  emit8(e, 0xc1);
+  emit_modrm_rr(e, op, dst);
+  emit8(e, imm);
+}
+
+// Two byte 0x0f opcodes on eax and a scratch register: cmovcc, bt*, movzx/movsx
+static void op0f_rr(emit_t *e, const uint8_t op, const hreg_t reg, const hreg_t rm)
+{
+  emit_rex(e, false, reg, rm);
+  emit8(e, 0x0f);
+  emit8(e, op);
+  emit_modrm_rr(e, reg, rm);
+}
+
+static void not_r(emit_t *e, const hreg_t dst)
+{
+  emit_rex(e, false, 0, dst);
+  emit8(e, 0xf7);
+  emit_modrm_rr(e, 2, dst);
+}
+
+// eax = cc ? 1 : 0
+static void setcc_eax(emit_t *e, const cc_t cc)
+{
+  emit8(e, 0x0f); emit8(e, 0x90 | cc); emit8(e, 0xc0); // setcc al
+  emit8(e, 0x0f); emit8(e, 0xb6); emit8(e, 0xc0);      // movzx eax, al
+}
+
+// Forward jump, returns the location of the rel32 to patch
+static uint8_t *jcc_forward(emit_t *e, const cc_t cc)
+{
+  emit8(e, 0x0f);
+  emit8(e, 0x80 | cc);
+  uint8_t *rel = e->p;
+  emit32(e, 0);
+  return rel;
+}
+
+static void patch_here(emit_t *e, uint8_t *rel)
+{
+  if(e->full) {
+    return; // rel may not have been emitted
+  }
+  const int32_t d = (int32_t)(e->p - (rel + 4));
+  memcpy(rel, &d, sizeof(d));
+}
+
+static void call_helper(emit_t *e, const void *fn)
+{
+  // mov rdi, r15
+  emit8(e, 0x4c); emit8(e, 0x89); emit8(e, 0xff);
+  // mov rax, imm64; call rax
+  emit8(e, 0x48); emit8(e, 0xb8); emit64(e, (uint64_t)(uintptr_t)fn);
+  emit8(e, 0xff); emit8(e, 0xd0);
+}
+
+// Guest register into a host scratch register
+static void get_reg(emit_t *e, const hreg_t dst, const uint8_t guest)
+{
+  if(guest == 0) {
+    alu_rr(e, ALU_XOR, dst, dst);
+  } else if(e->host[guest] != JIT_NOREG) {
+    mov_rr(e, dst, (hreg_t)e->host[guest]);
+  } else {
+    mov_r_core(e, dst, REG_OFFSET(guest));
+  }
+}
+
+// Host scratch register into a guest register
+static void set_reg(emit_t *e, const uint8_t guest, const hreg_t src)
+{
+  if(guest == 0) {
+    return;
+  } else if(e->host[guest] != JIT_NOREG) {
+    mov_rr(e, (hreg_t)e->host[guest], src);
+  } else {
+    mov_core_r(e, REG_OFFSET(guest), src);
+  }
+}
+
+static void emit_prologue(emit_t *e)
+{
+  static const hreg_t saved[] = { RBX, RBP, R12, R13, R14, R15 };
+  for(size_t i=0; i < sizeof(saved)/sizeof(saved[0]); i++) {
+    emit_rex(e, false, 0, saved[i]);
+    emit8(e, 0x50 + (saved[i] & 7));
+  }
+  // keep the stack 16 byte aligned for helper calls
+  emit8(e, 0x48); emit8(e, 0x83); emit8(e, 0xec); emit8(e, 0x08);
+  // mov r15, rdi
+  emit8(e, 0x49); emit8(e, 0x89); emit8(e, 0xff);
+
+  for(size_t g=1; g < NUMREGS; g++) {
+    if(e->host[g] != JIT_NOREG) {
+      mov_r_core(e, (hreg_t)e->host[g], REG_OFFSET(g));
+    }
+  }
+}
+
+// Write back cached registers and return. eax holds the next pc, unless
+// a constant one is given.
+static void emit_exit(emit_t *e, const bool constant, const vaddr_t pc)
+{
+  static const hreg_t saved[] = { R15, R14, R13, R12, RBP, RBX };
+  for(size_t g=1; g < NUMREGS; g++) {
+    if(e->dirty[g]) {
+      mov_core_r(e, REG_OFFSET(g), (hreg_t)e->host[g]);
+    }
+  }
+  if(constant) {
+    mov_ri(e, RAX, pc);
+  }
+  emit8(e, 0x48); emit8(e, 0x83); emit8(e, 0xc4); emit8(e, 0x08);
+  for(size_t i=0; i < sizeof(saved)/sizeof(saved[0]); i++) {
+    emit_rex(e, false, 0, saved[i]);
+    emit8(e, 0x58 + (saved[i] & 7));
+  }
+  emit8(e, 0xc3);
+}
+
+// Leave the block at pc if the last helper call trapped
+static void emit_trap_check(emit_t *e, const vaddr_t pc)
+{
+  // cmp byte [r15+state], TRAP; jne over
+  emit8(e, 0x41); emit8(e, 0x80);
+  emit_modrm_core(e, 7, STATE_OFFSET);
+  emit8(e, TRAP);
+  uint8_t *over = jcc_forward(e, CC_NE);
+  emit_exit(e, true, pc);
+  patch_here(e, over);
+}
+
+// Memory helpers called from generated code
+static uint32_t jit_lb(core_t *core, vaddr_t addr)
+{
+  uint32_t v = 0;
+  (void)core_load(core, addr, BYTE, &v);
+  return (int32_t)(int8_t)v;
+}
+
+static uint32_t jit_lh(core_t *core, vaddr_t addr)
+{
+  uint32_t v = 0;
+  (void)core_load(core, addr, HALFWORD, &v);
+  return (int32_t)(int16_t)v;
+}
+
+static uint32_t jit_lw(core_t *core, vaddr_t addr)
+{
+  uint32_t v = 0;
+  (void)core_load(core, addr, WORD, &v);
+  return v;
+}
+
+static uint32_t jit_lbu(core_t *core, vaddr_t addr)
+{
+  uint32_t v = 0;
+  (void)core_load(core, addr, BYTE, &v);
+  return v & 0xff;
+}
+
+static uint32_t jit_lhu(core_t *core, vaddr_t addr)
+{
+  uint32_t v = 0;
+  (void)core_load(core, addr, HALFWORD, &v);
+  return v & 0xffff;
+}
+
+static void jit_sb(core_t *core, vaddr_t addr, uint32_t v)
+{
+  (void)core_store(core, addr, v & 0xff, BYTE);
+}
+
+static void jit_sh(core_t *core, vaddr_t addr, uint32_t v)
+{
+  (void)core_store(core, addr, v & 0xffff, HALFWORD);
+}
+
+static void jit_sw(core_t *core, vaddr_t addr, uint32_t v)
+{
+  (void)core_store(core, addr, v, WORD);
+}
+
+// RV32M helpers for what has no single x86 instruction
+static uint32_t jit_mulh(core_t *core, uint32_t a, uint32_t b)   { (void)core; return rv32m_mulh(a, b); }
+static uint32_t jit_mulhsu(core_t *core, uint32_t a, uint32_t b) { (void)core; return rv32m_mulhsu(a, b); }
+static uint32_t jit_mulhu(core_t *core, uint32_t a, uint32_t b)  { (void)core; return rv32m_mulhu(a, b); }
+static uint32_t jit_div(core_t *core, uint32_t a, uint32_t b)    { (void)core; return rv32m_div(a, b); }
+static uint32_t jit_divu(core_t *core, uint32_t a, uint32_t b)   { (void)core; return rv32m_divu(a, b); }
+static uint32_t jit_rem(core_t *core, uint32_t a, uint32_t b)    { (void)core; return rv32m_rem(a, b); }
+static uint32_t jit_remu(core_t *core, uint32_t a, uint32_t b)   { (void)core; return rv32m_remu(a, b); }
+
+static uint32_t jit_clz(core_t *core, uint32_t a)  { (void)core; return rv32b_clz(a); }
+static uint32_t jit_ctz(core_t *core, uint32_t a)  { (void)core; return rv32b_ctz(a); }
+static uint32_t jit_cpop(core_t *core, uint32_t a) { (void)core; return rv32b_cpop(a); }
+static uint32_t jit_orcb(core_t *core, uint32_t a) { (void)core; return rv32b_orcb(a); }
+
+static bool emit_muldiv(emit_t *e, const dinstr_t *d)
+{
+  const void *fn;
+  switch(d->op) {
+  case OP_MULH:   fn = jit_mulh;   break;
+  case OP_MULHSU: fn = jit_mulhsu; break;
+  case OP_MULHU:  fn = jit_mulhu;  break;
+  case OP_DIV:    fn = jit_div;    break;
+  case OP_DIVU:   fn = jit_divu;   break;
+  case OP_REM:    fn = jit_rem;    break;
+  case OP_REMU:   fn = jit_remu;   break;
+  default: return false;
+  }
+  get_reg(e, RSI, d->rs1);
+  get_reg(e, RDX, d->rs2);
+  call_helper(e, fn);
+  set_reg(e, d->rd, RAX);
+  return true;
+}
+
+static bool emit_alu_r(emit_t *e, const dinstr_t *d)
+{
+  if(d->op != OP_MUL && (d->op >> 11) == FUNCT7_KEY(1)) {
+    return emit_muldiv(e, d);
+  }
+  get_reg(e, RAX, d->rs1);
+  get_reg(e, RCX, d->rs2);
+  switch(d->op) {
+  case OP_ADD:  alu_rr(e, ALU_ADD, RAX, RCX); break;
+  case OP_SUB:  alu_rr(e, ALU_SUB, RAX, RCX); break;
+  case OP_XOR:  alu_rr(e, ALU_XOR, RAX, RCX); break;
+  case OP_OR:   alu_rr(e, ALU_OR, RAX, RCX);  break;
+  case OP_AND:  alu_rr(e, ALU_AND, RAX, RCX); break;
+  case OP_SLL:  shift_rcl(e, SHIFT_SHL, RAX); break;
+  case OP_SRL:  shift_rcl(e, SHIFT_SHR, RAX); break;
+  case OP_SRA:  shift_rcl(e, SHIFT_SAR, RAX); break;
+  case OP_SLT:  alu_rr(e, ALU_CMP, RAX, RCX); setcc_eax(e, CC_L); break;
+  case OP_SLTU: alu_rr(e, ALU_CMP, RAX, RCX); setcc_eax(e, CC_B); break;
+  case OP_MUL:  emit8(e, 0x0f); emit8(e, 0xaf); emit_modrm_rr(e, RAX, RCX); break; // imul eax, ecx
+  case OP_SH1ADD: shift_ri(e, SHIFT_SHL, RAX, 1); alu_rr(e, ALU_ADD, RAX, RCX); break;
+  case OP_SH2ADD: shift_ri(e, SHIFT_SHL, RAX, 2); alu_rr(e, ALU_ADD, RAX, RCX); break;
+  case OP_SH3ADD: shift_ri(e, SHIFT_SHL, RAX, 3); alu_rr(e, ALU_ADD, RAX, RCX); break;
+  case OP_ANDN: not_r(e, RCX); alu_rr(e, ALU_AND, RAX, RCX); break;
+  case OP_ORN:  not_r(e, RCX); alu_rr(e, ALU_OR, RAX, RCX);  break;
+  case OP_XNOR: alu_rr(e, ALU_XOR, RAX, RCX); not_r(e, RAX); break;
+  case OP_MIN:  alu_rr(e, ALU_CMP, RAX, RCX); op0f_rr(e, 0x40 | CC_G, RAX, RCX); break;
+  case OP_MAX:  alu_rr(e, ALU_CMP, RAX, RCX); op0f_rr(e, 0x40 | CC_L, RAX, RCX); break;
+  case OP_MINU: alu_rr(e, ALU_CMP, RAX, RCX); op0f_rr(e, 0x40 | CC_A, RAX, RCX); break;
+  case OP_MAXU: alu_rr(e, ALU_CMP, RAX, RCX); op0f_rr(e, 0x40 | CC_B, RAX, RCX); break;
+  case OP_ROL:  shift_rcl(e, SHIFT_ROL, RAX); break;
+  case OP_ROR:  shift_rcl(e, SHIFT_ROR, RAX); break;
+  case OP_ZEXT_H: op0f_rr(e, 0xb7, RAX, RAX); break;         // movzx eax, ax
+  case OP_BCLR: op0f_rr(e, 0xb3, RCX, RAX); break;           // btr eax, ecx
+  case OP_BINV: op0f_rr(e, 0xbb, RCX, RAX); break;           // btc eax, ecx
+  case OP_BSET: op0f_rr(e, 0xab, RCX, RAX); break;           // bts eax, ecx
+  case OP_BEXT: op0f_rr(e, 0xa3, RCX, RAX); setcc_eax(e, CC_B); break; // bt eax, ecx
+  default: return false;
+  }
+  set_reg(e, d->rd, RAX);
+  return true;
+}
+
+static bool emit_alu_i(emit_t *e, const dinstr_t *d)
+{
+  const void *fn = NULL;
+  switch(d->op) {
+  case OP_CLZ:   fn = jit_clz;  break;
+  case OP_CTZ:   fn = jit_ctz;  break;
+  case OP_CPOP:  fn = jit_cpop; break;
+  case OP_ORC_B: fn = jit_orcb; break;
+  default: break;
+  }
+  if(fn != NULL) {
+    get_reg(e, RSI, d->rs1);
+    call_helper(e, fn);
+    set_reg(e, d->rd, RAX);
+    return true;
+  }
+
+  get_reg(e, RAX, d->rs1);
+  switch(d->op) {
+  case OP_ADDI:  alu_ri(e, ALU_ADD, RAX, d->imm); break;
+  case OP_XORI:  alu_ri(e, ALU_XOR, RAX, d->imm); break;
+  case OP_ORI:   alu_ri(e, ALU_OR, RAX, d->imm);  break;
+  case OP_ANDI:  alu_ri(e, ALU_AND, RAX, d->imm); break;
+  case OP_SLLI:  shift_ri(e, SHIFT_SHL, RAX, d->imm); break;
+  case OP_SRLI:  shift_ri(e, SHIFT_SHR, RAX, d->imm); break;
+  case OP_SRAI:  shift_ri(e, SHIFT_SAR, RAX, d->imm); break;
+  case OP_SLTI:  alu_ri(e, ALU_CMP, RAX, d->imm); setcc_eax(e, CC_L); break;
+  case OP_SLTIU: alu_ri(e, ALU_CMP, RAX, d->imm); setcc_eax(e, CC_B); break;
+  case OP_RORI:  shift_ri(e, SHIFT_ROR, RAX, d->imm); break;
+  case OP_REV8:  emit8(e, 0x0f); emit8(e, 0xc8); break;      // bswap eax
+  case OP_SEXT_B: op0f_rr(e, 0xbe, RAX, RAX); break;        // movsx eax, al
+  case OP_SEXT_H: op0f_rr(e, 0xbf, RAX, RAX); break;        // movsx eax, ax
+  case OP_BCLRI: alu_ri(e, ALU_AND, RAX, ~(1u << d->imm)); break;
+  case OP_BINVI: alu_ri(e, ALU_XOR, RAX, 1u << d->imm); break;
+  case OP_BSETI: alu_ri(e, ALU_OR, RAX, 1u << d->imm);  break;
+  case OP_BEXTI: shift_ri(e, SHIFT_SHR, RAX, d->imm); alu_ri(e, ALU_AND, RAX, 1); break;
+  default: return false;
+  }
+  set_reg(e, d->rd, RAX);
+  return true;
+}
+
+static bool emit_load(emit_t *e, const dinstr_t *d)
+{
+  const void *fn;
+  switch(d->op) {
+  case OP_LB:  fn = jit_lb;  break;
+  case OP_LH:  fn = jit_lh;  break;
+  case OP_LW:  fn = jit_lw;  break;
+  case OP_LBU: fn = jit_lbu; break;
+  case OP_LHU: fn = jit_lhu; break;
+  default: return false;
+  }
+  get_reg(e, RSI, d->rs1);
+  alu_ri(e, ALU_ADD, RSI, d->imm);
+  call_helper(e, fn);
+  emit_trap_check(e, d->pc);
+  set_reg(e, d->rd, RAX);
+  return true;
+}
+
+static bool emit_store(emit_t *e, const dinstr_t *d)
+{
+  const void *fn;
+  switch(d->op) {
+  case OP_SB: fn = jit_sb; break;
+  case OP_SH: fn = jit_sh; break;
+  case OP_SW: fn = jit_sw; break;
+  default: return false;
+  }
+  get_reg(e, RSI, d->rs1);
+  alu_ri(e, ALU_ADD, RSI, d->imm);
+  get_reg(e, RDX, d->rs2);
+  call_helper(e, fn);
+  emit_trap_check(e, d->pc);
+  return true;
+}
+
+static bool emit_branch(emit_t *e, const dinstr_t *d)
+{
+  cc_t cc;
+  switch(d->op) {
+  case OP_BEQ:  cc = CC_E;  break;
+  case OP_BNE:  cc = CC_NE; break;
+  case OP_BLT:  cc = CC_L;  break;
+  case OP_BGE:  cc = CC_GE; break;
+  case OP_BLTU: cc = CC_B;  break;
+  case OP_BGEU: cc = CC_AE; break;
+  default: return false;
+  }
+  get_reg(e, RAX, d->rs1);
+  get_reg(e, RCX, d->rs2);
+  alu_rr(e, ALU_CMP, RAX, RCX);
+  uint8_t *taken = jcc_forward(e, cc);
+  emit_exit(e, true, d->pc + d->len);
+  patch_here(e, taken);
+  emit_exit(e, true, d->pc + d->imm);
+  return true;
+}
+
+// Emit one instruction, false if it has to be left to the interpreter
+static bool emit_instruction(emit_t *e, const dinstr_t *d)
+{
+  switch(d->optype) {
+  case R: return emit_alu_r(e, d);
+  case S: return emit_store(e, d);
+  case B: return emit_branch(e, d);
+
+  case I:
+    if(d->op == OP_JALR) {
+      get_reg(e, RAX, d->rs1);
+      alu_ri(e, ALU_ADD, RAX, d->imm);
+      alu_ri(e, ALU_AND, RAX, ~1);
+      mov_ri(e, RCX, d->pc + d->len);
+      set_reg(e, d->rd, RCX);
+      emit_exit(e, false, 0);
+      return true;
+    }
+    if((d->op & 0x7f) == (OP_LW & 0x7f)) {
+      return emit_load(e, d);
+    }
+    return emit_alu_i(e, d);
+
+  case U:
+    mov_ri(e, RAX, d->op == OP_LUI ? (uint32_t)d->imm : d->pc + d->imm);
+    set_reg(e, d->rd, RAX);
+    return true;
+
+  case J:
+    mov_ri(e, RAX, d->pc + d->len);
+    set_reg(e, d->rd, RAX);
+    emit_exit(e, true, d->pc + d->imm);
+    return true;
+
+  case C:
+    if(d->op == OP_FENCE) {
+      emit8(e, 0x0f); emit8(e, 0xae); emit8(e, 0xf0); // mfence
+      return true;
+    }
+    return false;
+
+  default:
+    return false;
+  }
+}
+
+// Pick the most used guest registers of the block for the host registers
+static void allocate_registers(emit_t *e, const dblock_t *b, const uint32_t count)
+{
+  uint32_t uses[NUMREGS] = { 0 };
+  bool written[NUMREGS] = { false };
+  for(uint32_t i=0; i < count; i++) {
+    const dinstr_t *d = &b->instrs[i];
+    uses[d->rs1]++;
+    uses[d->rs2]++;
+    uses[d->rd]++;
+    written[d->rd] = true;
+  }
+  uses[0] = 0;
+
+  memset(e->host, JIT_NOREG, sizeof(e->host));
+  memset(e->dirty, 0, sizeof(e->dirty));
+  for(size_t h=0; h < JIT_CACHED; h++) {
+    size_t best = 0;
+    for(size_t g=1; g < NUMREGS; g++) {
+      if(e->host[g] == JIT_NOREG && uses[g] > uses[best]) {
+	best = g;
+      }
+    }
+    if(uses[best] < 2) {
+      break;
+    }
+    e->host[best] = cache_regs[h];
+    e->dirty[best] = written[best];
+  }
+}
+
+jit_t *jit_init(void)
+{
+  jit_t *jit = malloc(sizeof(jit_t));
+  if(!jit) {
+    return NULL;
+  }
+  jit->size = JIT_CODE_SIZE;
+  jit->used = 0;
+  jit->scratch = malloc(JIT_BLOCK_SIZE);
+  // Never writable and executable at once, see jit_translate
+  jit->code = mmap(NULL, jit->size, PROT_READ|PROT_EXEC, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(jit->scratch == NULL || jit->code == MAP_FAILED) {
+    fprintf(stderr, "jit::init: could not map code buffer, using the interpreter\n");
+    if(jit->code != MAP_FAILED) {
+      munmap(jit->code, jit->size);
+    }
+    free(jit->scratch);
+    free(jit);
+    return NULL;
+  }
+  return jit;
+}
+
+// Drop all translations, every block starts counting towards JIT_THRESHOLD again
+static void jit_flush(core_t *core)
+{
+  for(size_t i=0; i < BLOCK_CACHE_SIZE; i++) {
+    core->blocks[i].native = NULL;
+    core->blocks[i].hits = 0;
+  }
+  core->jit->used = 0;
+}
+
+bool jit_translate(core_t *core, dblock_t *b)
+{
+  jit_t *jit = core->jit;
+  if(jit == NULL) {
+    return false;
+  }
+
+  // Everything but a trailing unsupported instruction must be translatable
+  uint32_t count = 0;
+  while(count < b->count) {
+    const dinstr_t *d = &b->instrs[count];
+    const bool known = d->optype == R || d->optype == I || d->optype == S ||
+      d->optype == B || d->optype == U || d->optype == J || d->op == OP_FENCE;
+    if(!known || d->op == OP_NONE) {
+      break;
+    }
+    count++;
+  }
+  if(count == 0 || count < b->count - 1) {
+    return false;
+  }
+
+  // The block is emitted into scratch first, so nothing is flushed or
+  // written to the code buffer for a block that turns out not to translate
+  emit_t e;
+  e.p = jit->scratch;
+  e.end = jit->scratch + JIT_BLOCK_SIZE;
+  e.full = false;
+  allocate_registers(&e, b, count);
+  emit_prologue(&e);
+
+  for(uint32_t i=0; i < count; i++) {
+    if(!emit_instruction(&e, &b->instrs[i])) {
+      return false;
+    }
+  }
+  // Fell off the end: continue in the interpreter, or with the next block
+  const dinstr_t *last = &b->instrs[count-1];
+  if(last->optype != B && last->optype != J && last->op != OP_JALR) {
+    emit_exit(&e, true, last->pc + last->len);
+  }
+  const size_t size = e.p - jit->scratch;
+  if(e.full || size > jit->size) {
+    return false;
+  }
+
+  // The code has no pc relative references out of the block, so it can
+  // be copied. Its pages are writable only while it is.
+  if(jit->used + size > jit->size) {
+    jit_flush(core);
+  }
+  uint8_t *start = jit->code + jit->used;
+  const uintptr_t page = sysconf(_SC_PAGESIZE);
+  uint8_t *first = (uint8_t *)((uintptr_t)start & ~(page - 1));
+  const size_t span = ((uintptr_t)(start + size) - (uintptr_t)first + page - 1) & ~(page - 1);
+  if(mprotect(first, span, PROT_READ|PROT_WRITE) != 0) {
+    return false;
+  }
+  memcpy(start, jit->scratch, size);
+  if(mprotect(first, span, PROT_READ|PROT_EXEC) != 0) {
+    // Translations on these pages can not run any more
+    fprintf(stderr, "jit::translate: could not protect code buffer, flushing it\n");
+    jit_flush(core);
+    return false;
+  }
+  jit->used += size;
+  b->native = (jit_fn_t)(void *)start;
+  b->native_count = count;
+
+#ifdef CPU_TRACE
+  fprintf(stderr, "jit::translate pc=0x%08x count=%u/%u size=%zu\n", b->pc, count, b->count, size);
+#endif
+  return true;
+}
+
+#else
+
+jit_t *jit_init(void)
+{
+  return NULL;
+}
+
+bool jit_translate(core_t *core, dblock_t *b)
+{
+  (void)core;
+  (void)b;
+  return false;
+}
+
+#endif
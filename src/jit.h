@@ -0,0 +1,43 @@
+/**
+Copyright 2022 orIgo <mrorigo@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef __JIT_H__
+#define __JIT_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include "cpu.h"
+
+// x86-64 translation of hot basic blocks. The generated code keeps the most
+// used guest registers of a block in host registers, calls back into
+// core_load/core_store for memory (and so into cause_trap on faults), and
+// returns the pc to continue at. Instructions it can not translate are left
+// to the interpreter.
+typedef struct _jit_t {
+  uint8_t *code;    // read and execute, only made writable to copy a block in
+  size_t   size;
+  size_t   used;
+  uint8_t *scratch; // where a block is emitted before it is copied to code
+} jit_t;
+
+jit_t	*jit_init(void);
+bool	 jit_translate(core_t *, dblock_t *);
+
+#endif
@@ -39,7 +39,21 @@ int main(int argc, const char **argv)
 
   emulator_t *emul = emulator_init();
 
-  emulator_load_elf(emul, argv[1]);
-  
-  emulator_run(emul, argv[2]);
+  // With CRISCV_SNAPSHOT set, start from the snapshot file if it is for
+  // this ELF and arguments, or else make one: from the guest at entry,
+  // replaced by the guest at its snapshot point if it has one
+  const char *snapshot = getenv("CRISCV_SNAPSHOT");
+  bool save = false;
+  if(snapshot == NULL || !emulator_load_snapshot(emul, snapshot, argv[1], argv[2])) {
+    if(!emulator_load_elf(emul, argv[1])) {
+      return 1;
+    }
+    emulator_setup(emul, argv[2]);
+    save = snapshot != NULL && emulator_save_snapshot(emul, snapshot, argv[1], argv[2]);
+  }
+  while(emulator_execute(emul)) {
+    if(save) {
+      save = emulator_save_snapshot(emul, snapshot, argv[1], argv[2]);
+    }
+  }
 }
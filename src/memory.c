@@ -33,6 +33,13 @@ void init_ram(mmio_device_t *ram)
   ram->state = READY;
 }
 
+// RAM spans the address space on the bus, but only answers where the mmu
+// has memory
+bool ram_contains(mmio_device_t *ram, const uint32_t offs)
+{
+  return mmu_mapped((const mmu_t *)ram->user, offs);
+}
+
 size_t write_ram(struct _mmio_device_t *ram,
 		 const uint32_t offs,
 		 const void *buf,
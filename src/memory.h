@@ -25,6 +25,7 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "mmio.h"
 
 void     init_ram(mmio_device_t *);
+bool     ram_contains(mmio_device_t *, const uint32_t);
 
 uint32_t read_ram_single(mmio_device_t *ram,
 			 const uint32_t offs,
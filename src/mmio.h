@@ -1,6 +1,7 @@
 #ifndef __MMIO_H__
 #define __MMIO_H__
 
+#include <stdbool.h>
 #include <sys/types.h>
 
 typedef enum __attribute((packed)) _memory_access_width_t {
@@ -22,7 +23,9 @@ typedef struct _mmio_device_t {
   struct _mmio_device_t *next;
 
   uint32_t base_address; 
-  uint32_t size; // in 32bit words
+  uint32_t size; // in bytes
+  // Whether the device answers at offs, NULL when all of its range does
+  bool     (*contains)(struct _mmio_device_t *device, const uint32_t offs);
   void    *user;
   mmio_perm_t perm;
   device_state_t state;
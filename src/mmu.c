@@ -23,20 +23,376 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <assert.h>
+#include "config.h"
+#include "guard.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static inline uint8_t page_bits(const mperm_t perm)
+{
+  return ((perm & MPERM_READ) ? MPAGE_READ : 0) |
+    ((perm & (MPERM_WRITE|MPERM_RAW)) ? MPAGE_WRITE : 0);
+}
+
+// The chunk holding vaddr, NULL when nothing was mapped there
+static inline mmu_chunk_t *chunk_of(const mmu_t *mmu, const size_t vaddr)
+{
+  return mmu->dir[vaddr >> MMU_CHUNK_SHIFT];
+}
+
+// Index of the page holding vaddr within its chunk
+static inline size_t page_of(const size_t vaddr)
+{
+  return (vaddr >> MMU_PAGE_SHIFT) & (MMU_CHUNK_PAGES - 1);
+}
+
+// [vaddr, vaddr+size) fits the 32 bit guest address space
+static inline bool in_space(const vaddr_t vaddr, const size_t size)
+{
+  return size <= MMU_SPACE_SIZE - vaddr;
+}
+
+// The accesses a page allows with no checks or bookkeeping beyond marking
+// it dirty: MPERM_READ when all of it is readable, MPERM_WRITE too when it
+// is also all writable and not executable
+static inline mperm_t host_access(const mmu_chunk_t *c, const size_t pg)
+{
+  const uint8_t p = c->page_perm[pg];
+  if((p & (MPAGE_SHADOW|MPAGE_READ)) != MPAGE_READ) {
+    return 0;
+  }
+  return p == (MPAGE_READ|MPAGE_WRITE) && c->exec_spans[pg].lo == c->exec_spans[pg].hi ?
+    MPERM_READ|MPERM_WRITE : MPERM_READ;
+}
+
+// The shadow of a page, created from its page permissions if it has none
+static uint8_t *page_shadow(mmu_chunk_t *c, const size_t pg)
+{
+  if((c->page_perm[pg] & MPAGE_SHADOW) == 0) {
+    c->shadow[pg] = malloc(MMU_SHADOW_SIZE);
+    assert(c->shadow[pg] != NULL);
+    memset(c->shadow[pg], c->page_perm[pg] * 0x55, MMU_SHADOW_SIZE);
+    c->page_perm[pg] = MPAGE_SHADOW;
+    c->perm_dirty = true;
+  }
+  return c->shadow[pg];
+}
+
+static inline uint8_t lane(const uint8_t *shadow, const size_t i)
+{
+  return (shadow[i >> 2] >> (i & 3) * 2) & 3;
+}
+
+static inline void set_lane(uint8_t *shadow, const size_t i, const uint8_t bits)
+{
+  shadow[i >> 2] = (shadow[i >> 2] & ~(3 << (i & 3) * 2)) | bits << (i & 3) * 2;
+}
+
+static void shadow_set(uint8_t *shadow, size_t lo, const size_t hi, const uint8_t bits)
+{
+  for(; lo < hi && (lo & 3) != 0; lo++) {
+    set_lane(shadow, lo, bits);
+  }
+  const size_t whole = lo < hi ? (hi - lo) & ~(size_t)3 : 0;
+  memset(shadow + (lo >> 2), bits * 0x55, whole >> 2);
+  for(lo += whole; lo < hi; lo++) {
+    set_lane(shadow, lo, bits);
+  }
+}
+
+// All of [lo, hi) in the shadow have the bits of need
+static bool shadow_all(const uint8_t *shadow, size_t lo, const size_t hi, const uint8_t need)
+{
+  for(; lo < hi && (lo & 3) != 0; lo++) {
+    if((lane(shadow, lo) & need) != need) {
+      return false;
+    }
+  }
+  const uint8_t mask = need * 0x55;
+  const size_t whole = lo < hi ? (hi - lo) & ~(size_t)3 : 0;
+  size_t i = lo >> 2;
+  const size_t end = (lo + whole) >> 2;
+#ifdef __SSE2__
+  const __m128i m = _mm_set1_epi8(mask);
+  for(; i + 16 <= end; i += 16) {
+    const __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i *)(shadow + i)), m);
+    if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, m)) != 0xffff) {
+      return false;
+    }
+  }
+#endif
+  for(; i < end; i++) {
+    if((shadow[i] & mask) != mask) {
+      return false;
+    }
+  }
+  for(lo += whole; lo < hi; lo++) {
+    if((lane(shadow, lo) & need) != need) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Writable bytes in [lo, hi) were written and become readable, read after
+// write turns into read and write
+static void shadow_promote(uint8_t *shadow, size_t lo, const size_t hi)
+{
+  for(; lo < hi && (lo & 3) != 0; lo++) {
+    set_lane(shadow, lo, lane(shadow, lo) | lane(shadow, lo) >> 1);
+  }
+  const size_t whole = lo < hi ? (hi - lo) & ~(size_t)3 : 0;
+  size_t i = lo >> 2;
+  const size_t end = (lo + whole) >> 2;
+#ifdef __SSE2__
+  const __m128i m = _mm_set1_epi8(0x55);
+  for(; i + 16 <= end; i += 16) {
+    const __m128i v = _mm_loadu_si128((const __m128i *)(shadow + i));
+    _mm_storeu_si128((__m128i *)(shadow + i), _mm_or_si128(v, _mm_and_si128(_mm_srli_epi16(v, 1), m)));
+  }
+#endif
+  for(; i < end; i++) {
+    shadow[i] |= (shadow[i] >> 1) & 0x55;
+  }
+  for(lo += whole; lo < hi; lo++) {
+    set_lane(shadow, lo, lane(shadow, lo) | lane(shadow, lo) >> 1);
+  }
+}
+
+static inline bool exec_bit(const uint8_t *map, const size_t i)
+{
+  return (map[i >> 3] >> (i & 7)) & 1;
+}
+
+// A copy of an exec map, NULL for none
+static uint8_t *exec_map_dup(const uint8_t *map)
+{
+  if(map == NULL) {
+    return NULL;
+  }
+  uint8_t *copy = malloc(MMU_EXEC_MAP_SIZE);
+  assert(copy != NULL);
+  memcpy(copy, map, MMU_EXEC_MAP_SIZE);
+  return copy;
+}
+
+// Give [lo, hi) of a page MPERM_EXEC, or take it away. The span stays
+// exact as long as the executable bytes are one run; two runs, or a hole
+// cut into one, get an exec map until a single run is left again.
+static void exec_set(mmu_chunk_t *c, const size_t pg, const size_t lo, const size_t hi, const bool on)
+{
+  mmu_span_t *x = &c->exec_spans[pg];
+  if(c->exec_map[pg] == NULL) {
+    if(on && x->lo == x->hi) {
+      x->lo = lo;
+      x->hi = hi;
+      return;
+    }
+    if(on && lo <= x->hi && hi >= x->lo) {
+      x->lo = lo < x->lo ? lo : x->lo;
+      x->hi = hi > x->hi ? hi : x->hi;
+      return;
+    }
+    if(!on && (hi <= x->lo || lo >= x->hi)) {
+      return;
+    }
+    if(!on && lo <= x->lo && hi >= x->hi) {
+      x->lo = x->hi = 0;
+      return;
+    }
+    if(!on && (lo <= x->lo || hi >= x->hi)) {
+      x->lo = lo <= x->lo ? hi : x->lo;
+      x->hi = lo <= x->lo ? x->hi : lo;
+      return;
+    }
+    c->exec_map[pg] = malloc(MMU_EXEC_MAP_SIZE);
+    assert(c->exec_map[pg] != NULL);
+    memset(c->exec_map[pg], 0, MMU_EXEC_MAP_SIZE);
+    for(size_t i = x->lo; i < x->hi; i++) {
+      c->exec_map[pg][i >> 3] |= 1 << (i & 7);
+    }
+  }
+
+  uint8_t *map = c->exec_map[pg];
+  for(size_t i = lo; i < hi; i++) {
+    map[i >> 3] = (map[i >> 3] & ~(1 << (i & 7))) | (on ? 1 << (i & 7) : 0);
+  }
+  size_t a = 0, b = MMU_PAGE_SIZE;
+  while(a < b && !exec_bit(map, a)) {
+    a++;
+  }
+  while(b > a && !exec_bit(map, b - 1)) {
+    b--;
+  }
+  x->lo = a < b ? a : 0;
+  x->hi = a < b ? b : 0;
+  size_t i = a;
+  while(i < b && exec_bit(map, i)) {
+    i++;
+  }
+  if(i == b) {
+    free(map);
+    c->exec_map[pg] = NULL;
+  }
+}
+
+// The run of executable bytes of a page that holds offs, empty for none
+static mmu_span_t exec_run(const mmu_chunk_t *c, const size_t pg, const size_t offs)
+{
+  const mmu_span_t x = c->exec_spans[pg];
+  const uint8_t *map = c->exec_map[pg];
+  if(offs < x.lo || offs >= x.hi) {
+    return (mmu_span_t){0, 0};
+  }
+  if(map == NULL) {
+    return x;
+  }
+  if(!exec_bit(map, offs)) {
+    return (mmu_span_t){0, 0};
+  }
+  size_t a = offs, b = offs + 1;
+  while(a > x.lo && exec_bit(map, a - 1)) {
+    a--;
+  }
+  while(b < x.hi && exec_bit(map, b)) {
+    b++;
+  }
+  return (mmu_span_t){a, b};
+}
+
+// The bytes [vaddr, vaddr+size) of guest memory all have the bits of need
+static bool allowed(const mmu_t *mmu, const vaddr_t vaddr, const size_t size, const uint8_t need)
+{
+  if(size == 0) {
+    return true;
+  }
+  const size_t end = (size_t)vaddr + size;
+  for(size_t first = vaddr & ~(size_t)(MMU_PAGE_SIZE - 1); first < end; first += MMU_PAGE_SIZE) {
+    const size_t lo = vaddr > first ? vaddr - first : 0;
+    const size_t hi = end - first < MMU_PAGE_SIZE ? end - first : MMU_PAGE_SIZE;
+    const mmu_chunk_t *c = chunk_of(mmu, first);
+    if(c == NULL) {
+      return false;
+    }
+    const size_t pg = page_of(first);
+    const uint8_t p = c->page_perm[pg];
+    if((p & MPAGE_SHADOW) == 0 ? (p & need) != need : !shadow_all(c->shadow[pg], lo, hi, need)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool executable(const mmu_t *mmu, const vaddr_t vaddr, const size_t size)
+{
+  const size_t end = (size_t)vaddr + size;
+  for(size_t first = vaddr & ~(size_t)(MMU_PAGE_SIZE - 1); first < end; first += MMU_PAGE_SIZE) {
+    const size_t lo = vaddr > first ? vaddr - first : 0;
+    const size_t hi = end - first < MMU_PAGE_SIZE ? end - first : MMU_PAGE_SIZE;
+    const mmu_chunk_t *c = chunk_of(mmu, first);
+    if(c == NULL) {
+      return false;
+    }
+    const mmu_span_t run = exec_run(c, page_of(first), lo);
+    if(run.lo == run.hi || hi > run.hi) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Pages without memory have no permissions to change and are skipped
 void mmu_setperm(mmu_t *mmu, const vaddr_t vaddr, const size_t size, const mperm_t perm)
 {
-  fprintf(stderr, "mmu::setperm vaddr=0x%08x->0x%08lx, perm=0x%02x, size/aligned=0x%08zx/0x%08lx\n", vaddr, vaddr+size, perm, size, size);
-  assert(vaddr >= mmu->base);
-  assert(vaddr+size <= mmu->base+mmu->size);
-  for(size_t i=vaddr-mmu->base; i < vaddr-mmu->base+size; i++) {
-    mmu->perm[i] = perm;
+  assert(in_space(vaddr, size));
+  if(size == 0) {
+    return;
+  }
+  const uint8_t bits = page_bits(perm);
+  const size_t end = (size_t)vaddr + size;
+  for(size_t first = vaddr & ~(size_t)(MMU_PAGE_SIZE - 1); first < end; first += MMU_PAGE_SIZE) {
+    const size_t lo = vaddr > first ? vaddr - first : 0;
+    const size_t hi = end - first < MMU_PAGE_SIZE ? end - first : MMU_PAGE_SIZE;
+    mmu_chunk_t *c = chunk_of(mmu, first);
+    if(c == NULL) {
+      continue;
+    }
+    const size_t pg = page_of(first);
+    c->perm_dirty = true;
+    if(lo == 0 && hi == MMU_PAGE_SIZE) {
+      if((c->page_perm[pg] & MPAGE_SHADOW) != 0) {
+	free(c->shadow[pg]);
+	c->shadow[pg] = NULL;
+      }
+      c->page_perm[pg] = bits;
+    } else if(c->page_perm[pg] != bits) {
+      shadow_set(page_shadow(c, pg), lo, hi, bits);
+    }
+
+    exec_set(c, pg, lo, hi, (perm & MPERM_EXEC) != 0);
+#ifdef MMU_GUARD
+    guard_protect(mmu, first, host_access(c, pg));
+#endif
+  }
+  mmu->perm_gen++;
+}
+
+// Guest memory lives in MMU_CHUNK_SIZE chunks found through a one level
+// directory indexed by the top address bits, each a private anonymous
+// mapping of its own made when memory is first added there. The kernel
+// hands out zero pages on first touch, so time and RSS follow what the
+// guest uses, and separate segments cost nothing for the gap between them.
+static void *map_zeroed(const size_t size, const bool huge)
+{
+  void *p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+  if(p == MAP_FAILED) {
+    return NULL;
   }
+#ifdef RAM_HUGEPAGES
+  if(huge) {
+    (void)madvise(p, size, MADV_HUGEPAGE);
+  }
+#else
+  (void)huge;
+#endif
+  return p;
 }
 
-// Initialize a new MMU, initializing
+// Make sure there are chunks for all of [vaddr, vaddr+size)
+static bool mmu_map(mmu_t *mmu, const vaddr_t vaddr, const size_t size)
+{
+  const size_t end = (size_t)vaddr + size;
+  for(size_t first = vaddr & ~(size_t)(MMU_CHUNK_SIZE - 1); first < end; first += MMU_CHUNK_SIZE) {
+    if(chunk_of(mmu, first) != NULL) {
+      continue;
+    }
+    mmu_chunk_t *c = map_zeroed(sizeof(mmu_chunk_t), false);
+    if(c == NULL) {
+      return false;
+    }
+#ifdef MMU_GUARD
+    c->data = guard_map_chunk(mmu, first);
+#else
+    c->data = map_zeroed(MMU_CHUNK_SIZE, true);
+#endif
+    if(c->data == NULL) {
+      munmap(c, sizeof(mmu_chunk_t));
+      return false;
+    }
+    mmu->dir[first >> MMU_CHUNK_SHIFT] = c;
+  }
+  return true;
+}
+
+// Initialize a new MMU with size bytes of RAM from base, all of it read
+// after write, that mmu_allocate hands out
 mmu_t *mmu_init(const vaddr_t base, const size_t size)
 {
   mmu_t *mmu = malloc(sizeof(mmu_t));
@@ -44,31 +400,38 @@ mmu_t *mmu_init(const vaddr_t base, const size_t size)
   if(!mmu) {
     return NULL;
   }
+  memset(mmu, 0, sizeof(mmu_t));
 
   mmu->base = base;
   mmu->size = size;
   mmu->curr_vaddr = base;
+  mmu->state = MMU_OK;
+  mmu->code_watch_cnt = 0;
+  mmu->perm_gen = 0;
 
-  mmu->data = malloc(size);
-  if(!mmu->data) {
+  // Room for every block in the address space, of which only the part
+  // that gets used is ever touched
+  mmu->dirty_list = map_zeroed(MMU_SPACE_SIZE / DIRTY_PAGE_SIZE * sizeof(uint32_t), false);
+  if(mmu->dirty_list == NULL) {
     free(mmu);
     return NULL;
   }
-  memset(mmu->data, 0x0, size);
 
-  const size_t dirty_size = (size / DIRTY_PAGE_SIZE) + 1;
-  mmu->dirty = malloc(dirty_size);
-  if(!mmu->dirty) {
-    free(mmu->data);
+#ifdef MMU_GUARD
+  if(!guard_init(mmu)) {
+    munmap(mmu->dirty_list, MMU_SPACE_SIZE / DIRTY_PAGE_SIZE * sizeof(uint32_t));
     free(mmu);
     return NULL;
   }
-  memset(mmu->dirty, 0, dirty_size); 
-
-  mmu->perm = malloc(sizeof(mperm_t)*size);
-  if(!mmu->perm) {
-    free(mmu->dirty);
-    free(mmu->data);
+#endif
+  if(!in_space(base, size) || !mmu_map(mmu, base, size)) {
+    for(size_t i=0; i < MMU_DIR_SIZE; i++) {
+      if(mmu->dir[i] != NULL) {
+	munmap(mmu->dir[i]->data, MMU_CHUNK_SIZE);
+	munmap(mmu->dir[i], sizeof(mmu_chunk_t));
+      }
+    }
+    munmap(mmu->dirty_list, MMU_SPACE_SIZE / DIRTY_PAGE_SIZE * sizeof(uint32_t));
     free(mmu);
     return NULL;
   }
@@ -77,40 +440,48 @@ mmu_t *mmu_init(const vaddr_t base, const size_t size)
   return mmu;
 }
 
+// Add memory with perm anywhere in the address space. Memory touching the
+// RAM from base extends it, elsewhere it is a region of its own.
 bool mmu_add_memory(mmu_t *mmu, const vaddr_t addr, const size_t size, const mperm_t perm)
 {
-  if(addr < mmu->base) {
-    assert(0 && "can not extend memory segment");
+  if(!in_space(addr, size) || !mmu_map(mmu, addr, size)) {
     return false;
   }
-  if(addr + size > mmu->base + mmu->size) {
-    // Extend the current memory segment
-    const size_t new_size = (addr+size) - mmu->base;
-    void * new_data = realloc(mmu->data, new_size);
-    if(new_data == NULL) {
-      return false;
+  if(addr >= mmu->base && addr <= mmu->base + mmu->size) {
+    if(addr + size > mmu->base + mmu->size) {
+      // Extend the current memory segment
+      mmu->size = (addr+size) - mmu->base;
+    } else {
+      // extend the curr_vaddr beyond addr+size
+      mmu->curr_vaddr = addr + size;
     }
-    mmu->data = new_data;
+  }
+  mmu_setperm(mmu, addr, size, perm);
+  return true;
+}
 
-    void * new_perm = realloc(mmu->perm, new_size);
-    if(new_perm == NULL) {
-      return false;
-    }
-    mmu->perm = new_perm;
+// Any memory with any permission at vaddr
+bool mmu_mapped(const mmu_t *mmu, const vaddr_t vaddr)
+{
+  const mmu_chunk_t *c = chunk_of(mmu, vaddr);
+  return c != NULL && c->page_perm[page_of(vaddr)] != 0;
+}
 
-    void * new_dirty = realloc(mmu->dirty, new_size);
-    if(new_dirty == NULL) {
-      return false;
+// Copy between buf and guest memory that has chunks, chunk by chunk
+static void copy(const mmu_t *mmu, const vaddr_t vaddr, void *buf, const size_t size, const bool to_guest)
+{
+  for(size_t done = 0; done < size; ) {
+    const size_t at = (size_t)vaddr + done;
+    const size_t offs = at & (MMU_CHUNK_SIZE - 1);
+    const size_t n = MMU_CHUNK_SIZE - offs < size - done ? MMU_CHUNK_SIZE - offs : size - done;
+    uint8_t *g = chunk_of(mmu, at)->data + offs;
+    if(to_guest) {
+      memcpy(g, (uint8_t *)buf + done, n);
+    } else {
+      memcpy((uint8_t *)buf + done, g, n);
     }
-    mmu->dirty = new_dirty;
-
-    mmu->size = new_size;
-  } else {
-    // extend the curr_vaddr beyond addr+size
-    mmu->curr_vaddr = addr + size;
+    done += n;
   }
-  mmu_setperm(mmu, addr, size, perm);
-  return true;
 }
 
 // Allocate a block of memory with specific access permissions
@@ -139,59 +510,588 @@ vaddr_t mmu_allocate_raw(mmu_t *mmu, const size_t size)
   return mmu_allocate(mmu, size, MPERM_WRITE|MPERM_RAW);
 }
 
-bool mmu_check_access(const mmu_t *mmu,
-		      const vaddr_t vaddr,
-		      const size_t size_in_bytes,
-		      const mperm_t perm)
+// Register a callback for writes to executable memory
+bool mmu_watch_code(mmu_t *mmu, mmu_code_write_t invalidate, void *user)
+{
+  if(mmu->code_watch_cnt == MMU_CODE_WATCHERS) {
+    return false;
+  }
+  mmu->code_watch[mmu->code_watch_cnt].invalidate = invalidate;
+  mmu->code_watch[mmu->code_watch_cnt].user = user;
+  mmu->code_watch_cnt++;
+  return true;
+}
+
+// Tell whoever caches decoded instructions that [vaddr, vaddr+size) changed
+static void code_written(mmu_t *mmu, const vaddr_t vaddr, const size_t size)
 {
-  for(size_t i=vaddr-mmu->base; i < vaddr - mmu->base + size_in_bytes; i++) {
-    const mperm_t p = mmu->perm[i];
+  for(size_t i=0; i < mmu->code_watch_cnt; i++) {
+    mmu->code_watch[i].invalidate(mmu->code_watch[i].user, vaddr, size);
+  }
+}
 
-    if((p & MPERM_READ) == perm ||
-       (p & MPERM_WRITE) == perm ||
-       (p & MPERM_EXEC) == perm) {
+// Take a snapshot of all guest memory, its permissions and the allocator,
+// for mmu_restore to go back to. Memory is copied only where it was
+// written since mmu_init or the previous snapshot, the rest of the copy is
+// still right, or zero pages that cost nothing.
+bool mmu_snapshot(mmu_t *mmu)
+{
+  for(size_t i=0; i < MMU_DIR_SIZE; i++) {
+    mmu_chunk_t *c = mmu->dir[i];
+    if(c == NULL) {
       continue;
     }
-    else if((p & MPERM_RAW) == MPERM_RAW && perm == MPERM_WRITE) {
+    mmu_chunk_snap_t *s = c->snap;
+    if(s == NULL) {
+      s = malloc(sizeof(mmu_chunk_snap_t));
+      if(s == NULL) {
+	return false;
+      }
+      memset(s, 0, sizeof(mmu_chunk_snap_t));
+      s->data = map_zeroed(MMU_CHUNK_SIZE, false);
+      if(s->data == NULL) {
+	free(s);
+	return false;
+      }
+      c->snap = s;
+    }
+    for(size_t pg=0; pg < MMU_CHUNK_PAGES; pg++) {
+      free(s->shadow[pg]);
+      s->shadow[pg] = NULL;
+      if((c->page_perm[pg] & MPAGE_SHADOW) != 0) {
+	s->shadow[pg] = malloc(MMU_SHADOW_SIZE);
+	assert(s->shadow[pg] != NULL);
+	memcpy(s->shadow[pg], c->shadow[pg], MMU_SHADOW_SIZE);
+      }
+      free(s->exec_map[pg]);
+      s->exec_map[pg] = exec_map_dup(c->exec_map[pg]);
+    }
+    memcpy(s->page_perm, c->page_perm, sizeof(s->page_perm));
+    memcpy(s->exec_spans, c->exec_spans, sizeof(s->exec_spans));
+    c->perm_dirty = false;
+  }
+
+  for(size_t i=0; i < mmu->dirty_cnt; i++) {
+    const size_t offs = ((size_t)mmu->dirty_list[i] * DIRTY_PAGE_SIZE) & (MMU_CHUNK_SIZE - 1);
+    mmu_chunk_t *c = mmu->dir[mmu->dirty_list[i] / MMU_CHUNK_DIRTY];
+    memcpy(c->snap->data + offs, c->data + offs, DIRTY_PAGE_SIZE);
+    c->dirty[offs / DIRTY_PAGE_SIZE] = false;
+  }
+  mmu->dirty_cnt = 0;
+  mmu->snap_size = mmu->size;
+  mmu->snap_curr_vaddr = mmu->curr_vaddr;
+  mmu->snapped = true;
+  return true;
+}
+
+// Put back the page tables of a chunk from the snapshot, no permissions
+// at all for a chunk mapped after it
+static void restore_pages(mmu_t *mmu, const size_t first, mmu_chunk_t *c)
+{
+  const mmu_chunk_snap_t *s = c->snap;
+  for(size_t pg=0; pg < MMU_CHUNK_PAGES; pg++) {
+    const uint8_t was = s != NULL ? s->page_perm[pg] : 0;
+    const mmu_span_t span = s != NULL ? s->exec_spans[pg] : (mmu_span_t){0, 0};
+    const uint8_t *map = s != NULL ? s->exec_map[pg] : NULL;
+    const uint8_t p = c->page_perm[pg];
+    const bool code = span.lo != c->exec_spans[pg].lo || span.hi != c->exec_spans[pg].hi ||
+      (map == NULL) != (c->exec_map[pg] == NULL) ||
+      (map != NULL && memcmp(map, c->exec_map[pg], MMU_EXEC_MAP_SIZE) != 0);
+    if(p == was && (p & MPAGE_SHADOW) == 0 && !code) {
       continue;
     }
-    else {
-      fprintf(stderr, "mmu::check_access: Access denied to memory at 0x%08x with permissions 0x%02x. Requested permission: 0x%02x\n", (unsigned int)i + mmu->base, p, perm);
+    if((p & MPAGE_SHADOW) != 0 && (was & MPAGE_SHADOW) == 0) {
+      free(c->shadow[pg]);
+      c->shadow[pg] = NULL;
+    } else if((was & MPAGE_SHADOW) != 0) {
+      if((p & MPAGE_SHADOW) == 0) {
+	c->shadow[pg] = malloc(MMU_SHADOW_SIZE);
+	assert(c->shadow[pg] != NULL);
+      }
+      memcpy(c->shadow[pg], s->shadow[pg], MMU_SHADOW_SIZE);
+    }
+    c->page_perm[pg] = was;
+    c->exec_spans[pg] = span;
+    if(code) {
+      free(c->exec_map[pg]);
+      c->exec_map[pg] = exec_map_dup(map);
+      code_written(mmu, first + (pg << MMU_PAGE_SHIFT), MMU_PAGE_SIZE);
+    }
+#ifdef MMU_GUARD
+    guard_protect(mmu, first + (pg << MMU_PAGE_SHIFT), host_access(c, pg));
+#endif
+  }
+  c->perm_dirty = false;
+}
+
+// Go back to the snapshot, copying only the blocks written since, so the
+// cost follows the memory the guest touched rather than its size. No core
+// may run meanwhile.
+void mmu_restore(mmu_t *mmu)
+{
+  assert(mmu->snapped);
+  for(size_t i=0; i < mmu->dirty_cnt; i++) {
+    const size_t at = (size_t)mmu->dirty_list[i] * DIRTY_PAGE_SIZE;
+    const size_t offs = at & (MMU_CHUNK_SIZE - 1);
+    mmu_chunk_t *c = chunk_of(mmu, at);
+    if(c->snap != NULL) {
+      memcpy(c->data + offs, c->snap->data + offs, DIRTY_PAGE_SIZE);
+    } else {
+      memset(c->data + offs, 0, DIRTY_PAGE_SIZE);
+    }
+    c->dirty[offs / DIRTY_PAGE_SIZE] = false;
+    const mmu_span_t span = c->exec_spans[page_of(at)];
+    const size_t lo = at & (MMU_PAGE_SIZE - 1);
+    if(lo < span.hi && lo + DIRTY_PAGE_SIZE > span.lo) {
+      code_written(mmu, at, DIRTY_PAGE_SIZE);
+    }
+  }
+  mmu->dirty_cnt = 0;
+
+  for(size_t i=0; i < MMU_DIR_SIZE; i++) {
+    if(mmu->dir[i] != NULL && mmu->dir[i]->perm_dirty) {
+      restore_pages(mmu, i << MMU_CHUNK_SHIFT, mmu->dir[i]);
+    }
+  }
+  mmu->size = mmu->snap_size;
+  mmu->curr_vaddr = mmu->snap_curr_vaddr;
+  mmu->state = MMU_OK;
+  mmu->perm_gen++;
+}
+
+// Memory in an image file: this header, then per chunk its directory
+// index, page tables and which pages hold anything other than zeroes,
+// then the shadows of its shadowed pages and the exec maps of the pages
+// that have one, in order. The chunks' memory
+// follows from data_offs, MMU_CHUNK_SIZE each with zero pages left as
+// holes, so that mmu_load can map it straight from the file.
+typedef struct _mmu_image_t {
+  uint32_t chunk_shift;
+  uint32_t page_shift;
+  uint32_t chunks;
+  vaddr_t  base;
+  uint64_t size;
+  uint64_t curr_vaddr;
+  uint64_t data_offs;
+} mmu_image_t;
+
+typedef struct _mmu_image_chunk_t {
+  uint32_t   index;
+  uint8_t    page_perm[MMU_CHUNK_PAGES];
+  mmu_span_t exec_spans[MMU_CHUNK_PAGES];
+  uint8_t    exec_mapped[MMU_CHUNK_PAGES / 8];
+  uint8_t    used[MMU_CHUNK_PAGES / 8];
+} mmu_image_chunk_t;
+
+static bool put(const int fd, const void *buf, const size_t size)
+{
+  for(size_t done = 0; done < size; ) {
+    const ssize_t n = write(fd, (const uint8_t *)buf + done, size - done);
+    if(n <= 0) {
       return false;
     }
+    done += n;
   }
   return true;
 }
 
+static bool get(const int fd, void *buf, const size_t size)
+{
+  for(size_t done = 0; done < size; ) {
+    const ssize_t n = read(fd, (uint8_t *)buf + done, size - done);
+    if(n <= 0) {
+      return false;
+    }
+    done += n;
+  }
+  return true;
+}
+
+static bool zero_page(const uint8_t *page)
+{
+  const uint64_t *w = (const uint64_t *)page;
+  for(size_t i=0; i < MMU_PAGE_SIZE / sizeof(uint64_t); i++) {
+    if(w[i] != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Write all guest memory, its permissions and the allocator to fd, from
+// its current position
+bool mmu_save(const mmu_t *mmu, const int fd)
+{
+  mmu_image_t img = {
+    .chunk_shift = MMU_CHUNK_SHIFT,
+    .page_shift = MMU_PAGE_SHIFT,
+    .base = mmu->base,
+    .size = mmu->size,
+    .curr_vaddr = mmu->curr_vaddr
+  };
+  size_t shadows = 0, exec_maps = 0;
+  for(size_t i=0; i < MMU_DIR_SIZE; i++) {
+    if(mmu->dir[i] == NULL) {
+      continue;
+    }
+    img.chunks++;
+    for(size_t pg=0; pg < MMU_CHUNK_PAGES; pg++) {
+      shadows += (mmu->dir[i]->page_perm[pg] & MPAGE_SHADOW) != 0;
+      exec_maps += mmu->dir[i]->exec_map[pg] != NULL;
+    }
+  }
+  const off_t at = lseek(fd, 0, SEEK_CUR);
+  if(at < 0) {
+    return false;
+  }
+  const size_t meta = sizeof(img) + img.chunks * sizeof(mmu_image_chunk_t) + shadows * MMU_SHADOW_SIZE +
+    exec_maps * MMU_EXEC_MAP_SIZE;
+  img.data_offs = ((size_t)at + meta + MMU_CHUNK_SIZE - 1) & ~(MMU_CHUNK_SIZE - 1);
+  if(!put(fd, &img, sizeof(img))) {
+    return false;
+  }
+
+  mmu_image_chunk_t *ic = malloc(sizeof(mmu_image_chunk_t));
+  assert(ic != NULL);
+  size_t k = 0;
+  bool ok = true;
+  for(size_t i=0; ok && i < MMU_DIR_SIZE; i++) {
+    const mmu_chunk_t *c = mmu->dir[i];
+    if(c == NULL) {
+      continue;
+    }
+    memset(ic, 0, sizeof(mmu_image_chunk_t));
+    ic->index = i;
+    memcpy(ic->page_perm, c->page_perm, sizeof(ic->page_perm));
+    memcpy(ic->exec_spans, c->exec_spans, sizeof(ic->exec_spans));
+    for(size_t pg=0; pg < MMU_CHUNK_PAGES; pg++) {
+      ic->exec_mapped[pg / 8] |= (c->exec_map[pg] != NULL) << (pg % 8);
+    }
+    const off_t data = img.data_offs + k++ * MMU_CHUNK_SIZE;
+    for(size_t pg=0; ok && pg < MMU_CHUNK_PAGES; pg++) {
+      const uint8_t *page = c->data + (pg << MMU_PAGE_SHIFT);
+      if(!zero_page(page)) {
+	ic->used[pg / 8] |= 1 << (pg % 8);
+	ok = pwrite(fd, page, MMU_PAGE_SIZE, data + (pg << MMU_PAGE_SHIFT)) == MMU_PAGE_SIZE;
+      }
+    }
+    ok = ok && put(fd, ic, sizeof(mmu_image_chunk_t));
+    for(size_t pg=0; ok && pg < MMU_CHUNK_PAGES; pg++) {
+      if((c->page_perm[pg] & MPAGE_SHADOW) != 0) {
+	ok = put(fd, c->shadow[pg], MMU_SHADOW_SIZE);
+      }
+    }
+    for(size_t pg=0; ok && pg < MMU_CHUNK_PAGES; pg++) {
+      if(c->exec_map[pg] != NULL) {
+	ok = put(fd, c->exec_map[pg], MMU_EXEC_MAP_SIZE);
+      }
+    }
+  }
+  free(ic);
+  return ok && ftruncate(fd, img.data_offs + img.chunks * MMU_CHUNK_SIZE) == 0;
+}
+
+// A chunk of an image as mmu_load reads it, before it is put in place
+typedef struct _mmu_load_chunk_t {
+  mmu_image_chunk_t rec;
+  uint8_t          *shadow[MMU_CHUNK_PAGES];
+  uint8_t          *exec_map[MMU_CHUNK_PAGES];
+  void             *data; // its memory, mapped from the file
+} mmu_load_chunk_t;
+
+static void load_chunks_free(mmu_load_chunk_t *lc, const size_t chunks)
+{
+  for(size_t k=0; k < chunks; k++) {
+    for(size_t pg=0; pg < MMU_CHUNK_PAGES; pg++) {
+      free(lc[k].shadow[pg]);
+      free(lc[k].exec_map[pg]);
+    }
+    if(lc[k].data != NULL) {
+      munmap(lc[k].data, MMU_CHUNK_SIZE);
+    }
+  }
+  free(lc);
+}
+
+// Replace all guest memory with an image mmu_save wrote to fd, from its
+// current position. Memory is mapped copy on write from the file, so only
+// pages the guest goes on to write get copied. The pages of the image
+// count as written since mmu_init, for mmu_snapshot. All of the image is
+// read and checked before the mmu is changed, so on false it is as it was,
+// except for chunks the image has that now exist without permissions.
+bool mmu_load(mmu_t *mmu, const int fd)
+{
+  mmu_image_t img;
+  struct stat st;
+  if(!get(fd, &img, sizeof(img)) || fstat(fd, &st) != 0 ||
+     img.chunk_shift != MMU_CHUNK_SHIFT || img.page_shift != MMU_PAGE_SHIFT ||
+     img.chunks == 0 || img.chunks > MMU_DIR_SIZE || !in_space(img.base, img.size) ||
+     (img.data_offs & (MMU_CHUNK_SIZE - 1)) != 0 || img.data_offs > (uint64_t)st.st_size ||
+     (uint64_t)img.chunks * MMU_CHUNK_SIZE > (uint64_t)st.st_size - img.data_offs) {
+    return false;
+  }
+
+  mmu_load_chunk_t *lc = malloc(img.chunks * sizeof(mmu_load_chunk_t));
+  assert(lc != NULL);
+  memset(lc, 0, img.chunks * sizeof(mmu_load_chunk_t));
+  bool ok = true;
+  for(size_t k=0; ok && k < img.chunks; k++) {
+    const mmu_image_chunk_t *ic = &lc[k].rec;
+    ok = get(fd, &lc[k].rec, sizeof(mmu_image_chunk_t)) && ic->index < MMU_DIR_SIZE &&
+      (k == 0 || ic->index > lc[k - 1].rec.index);
+    for(size_t pg=0; ok && pg < MMU_CHUNK_PAGES; pg++) {
+      if((ic->page_perm[pg] & MPAGE_SHADOW) != 0) {
+	lc[k].shadow[pg] = malloc(MMU_SHADOW_SIZE);
+	assert(lc[k].shadow[pg] != NULL);
+	ok = get(fd, lc[k].shadow[pg], MMU_SHADOW_SIZE);
+      }
+    }
+    for(size_t pg=0; ok && pg < MMU_CHUNK_PAGES; pg++) {
+      if((ic->exec_mapped[pg / 8] & (1 << (pg % 8))) != 0) {
+	lc[k].exec_map[pg] = malloc(MMU_EXEC_MAP_SIZE);
+	assert(lc[k].exec_map[pg] != NULL);
+	ok = get(fd, lc[k].exec_map[pg], MMU_EXEC_MAP_SIZE);
+      }
+    }
+    if(ok) {
+      void *p = mmap(NULL, MMU_CHUNK_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_NORESERVE, fd,
+		     img.data_offs + k * MMU_CHUNK_SIZE);
+      ok = p != MAP_FAILED;
+      lc[k].data = ok ? p : NULL;
+    }
+  }
+  ok = ok && lseek(fd, 0, SEEK_CUR) <= (off_t)img.data_offs;
+  for(size_t k=0; ok && k < img.chunks; k++) {
+    ok = mmu_map(mmu, lc[k].rec.index << MMU_CHUNK_SHIFT, MMU_CHUNK_SIZE);
+  }
+  if(!ok) {
+    load_chunks_free(lc, img.chunks);
+    return false;
+  }
+
+  // Memory the image does not have is left without any permissions
+  for(size_t i=0; i < MMU_DIR_SIZE; i++) {
+    if(mmu->dir[i] != NULL) {
+      mmu_setperm(mmu, i << MMU_CHUNK_SHIFT, MMU_CHUNK_SIZE, 0);
+    }
+  }
+
+  for(size_t k=0; k < img.chunks; k++) {
+    const mmu_image_chunk_t *ic = &lc[k].rec;
+    const size_t first = (size_t)ic->index << MMU_CHUNK_SHIFT;
+    mmu_chunk_t *c = mmu->dir[ic->index];
+#ifdef MMU_GUARD
+    // The memory has to stay in the guard region, so it is copied
+    for(size_t pg=0; pg < MMU_CHUNK_PAGES; pg++) {
+      uint8_t *page = c->data + (pg << MMU_PAGE_SHIFT);
+      if((ic->used[pg / 8] & (1 << (pg % 8))) != 0) {
+	memcpy(page, (uint8_t *)lc[k].data + (pg << MMU_PAGE_SHIFT), MMU_PAGE_SIZE);
+      } else if(!zero_page(page)) {
+	memset(page, 0, MMU_PAGE_SIZE);
+      }
+    }
+    munmap(lc[k].data, MMU_CHUNK_SIZE);
+#else
+    munmap(c->data, MMU_CHUNK_SIZE);
+    c->data = lc[k].data;
+#endif
+    lc[k].data = NULL;
+    for(size_t pg=0; pg < MMU_CHUNK_PAGES; pg++) {
+      if((c->page_perm[pg] & MPAGE_SHADOW) != 0) {
+	free(c->shadow[pg]);
+      }
+      c->page_perm[pg] = ic->page_perm[pg];
+      c->exec_spans[pg] = ic->exec_spans[pg];
+      c->shadow[pg] = lc[k].shadow[pg];
+      lc[k].shadow[pg] = NULL;
+      free(c->exec_map[pg]);
+      c->exec_map[pg] = lc[k].exec_map[pg];
+      lc[k].exec_map[pg] = NULL;
+      if((ic->used[pg / 8] & (1 << (pg % 8))) != 0) {
+	for(size_t b=0; b < MMU_PAGE_SIZE; b += DIRTY_PAGE_SIZE) {
+	  mmu_dirty_block(mmu, first + (pg << MMU_PAGE_SHIFT) + b);
+	}
+      }
+#ifdef MMU_GUARD
+      guard_protect(mmu, first + (pg << MMU_PAGE_SHIFT), host_access(c, pg));
+#endif
+    }
+    c->perm_dirty = true;
+  }
+  load_chunks_free(lc, img.chunks);
+
+  mmu->base = img.base;
+  mmu->size = img.size;
+  mmu->curr_vaddr = img.curr_vaddr;
+  mmu->perm_gen++;
+  return true;
+}
+
+bool mmu_check_access(const mmu_t *mmu,
+		      const vaddr_t vaddr,
+		      const size_t size_in_bytes,
+		      const mperm_t perm)
+{
+  const bool ok = in_space(vaddr, size_in_bytes) &&
+    (perm == MPERM_EXEC ? executable(mmu, vaddr, size_in_bytes) :
+     allowed(mmu, vaddr, size_in_bytes, page_bits(perm)));
+  if(!ok) {
+    fprintf(stderr, "mmu::check_access: Access denied to memory at 0x%08x, size %zu. Requested permission: 0x%02x\n", vaddr, size_in_bytes, perm);
+  }
+  return ok;
+}
+
 size_t mmu_write_from(mmu_t *mmu, const void *src, const vaddr_t vaddr, const size_t size_in_bytes)
 {
-  if(vaddr < mmu->base || vaddr + size_in_bytes > mmu->base + mmu->size) {
+  if(!in_space(vaddr, size_in_bytes)) {
     mmu->state = READ_PAGE_FAULT;
     return 0;
   }
-  assert(vaddr >= mmu->base);
-  assert(vaddr <= mmu->base + mmu->size );
   if(!mmu_check_access(mmu, vaddr, size_in_bytes, MPERM_WRITE)) {
     mmu->state = ACCESS_DENIED;
     return 0;
   }
   mmu->state = MMU_OK;
-  memcpy((uint8_t*)mmu->data + (vaddr - mmu->base), src, size_in_bytes);
+  copy(mmu, vaddr, (void *)src, size_in_bytes, true);
+  mmu_written(mmu, vaddr, size_in_bytes);
+  return size_in_bytes;
+}
+
+// Write [vaddr, vaddr+size) from the file fd at offs, mapping its whole
+// pages copy on write where the offset allows it. Instances running the
+// same file then share those pages through the host page cache until they
+// write them; the file must not be changed in place meanwhile. Returns
+// the number of bytes written, less than size when the file is short or
+// unreadable.
+size_t mmu_write_from_file(mmu_t *mmu, const int fd, const off_t offs, const vaddr_t vaddr, const size_t size)
+{
+  if(!in_space(vaddr, size)) {
+    mmu->state = READ_PAGE_FAULT;
+    return 0;
+  }
+  if(!mmu_check_access(mmu, vaddr, size, MPERM_WRITE)) {
+    mmu->state = ACCESS_DENIED;
+    return 0;
+  }
+  const size_t end = (size_t)vaddr + size;
+  for(size_t at = vaddr; at < end; ) {
+    const size_t next = (at | (MMU_PAGE_SIZE - 1)) + 1;
+    const size_t n = (next < end ? next : end) - at;
+    uint8_t *g = chunk_of(mmu, at)->data + (at & (MMU_CHUNK_SIZE - 1));
+    bool mapped = false;
+#ifndef MMU_GUARD
+    // Guard memory has to stay in the guard region and is always read
+    if(n == MMU_PAGE_SIZE && ((offs + at - vaddr) & (MMU_PAGE_SIZE - 1)) == 0) {
+      mapped = mmap(g, n, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, fd, offs + (at - vaddr)) != MAP_FAILED;
+    }
+#endif
+    if(!mapped) {
+      const ssize_t got = pread(fd, g, n, offs + (at - vaddr));
+      if(got != (ssize_t)n) {
+	// What made it into memory still needs its bookkeeping
+	const size_t written = at - vaddr + (got > 0 ? (size_t)got : 0);
+	mmu_written(mmu, vaddr, written);
+	mmu->state = READ_PAGE_FAULT;
+	return written;
+      }
+    }
+    at += n;
+  }
+  mmu->state = MMU_OK;
+  mmu_written(mmu, vaddr, size);
+  return size;
+}
 
-  // Update perms
-  for(size_t i = vaddr-mmu->base; i < vaddr-mmu->base+size_in_bytes; i++) {
-    if((mmu->perm[i] & MPERM_RAW) == MPERM_RAW) {
-      mmu->perm[i] = MPERM_READ|MPERM_WRITE|(mmu->perm[i]&MPERM_EXEC);
+// Bookkeeping after guest memory was written: RAW becomes RW, decoded
+// code is dropped and pages are marked dirty
+void mmu_written(mmu_t *mmu, const vaddr_t vaddr, const size_t size_in_bytes)
+{
+  if(size_in_bytes == 0) {
+    return;
+  }
+
+  // RAW becomes RW, and self-modifying code tells whoever caches decoded
+  // instructions
+  const size_t end = (size_t)vaddr + size_in_bytes;
+  bool code = false;
+  for(size_t first = vaddr & ~(size_t)(MMU_PAGE_SIZE - 1); first < end; first += MMU_PAGE_SIZE) {
+    const size_t lo = vaddr > first ? vaddr - first : 0;
+    const size_t hi = end - first < MMU_PAGE_SIZE ? end - first : MMU_PAGE_SIZE;
+    mmu_chunk_t *c = chunk_of(mmu, first);
+    const size_t pg = page_of(first);
+    const uint8_t p = c->page_perm[pg];
+    if((p & MPAGE_SHADOW) != 0) {
+      shadow_promote(c->shadow[pg], lo, hi);
+      c->perm_dirty = true;
+    } else if(p == MPAGE_WRITE && lo == 0 && hi == MMU_PAGE_SIZE) {
+      c->page_perm[pg] = MPAGE_READ|MPAGE_WRITE;
+      c->perm_dirty = true;
+#ifdef MMU_GUARD
+      guard_protect(mmu, first, host_access(c, pg));
+#endif
+    } else if(p == MPAGE_WRITE) {
+      shadow_set(page_shadow(c, pg), lo, hi, MPAGE_READ|MPAGE_WRITE);
     }
+    code |= lo < c->exec_spans[pg].hi && hi > c->exec_spans[pg].lo;
+  }
+  if(code) {
+    code_written(mmu, vaddr, size_in_bytes);
   }
 
   // Mark dirty
-  const size_t dbi = (vaddr - mmu->base) / DIRTY_PAGE_SIZE;
-  const size_t dbe = (vaddr - mmu->base + size_in_bytes) / DIRTY_PAGE_SIZE;
-  for(size_t i=dbi; i < dbe; i++) {
-    mmu->dirty[i] = true;
+  for(size_t i = vaddr / DIRTY_PAGE_SIZE; i * DIRTY_PAGE_SIZE < end; i++) {
+    mmu_dirty_block(mmu, i * DIRTY_PAGE_SIZE);
   }
-  return size_in_bytes;
+}
+
+// Host pointer to an aligned guest word, for atomic access that bypasses
+// the bus lock. perm is MPERM_READ, or MPERM_WRITE for read-modify-write;
+// the caller calls mmu_written after a successful write.
+uint32_t *mmu_atomic_word(mmu_t *mmu, const vaddr_t vaddr, const mperm_t perm)
+{
+  if((vaddr & 3) != 0) {
+    return NULL;
+  }
+  if(!mmu_check_access(mmu, vaddr, sizeof(uint32_t), MPERM_READ) ||
+     (perm == MPERM_WRITE && !mmu_check_access(mmu, vaddr, sizeof(uint32_t), MPERM_WRITE))) {
+    return NULL;
+  }
+  return (uint32_t *)(chunk_of(mmu, vaddr)->data + (vaddr & (MMU_CHUNK_SIZE - 1)));
+}
+
+// Host memory for instruction fetch at vaddr, NULL unless vaddr is in a
+// run of executable bytes of its page and all of the run is readable.
+// *start and *len get the guest range of the run. The pointer stays good while mmu->perm_gen is unchanged.
+const uint8_t *mmu_exec_span(const mmu_t *mmu, const vaddr_t vaddr, vaddr_t *start, size_t *len)
+{
+  const mmu_chunk_t *c = chunk_of(mmu, vaddr);
+  if(c == NULL) {
+    return NULL;
+  }
+  const mmu_span_t span = exec_run(c, page_of(vaddr), vaddr & (MMU_PAGE_SIZE - 1));
+  const vaddr_t first = (vaddr & ~(vaddr_t)(MMU_PAGE_SIZE - 1)) + span.lo;
+  if(vaddr < first || vaddr - first >= (vaddr_t)(span.hi - span.lo) ||
+     !allowed(mmu, first, span.hi - span.lo, MPAGE_READ)) {
+    return NULL;
+  }
+  *start = first;
+  *len = span.hi - span.lo;
+  return c->data + (first & (MMU_CHUNK_SIZE - 1));
+}
+
+// Host memory of the MMU_PAGE_SIZE page at vaddr for perm, NULL unless
+// host_access allows it. The pointer stays good while mmu->perm_gen is
+// unchanged.
+uint8_t *mmu_host_page(mmu_t *mmu, const vaddr_t vaddr, const mperm_t perm)
+{
+  const mmu_chunk_t *c = chunk_of(mmu, vaddr);
+  if(c == NULL || (vaddr & (MMU_PAGE_SIZE - 1)) != 0) {
+    return NULL;
+  }
+  if((host_access(c, page_of(vaddr)) & perm) == 0) {
+    return NULL;
+  }
+  return c->data + (vaddr & (MMU_CHUNK_SIZE - 1));
 }
 
 size_t mmu_read_into(mmu_t *mmu,
@@ -199,13 +1099,13 @@ size_t mmu_read_into(mmu_t *mmu,
 		     vaddr_t vaddr,
 		     size_t size_in_bytes)
 {
-  if(vaddr < mmu->base || vaddr + size_in_bytes > mmu->base + mmu->size) {
+  if(!in_space(vaddr, size_in_bytes)) {
     mmu->state = WRITE_PAGE_FAULT;
     return 0;
   }
 
   if(mmu_check_access(mmu, vaddr, size_in_bytes, MPERM_READ)) {
-    memcpy(dst, (uint8_t*)mmu->data + (vaddr - mmu->base), size_in_bytes);
+    copy(mmu, vaddr, dst, size_in_bytes, false);
     mmu->state = MMU_OK;
   } else {
     fprintf(stderr, "mmu::read_into from 0x%08x, size %zu, access denied!\n", vaddr, size_in_bytes);
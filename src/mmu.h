@@ -19,18 +19,104 @@ typedef enum _mmu_state_t {
 } mmu_state_t;
 
 typedef uint32_t vaddr_t;
-    
+
+// Called when a write touches memory with MPERM_EXEC set, so that anything
+// derived from the instruction stream (decoded instructions) can be dropped.
+typedef void (*mmu_code_write_t)(void *user, const vaddr_t vaddr, const size_t size);
+
+#define MMU_CODE_WATCHERS 8
+
+typedef struct _mmu_code_watch_t {
+  mmu_code_write_t invalidate;
+  void            *user;
+} mmu_code_watch_t;
+
+// Access permissions are kept per MMU_PAGE_SIZE page. A page whose bytes
+// differ has MPAGE_SHADOW set and a shadow of 2 bits per byte, MPAGE_READ
+// and MPAGE_WRITE in the same positions: 0 none, 1 read, 2 read after
+// write (MPERM_RAW), 3 read and write. A write always makes memory
+// readable, so MPERM_WRITE and MPERM_RAW both map to MPAGE_WRITE.
+#define MPAGE_READ	1
+#define MPAGE_WRITE	2
+#define MPAGE_SHADOW	4
+
+// Bytes within a page that were given MPERM_EXEC, [lo, hi) from its start;
+// empty when lo == hi. Where they are not one run the span covers them all
+// and the page has an exec map, a bit per byte, to tell them apart.
+typedef struct _mmu_span_t {
+  uint16_t lo;
+  uint16_t hi;
+} mmu_span_t;
+
+#define DIRTY_PAGE_SIZE 64
+#define MMU_PAGE_SHIFT 12
+#define MMU_PAGE_SIZE (1 << MMU_PAGE_SHIFT)
+#define MMU_SHADOW_SIZE (MMU_PAGE_SIZE / 4)
+#define MMU_EXEC_MAP_SIZE (MMU_PAGE_SIZE / 8)
+
+// The 32 bit guest address space is split into chunks of 4 MiB, each with
+// its memory and page tables, that exist only where memory was added
+#define MMU_SPACE_SIZE  ((size_t)1 << 32)
+#define MMU_CHUNK_SHIFT 22
+#define MMU_CHUNK_SIZE  ((size_t)1 << MMU_CHUNK_SHIFT)
+#define MMU_CHUNK_PAGES (MMU_CHUNK_SIZE >> MMU_PAGE_SHIFT)
+#define MMU_CHUNK_DIRTY (MMU_CHUNK_SIZE / DIRTY_PAGE_SIZE)
+#define MMU_DIR_SIZE    (MMU_SPACE_SIZE >> MMU_CHUNK_SHIFT)
+
+typedef struct _mmu_chunk_t {
+  uint8_t   *data;                        // MMU_CHUNK_SIZE bytes of guest memory
+  uint8_t    page_perm[MMU_CHUNK_PAGES];  // MPAGE_* per page
+  uint8_t   *shadow[MMU_CHUNK_PAGES];     // MMU_SHADOW_SIZE bytes when MPAGE_SHADOW
+  mmu_span_t exec_spans[MMU_CHUNK_PAGES];
+  uint8_t   *exec_map[MMU_CHUNK_PAGES];   // MMU_EXEC_MAP_SIZE bytes, NULL when the span is exact
+  bool       dirty[MMU_CHUNK_DIRTY];      // per DIRTY_PAGE_SIZE bytes, since the snapshot
+  bool       perm_dirty;                  // page tables changed since the snapshot
+  struct _mmu_chunk_snap_t *snap;         // NULL when the chunk is newer than the snapshot
+} mmu_chunk_t;
+
+// A chunk as it was at mmu_snapshot
+typedef struct _mmu_chunk_snap_t {
+  uint8_t   *data;
+  uint8_t    page_perm[MMU_CHUNK_PAGES];
+  uint8_t   *shadow[MMU_CHUNK_PAGES];
+  mmu_span_t exec_spans[MMU_CHUNK_PAGES];
+  uint8_t   *exec_map[MMU_CHUNK_PAGES];
+} mmu_chunk_snap_t;
+
 typedef struct _mmu_t {
-  size_t  size;
+  size_t  size;           // RAM from base, where mmu_allocate hands out memory
   vaddr_t base;
   size_t  curr_vaddr;
-  void    *data;
-  mperm_t *perm;
-  bool    *dirty;
+  mmu_chunk_t *dir[MMU_DIR_SIZE]; // by address >> MMU_CHUNK_SHIFT, NULL when unmapped
+  uint32_t perm_gen;   // bumped when permissions change
+  uint8_t *guard;         // MMU_GUARD: guest memory at guard + address, see guard.h
+  int      guard_fd;
   mmu_state_t state;
+  mmu_code_watch_t code_watch[MMU_CODE_WATCHERS];
+  size_t  code_watch_cnt;
+  uint32_t *dirty_list;   // address / DIRTY_PAGE_SIZE of each block in dirty, in no order
+  size_t  dirty_cnt;
+  bool    snapped;        // mmu_snapshot was taken, with the fields below
+  size_t  snap_size;
+  size_t  snap_curr_vaddr;
 } mmu_t;
 
-#define DIRTY_PAGE_SIZE 64
+// Mark the DIRTY_PAGE_SIZE block holding vaddr dirty, listing it the first
+// time. Cores store concurrently, so exactly one of them gets to list it.
+static inline void mmu_dirty_block(mmu_t *mmu, const vaddr_t vaddr)
+{
+  bool *d = &mmu->dir[vaddr >> MMU_CHUNK_SHIFT]->dirty[(vaddr & (MMU_CHUNK_SIZE - 1)) / DIRTY_PAGE_SIZE];
+  if(!*d && !__atomic_exchange_n(d, true, __ATOMIC_RELAXED)) {
+    mmu->dirty_list[__atomic_fetch_add(&mmu->dirty_cnt, 1, __ATOMIC_RELAXED)] = vaddr / DIRTY_PAGE_SIZE;
+  }
+}
+
+// Mark a store of at most a word, made straight to host memory, dirty
+static inline void mmu_dirty(mmu_t *mmu, const vaddr_t vaddr, const size_t size)
+{
+  mmu_dirty_block(mmu, vaddr);
+  mmu_dirty_block(mmu, vaddr + size - 1);
+}
 
 bool     mmu_check_access(const mmu_t *,
 			  const vaddr_t,
@@ -38,10 +124,21 @@ bool     mmu_check_access(const mmu_t *,
 			  const mperm_t);
 mmu_t	*mmu_init(const vaddr_t, const size_t);
 bool     mmu_add_memory(mmu_t *mmu, const vaddr_t addr, const size_t size, const mperm_t perm);
+bool     mmu_mapped(const mmu_t *, const vaddr_t);
 vaddr_t	 mmu_allocate(mmu_t *, const size_t, mperm_t);
 vaddr_t	 mmu_allocate_raw(mmu_t *, const size_t);
 size_t	 mmu_write_from(mmu_t *, const void *, const vaddr_t, const size_t);
+size_t	 mmu_write_from_file(mmu_t *, const int, const off_t, const vaddr_t, const size_t);
 size_t	 mmu_read_into(mmu_t *, void *, vaddr_t, size_t);
+uint32_t *mmu_atomic_word(mmu_t *, const vaddr_t, const mperm_t);
+const uint8_t *mmu_exec_span(const mmu_t *, const vaddr_t, vaddr_t *, size_t *);
+uint8_t	*mmu_host_page(mmu_t *, const vaddr_t, const mperm_t);
+void	 mmu_written(mmu_t *, const vaddr_t, const size_t);
 void	 mmu_setperm(mmu_t *, const vaddr_t, const size_t, const mperm_t);
+bool	 mmu_watch_code(mmu_t *, mmu_code_write_t, void *);
+bool	 mmu_snapshot(mmu_t *);
+void	 mmu_restore(mmu_t *);
+bool	 mmu_save(const mmu_t *, const int);
+bool	 mmu_load(mmu_t *, const int);
 
 #endif
@@ -0,0 +1,199 @@
+/**
+Copyright 2022 orIgo <mrorigo@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include "rvc.h"
+
+#define BIT(x, n)          (((x) >> (n)) & 1)
+#define BITS(x, hi, lo)    (((x) >> (lo)) & ((1u << ((hi) - (lo) + 1)) - 1))
+#define SEXT(x, bits)      ((int32_t)((uint32_t)(x) << (32 - (bits))) >> (32 - (bits)))
+#define RC(x, lo)          (8 + BITS(x, (lo) + 2, lo)) // x8-x15 register field
+
+// Base opcodes
+#define LOAD     0b0000011
+#define LOAD_FP  0b0000111
+#define OP_IMM   0b0010011
+#define STORE    0b0100011
+#define STORE_FP 0b0100111
+#define OP       0b0110011
+#define LUI      0b0110111
+#define BRANCH   0b1100011
+#define JALR     0b1100111
+#define JAL      0b1101111
+#define SYSTEM   0b1110011
+
+static inline uint32_t enc_r(uint32_t f7, uint32_t rs2, uint32_t rs1, uint32_t f3, uint32_t rd, uint32_t op)
+{
+  return (f7 << 25) | (rs2 << 20) | (rs1 << 15) | (f3 << 12) | (rd << 7) | op;
+}
+
+static inline uint32_t enc_i(int32_t imm, uint32_t rs1, uint32_t f3, uint32_t rd, uint32_t op)
+{
+  return ((uint32_t)imm << 20) | (rs1 << 15) | (f3 << 12) | (rd << 7) | op;
+}
+
+static inline uint32_t enc_s(int32_t imm, uint32_t rs2, uint32_t rs1, uint32_t f3, uint32_t op)
+{
+  return (BITS((uint32_t)imm, 11, 5) << 25) | (rs2 << 20) | (rs1 << 15) | (f3 << 12) |
+    (BITS((uint32_t)imm, 4, 0) << 7) | op;
+}
+
+static inline uint32_t enc_b(int32_t imm, uint32_t rs2, uint32_t rs1, uint32_t f3)
+{
+  const uint32_t u = (uint32_t)imm;
+  return (BIT(u, 12) << 31) | (BITS(u, 10, 5) << 25) | (rs2 << 20) | (rs1 << 15) | (f3 << 12) |
+    (BITS(u, 4, 1) << 8) | (BIT(u, 11) << 7) | BRANCH;
+}
+
+static inline uint32_t enc_j(int32_t imm, uint32_t rd)
+{
+  const uint32_t u = (uint32_t)imm;
+  return (BIT(u, 20) << 31) | (BITS(u, 10, 1) << 21) | (BIT(u, 11) << 20) |
+    (BITS(u, 19, 12) << 12) | (rd << 7) | JAL;
+}
+
+// CJ format jump offset
+static inline int32_t cj_offset(const uint32_t c)
+{
+  return SEXT((BIT(c, 12) << 11) | (BIT(c, 11) << 4) | (BITS(c, 10, 9) << 8) |
+	      (BIT(c, 8) << 10) | (BIT(c, 7) << 6) | (BIT(c, 6) << 7) |
+	      (BITS(c, 5, 3) << 1) | (BIT(c, 2) << 5), 12);
+}
+
+// CB format branch offset
+static inline int32_t cb_offset(const uint32_t c)
+{
+  return SEXT((BIT(c, 12) << 8) | (BITS(c, 11, 10) << 3) | (BITS(c, 6, 5) << 6) |
+	      (BITS(c, 4, 3) << 1) | (BIT(c, 2) << 5), 9);
+}
+
+// 6 bit immediate in bits 12 and 6:2
+static inline int32_t ci_imm(const uint32_t c)
+{
+  return SEXT((BIT(c, 12) << 5) | BITS(c, 6, 2), 6);
+}
+
+static uint32_t quadrant0(const uint32_t c)
+{
+  const uint32_t rd = RC(c, 2), rs1 = RC(c, 7);
+  // CL/CS word and double offsets
+  const uint32_t woff = (BITS(c, 12, 10) << 3) | (BIT(c, 6) << 2) | (BIT(c, 5) << 6);
+  const uint32_t doff = (BITS(c, 12, 10) << 3) | (BITS(c, 6, 5) << 6);
+
+  switch(BITS(c, 15, 13)) {
+  case 0b000: { // C.ADDI4SPN
+    const uint32_t imm = (BITS(c, 12, 11) << 4) | (BITS(c, 10, 7) << 6) | (BIT(c, 6) << 2) | (BIT(c, 5) << 3);
+    return imm ? enc_i(imm, 2, 0b000, rd, OP_IMM) : 0;
+  }
+  case 0b001: return enc_i(doff, rs1, 0b011, rd, LOAD_FP);   // C.FLD
+  case 0b010: return enc_i(woff, rs1, 0b010, rd, LOAD);      // C.LW
+  case 0b011: return enc_i(woff, rs1, 0b010, rd, LOAD_FP);   // C.FLW
+  case 0b101: return enc_s(doff, rd, rs1, 0b011, STORE_FP);  // C.FSD
+  case 0b110: return enc_s(woff, rd, rs1, 0b010, STORE);     // C.SW
+  case 0b111: return enc_s(woff, rd, rs1, 0b010, STORE_FP);  // C.FSW
+  default:    return 0;
+  }
+}
+
+static uint32_t quadrant1(const uint32_t c)
+{
+  const uint32_t rd = BITS(c, 11, 7);
+  const uint32_t rdc = RC(c, 7), rs2c = RC(c, 2);
+
+  switch(BITS(c, 15, 13)) {
+  case 0b000: return enc_i(ci_imm(c), rd, 0b000, rd, OP_IMM); // C.ADDI, C.NOP
+  case 0b001: return enc_j(cj_offset(c), 1);                  // C.JAL
+  case 0b010: return enc_i(ci_imm(c), 0, 0b000, rd, OP_IMM);  // C.LI
+  case 0b011:
+    if(rd == 2) { // C.ADDI16SP
+      const int32_t imm = SEXT((BIT(c, 12) << 9) | (BIT(c, 6) << 4) | (BIT(c, 5) << 6) |
+			       (BITS(c, 4, 3) << 7) | (BIT(c, 2) << 5), 10);
+      return imm ? enc_i(imm, 2, 0b000, 2, OP_IMM) : 0;
+    } else { // C.LUI
+      const int32_t imm = ci_imm(c);
+      return imm ? (((uint32_t)imm << 12) | (rd << 7) | LUI) : 0;
+    }
+  case 0b100:
+    switch(BITS(c, 11, 10)) {
+    case 0b00: return BIT(c, 12) ? 0 : enc_i(BITS(c, 6, 2), rdc, 0b101, rdc, OP_IMM);              // C.SRLI
+    case 0b01: return BIT(c, 12) ? 0 : enc_i(BITS(c, 6, 2) | 0x400, rdc, 0b101, rdc, OP_IMM);      // C.SRAI
+    case 0b10: return enc_i(ci_imm(c), rdc, 0b111, rdc, OP_IMM);                                   // C.ANDI
+    default:
+      if(BIT(c, 12)) {
+	return 0; // RV64 C.SUBW/C.ADDW
+      }
+      switch(BITS(c, 6, 5)) {
+      case 0b00: return enc_r(0b0100000, rs2c, rdc, 0b000, rdc, OP); // C.SUB
+      case 0b01: return enc_r(0, rs2c, rdc, 0b100, rdc, OP);         // C.XOR
+      case 0b10: return enc_r(0, rs2c, rdc, 0b110, rdc, OP);         // C.OR
+      default:   return enc_r(0, rs2c, rdc, 0b111, rdc, OP);         // C.AND
+      }
+    }
+  case 0b101: return enc_j(cj_offset(c), 0);                // C.J
+  case 0b110: return enc_b(cb_offset(c), 0, rdc, 0b000);    // C.BEQZ
+  default:    return enc_b(cb_offset(c), 0, rdc, 0b001);    // C.BNEZ
+  }
+}
+
+static uint32_t quadrant2(const uint32_t c)
+{
+  const uint32_t rd = BITS(c, 11, 7), rs2 = BITS(c, 6, 2);
+  const uint32_t lwsp = (BIT(c, 12) << 5) | (BITS(c, 6, 4) << 2) | (BITS(c, 3, 2) << 6);
+  const uint32_t ldsp = (BIT(c, 12) << 5) | (BITS(c, 6, 5) << 3) | (BITS(c, 4, 2) << 6);
+  const uint32_t swsp = (BITS(c, 12, 9) << 2) | (BITS(c, 8, 7) << 6);
+  const uint32_t sdsp = (BITS(c, 12, 10) << 3) | (BITS(c, 9, 7) << 6);
+
+  switch(BITS(c, 15, 13)) {
+  case 0b000: return BIT(c, 12) ? 0 : enc_i(rs2, rd, 0b001, rd, OP_IMM); // C.SLLI
+  case 0b001: return enc_i(ldsp, 2, 0b011, rd, LOAD_FP);                 // C.FLDSP
+  case 0b010: return rd ? enc_i(lwsp, 2, 0b010, rd, LOAD) : 0;           // C.LWSP
+  case 0b011: return enc_i(lwsp, 2, 0b010, rd, LOAD_FP);                 // C.FLWSP
+  case 0b100:
+    if(!BIT(c, 12)) {
+      if(rs2 == 0) {
+	return rd ? enc_i(0, rd, 0b000, 0, JALR) : 0;  // C.JR
+      }
+      return enc_r(0, rs2, 0, 0b000, rd, OP);         // C.MV
+    }
+    if(rs2 == 0) {
+      if(rd == 0) {
+	return enc_i(1, 0, 0b000, 0, SYSTEM);          // C.EBREAK
+      }
+      return enc_i(0, rd, 0b000, 1, JALR);             // C.JALR
+    }
+    return enc_r(0, rs2, rd, 0b000, rd, OP);          // C.ADD
+  case 0b101: return enc_s(sdsp, rs2, 2, 0b011, STORE_FP); // C.FSDSP
+  case 0b110: return enc_s(swsp, rs2, 2, 0b010, STORE);    // C.SWSP
+  default:    return enc_s(swsp, rs2, 2, 0b010, STORE_FP); // C.FSWSP
+  }
+}
+
+uint32_t rvc_expand(const uint16_t parcel)
+{
+  const uint32_t c = parcel;
+  if(c == 0) {
+    return 0; // defined illegal
+  }
+  switch(c & 3) {
+  case 0:  return quadrant0(c);
+  case 1:  return quadrant1(c);
+  case 2:  return quadrant2(c);
+  default: return 0;
+  }
+}
@@ -0,0 +1,212 @@
+/**
+Copyright 2022 orIgo <mrorigo@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sv32.h"
+
+#define PTE_V (1u << 0)
+#define PTE_R (1u << 1)
+#define PTE_W (1u << 2)
+#define PTE_X (1u << 3)
+#define PTE_U (1u << 4)
+#define PTE_A (1u << 6)
+#define PTE_D (1u << 7)
+
+static const trap_cause_t page_fault[] = {
+  LOAD_PAGE_FAULT, STORE_PAGE_FAULT, INSTRUCTION_PAGE_FAULT
+};
+static const trap_cause_t access_fault[] = {
+  LOAD_ACCESS_FAULT, STORE_ACCESS_FAULT, INSTRUCTION_ACCESS_FAULT
+};
+
+tlb_t *sv32_init(void)
+{
+  tlb_t *tlb = malloc(sizeof(tlb_t));
+  if(!tlb) {
+    return NULL;
+  }
+  memset(tlb, 0, sizeof(tlb_t));
+  for(size_t i=0; i < TLB_ENTRIES; i++) {
+    tlb->entries[i].tag[TLB_LOAD] = tlb->entries[i].tag[TLB_STORE] = tlb->entries[i].tag[TLB_FETCH] = TLB_NONE;
+  }
+  return tlb;
+}
+
+// Work out what is translated after satp, mstatus or the privilege mode
+// changed. Cached translations were checked against the old state, so
+// they are all dropped.
+void sv32_update(core_t *core)
+{
+  tlb_t *tlb = core->tlb;
+  const uint32_t status = core->csr.state[mstatus];
+  const bool paging = (core->csr.state[satp] & SATP_MODE_SV32) != 0;
+
+  tlb->data_mode = core->priv_mode;
+  if(core->priv_mode == PMODE_MACHINE && (status & MSTATUS_MPRV) != 0) {
+    switch((status >> MSTATUS_MPP_SHIFT) & 3) {
+    case 0:  tlb->data_mode = PMODE_USER;       break;
+    case 1:  tlb->data_mode = PMODE_SUPERVISOR; break;
+    default: tlb->data_mode = PMODE_MACHINE;    break;
+    }
+  }
+  tlb->data = paging && tlb->data_mode != PMODE_MACHINE;
+  tlb->fetch = paging && core->priv_mode != PMODE_MACHINE;
+  sv32_flush(core, 0, true);
+}
+
+// SFENCE.VMA: drop the translation of the page holding va, or all of them.
+// Megapages are split over several entries, so once there are any, every
+// flush drops everything.
+void sv32_flush(core_t *core, const vaddr_t va, const bool all)
+{
+  tlb_t *tlb = core->tlb;
+  if(all || tlb->mega) {
+    for(size_t i=0; i < TLB_ENTRIES; i++) {
+      tlb->entries[i].tag[TLB_LOAD] = tlb->entries[i].tag[TLB_STORE] = tlb->entries[i].tag[TLB_FETCH] = TLB_NONE;
+    }
+    tlb->mega = false;
+    tlb->gen = core->mmu ? core->mmu->perm_gen : 0;
+    return;
+  }
+  tlb_entry_t *e = &tlb->entries[TLB_INDEX(va)];
+  e->tag[TLB_LOAD] = e->tag[TLB_STORE] = e->tag[TLB_FETCH] = TLB_NONE;
+}
+
+// May mode use a page with the U bit u? Supervisor data accesses to user
+// pages need mstatus.SUM, supervisor fetch from them is never allowed.
+static inline bool privileged(const core_t *core, const priv_mode_t mode, const bool u, const bool fetch)
+{
+  if(mode == PMODE_USER) {
+    return u;
+  }
+  return !u || (!fetch && (core->csr.state[mstatus] & MSTATUS_SUM) != 0);
+}
+
+static bool fault(core_t *core, const vaddr_t va, const trap_cause_t cause)
+{
+  (void)csr_read_write32(&core->csr, mtval, va);
+  cause_trap(core, cause);
+  return false;
+}
+
+// Walk the page table for va and fill its TLB entry, trapping with a page
+// or access fault when access is not allowed
+static bool walk(core_t *core, const vaddr_t va, const tlb_access_t access)
+{
+  vaddr_t table = (core->csr.state[satp] & SATP_PPN) << SV32_PAGE_SHIFT;
+  vaddr_t pte_addr = 0;
+  uint32_t pte = 0;
+  int level;
+  for(level = 1; level >= 0; level--) {
+    pte_addr = table + ((va >> (SV32_PAGE_SHIFT + 10 * level)) & 0x3ff) * sizeof(uint32_t);
+    pte = bus_read_single(core->bus, pte_addr, WORD);
+    if(core->bus->status != BUS_OK) {
+      return fault(core, va, access_fault[access]);
+    }
+    if((pte & PTE_V) == 0 || (pte & (PTE_R|PTE_W)) == PTE_W) {
+      return fault(core, va, page_fault[access]);
+    }
+    if((pte & (PTE_R|PTE_X)) != 0) {
+      break;
+    }
+    if((pte >> 30) != 0) {
+      return fault(core, va, access_fault[access]); // beyond the 32 bit physical address space
+    }
+    table = (pte >> 10) << SV32_PAGE_SHIFT;
+  }
+  if(level < 0 || (level == 1 && ((pte >> 10) & 0x3ff) != 0)) {
+    return fault(core, va, page_fault[access]); // no leaf, or a misaligned megapage
+  }
+  if((pte >> 30) != 0) {
+    return fault(core, va, access_fault[access]);
+  }
+
+  tlb_t *tlb = core->tlb;
+  const bool u = (pte & PTE_U) != 0;
+  const bool data = privileged(core, tlb->data_mode, u, false);
+  const bool mxr = (core->csr.state[mstatus] & MSTATUS_MXR) != 0;
+  const bool allowed[] = {
+    data && ((pte & PTE_R) != 0 || (mxr && (pte & PTE_X) != 0)),
+    data && (pte & PTE_W) != 0,
+    privileged(core, core->priv_mode, u, true) && (pte & PTE_X) != 0
+  };
+  if(!allowed[access]) {
+    return fault(core, va, page_fault[access]);
+  }
+
+  // Hardware managed A and D bits
+  const uint32_t ad = PTE_A | (access == TLB_STORE ? PTE_D : 0);
+  if((pte & ad) != ad) {
+    pte |= ad;
+    bus_write_single(core->bus, pte_addr, pte, WORD);
+    if(core->bus->status != BUS_OK) {
+      return fault(core, va, access_fault[access]);
+    }
+  }
+
+  tlb_entry_t *e = &tlb->entries[TLB_INDEX(va)];
+  const uint32_t vpn = va >> SV32_PAGE_SHIFT;
+  e->page = level == 1 ?
+    ((pte >> 20) << 22) | (va & 0x3ff000) :
+    (pte >> 10) << SV32_PAGE_SHIFT;
+  e->tag[TLB_LOAD] = allowed[TLB_LOAD] ? vpn : TLB_NONE;
+  e->tag[TLB_STORE] = allowed[TLB_STORE] && (pte & PTE_D) != 0 ? vpn : TLB_NONE;
+  e->tag[TLB_FETCH] = allowed[TLB_FETCH] && tlb->fetch ? vpn : TLB_NONE;
+  e->load = core->mmu ? mmu_host_page(core->mmu, e->page, MPERM_READ) : NULL;
+  e->store = core->mmu ? mmu_host_page(core->mmu, e->page, MPERM_WRITE) : NULL;
+  tlb->mega |= level == 1;
+#ifdef MEM_TRACE
+  fprintf(stderr, "sv32::walk va=0x%08x pa=0x%08x pte=0x%08x\n", va, e->page, pte);
+#endif
+  return true;
+}
+
+// Without translation, loads and stores still go through the TLB so RAM
+// pages get their host pointers; va is the physical address then
+static void identity(core_t *core, const vaddr_t va)
+{
+  tlb_entry_t *e = &core->tlb->entries[TLB_INDEX(va)];
+  const uint32_t vpn = va >> SV32_PAGE_SHIFT;
+  e->page = va & ~(SV32_PAGE_SIZE - 1);
+  e->tag[TLB_LOAD] = e->tag[TLB_STORE] = vpn;
+  e->tag[TLB_FETCH] = TLB_NONE;
+  e->load = core->mmu ? mmu_host_page(core->mmu, e->page, MPERM_READ) : NULL;
+  e->store = core->mmu ? mmu_host_page(core->mmu, e->page, MPERM_WRITE) : NULL;
+}
+
+// Physical address of va for access, trapping on a fault
+bool sv32_translate(core_t *core, const vaddr_t va, const tlb_access_t access, vaddr_t *pa)
+{
+  // Host pointers are stale once the mmu changed permissions or moved
+  if(core->mmu && core->tlb->gen != core->mmu->perm_gen) {
+    sv32_flush(core, 0, true);
+  }
+  if(!sv32_cached(core->tlb, va, access, pa)) {
+    if(!core->tlb->data && access != TLB_FETCH) {
+      identity(core, va);
+    } else if(!walk(core, va, access)) {
+      return false;
+    }
+    (void)sv32_cached(core->tlb, va, access, pa);
+  }
+  return true;
+}
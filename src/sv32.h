@@ -0,0 +1,86 @@
+/**
+Copyright 2022 orIgo <mrorigo@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef __SV32_H__
+#define __SV32_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include "cpu.h"
+
+// Sv32 paging for S and U mode, and for M mode loads and stores under
+// mstatus.MPRV. satp points at the root page table; walks read it through
+// the bus with physical addresses and set the A and D bits of the leaf in
+// place. Translations are cached per core in a direct-mapped TLB of 4 KiB
+// entries, megapages are split. An entry holds the virtual page number
+// under which loads, stores and fetches may use it, so one compare answers
+// both hit and permission. For plain RAM it also holds the host address of
+// the page, so a load or store that hits needs no bus at all. With
+// translation off, loads and stores fill identity entries for the same
+// reason.
+#define SATP_MODE_SV32    (1u << 31)
+#define SATP_PPN          0x003fffff
+#define MSTATUS_MPP_SHIFT 11
+#define MSTATUS_MPRV      (1u << 17)
+#define MSTATUS_SUM       (1u << 18)
+#define MSTATUS_MXR       (1u << 19)
+
+#define SV32_PAGE_SHIFT   12
+#define SV32_PAGE_SIZE    (1u << SV32_PAGE_SHIFT)
+#define TLB_INDEX(va)     (((va) >> SV32_PAGE_SHIFT) & (TLB_ENTRIES - 1))
+#define TLB_NONE          0xffffffff // never a virtual page number
+
+typedef enum _tlb_access_t {
+  TLB_LOAD, TLB_STORE, TLB_FETCH
+} tlb_access_t;
+
+typedef struct _tlb_entry_t {
+  uint32_t tag[3]; // virtual page number per tlb_access_t, TLB_NONE if not allowed
+  vaddr_t  page;   // physical address of the page
+  uint8_t *load;   // host memory of the page for loads, NULL to use the bus
+  uint8_t *store;  // the same for stores
+} tlb_entry_t;
+
+typedef struct _tlb_t {
+  bool        data;      // loads and stores are translated
+  bool        fetch;     // instruction fetch is translated
+  bool        mega;      // some entry came from a megapage
+  priv_mode_t data_mode; // privilege loads and stores are checked with
+  uint32_t    gen;       // mmu->perm_gen the host pointers were taken at
+  tlb_entry_t entries[TLB_ENTRIES];
+} tlb_t;
+
+tlb_t	*sv32_init(void);
+void	 sv32_update(core_t *);
+void	 sv32_flush(core_t *, const vaddr_t, const bool);
+bool	 sv32_translate(core_t *, const vaddr_t, const tlb_access_t, vaddr_t *);
+
+// Translation from the TLB alone, false on a miss
+static inline bool sv32_cached(const tlb_t *tlb, const vaddr_t va, const tlb_access_t access, vaddr_t *pa)
+{
+  const tlb_entry_t *e = &tlb->entries[TLB_INDEX(va)];
+  if(e->tag[access] != va >> SV32_PAGE_SHIFT) {
+    return false;
+  }
+  *pa = e->page | (va & (SV32_PAGE_SIZE - 1));
+  return true;
+}
+
+#endif
@@ -119,6 +119,18 @@ SYSCALL1(sys_brk) {
   return true;
 }
 
+/**
+ * Emulator
+ */
+// The guest is done initialising: the core stops here for the emulator to
+// save a snapshot, and goes on with the next emulator_execute
+SYSCALL1(sys_snapshot) {
+  (void)arg0;
+  emu->snapshot_point = true;
+  core->trap_regs[10] = 0;
+  return false;
+}
+
 
 bool handle_syscall(emulator_t *emu, core_t *core,
 		    uint32_t n,
@@ -134,6 +146,7 @@ bool handle_syscall(emulator_t *emu, core_t *core,
   case SYS_exit:       fprintf(stderr, "syscall::exit()\n");       return false;
   case SYS_exit_group: fprintf(stderr, "syscall::exit_group()\n"); return false;
   case SYS_brk: return sys_brk(emu, core, arg0);
+  case SYS_snapshot: return sys_snapshot(emu, core, arg0);
   case SYS_read: return sys_read(emu, core, arg0, arg1, arg2);
   case SYS_write: return sys_write(emu, core, arg0, arg1, arg2);
   case SYS_open:  return sys_open(emu, core, arg0, arg1, arg2);
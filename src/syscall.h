@@ -47,6 +47,7 @@
 #define SYS_lstat 1039
 #define SYS_time 1062
 #define SYS_getmainvars 2011
+#define SYS_snapshot 2012
 
 bool handle_syscall(emulator_t *emu, core_t *core, uint32_t n, uint32_t arg0, uint32_t arg1,
 		    uint32_t arg2, uint32_t arg3, uint32_t arg4);
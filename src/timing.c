@@ -0,0 +1,189 @@
+/**
+Copyright 2022 orIgo <mrorigo@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "timing.h"
+
+#define OPCODE_LOAD 0b0000011
+#define OPCODE_AMO  0b0101111
+#define OPCODE_LOAD_FP 0b0000111
+#define OPCODE_STORE_FP 0b0100111
+#define OPCODE_FMADD 0b1000011
+#define OPCODE_OP_FP 0b1010011
+#define OPCODE_JAL  0b1101111
+
+// Writeback, counted from EX, with the register file written in the first
+// half of a cycle and read in the second
+#define WB_DISTANCE 2
+
+timing_t *timing_init(void)
+{
+  timing_t *t = malloc(sizeof(timing_t));
+  if(!t) {
+    return NULL;
+  }
+  memset(t, 0, sizeof(timing_t));
+  t->ex = 1;      // first instruction: IF at 0, ID at 1
+  t->next_ex = 0;
+  return t;
+}
+
+static inline void stall(timing_t *t, uint64_t *ex, const uint64_t until, const stall_t why)
+{
+  if(until > *ex) {
+    t->stalls[why] += until - *ex;
+    *ex = until;
+  }
+}
+
+// The register file each operand of an instruction names, if any. The
+// optype only knows about X; F/D loads, stores and arithmetic reuse I, S
+// and R, so those are told apart by the opcode.
+typedef enum _regfile_t { FILE_NONE, FILE_X, FILE_F } regfile_t;
+
+typedef struct _operands_t {
+  regfile_t rd, rs1, rs2, rs3;
+} operands_t;
+
+static operands_t operands(const dinstr_t *d)
+{
+  const uint32_t opcode = d->op & 0x7f;
+  operands_t o = { FILE_NONE, FILE_NONE, FILE_NONE, FILE_NONE };
+
+  if(d->optype == V) {
+    return o;
+  }
+  if(opcode == OPCODE_LOAD_FP) {
+    o.rd = FILE_F;
+    o.rs1 = FILE_X;
+  } else if(opcode == OPCODE_STORE_FP) {
+    o.rs1 = FILE_X;
+    o.rs2 = FILE_F;
+  } else if((opcode & 0b1110011) == OPCODE_FMADD) {
+    o.rd = o.rs1 = o.rs2 = o.rs3 = FILE_F;
+  } else if(opcode == OPCODE_OP_FP) {
+    // Conversions from and moves out of integers read X; compares,
+    // conversions to integers, moves into X and FCLASS write it
+    const uint32_t funct5 = (d->op >> 11) & 0x1f;
+    o.rs1 = (funct5 == 0b11010 || funct5 == 0b11110) ? FILE_X : FILE_F;
+    o.rs2 = (funct5 <= 0b00101 || funct5 == 0b10100) ? FILE_F : FILE_NONE;
+    o.rd = (funct5 == 0b10100 || funct5 == 0b11000 || funct5 == 0b11100) ? FILE_X : FILE_F;
+  } else {
+    if(d->optype == R || d->optype == I || d->optype == S || d->optype == B ||
+       (d->optype == C && d->op != OP_ECALL && !(d->op & (0b100 << 7)))) {
+      o.rs1 = FILE_X;
+    }
+    if(d->optype == R || d->optype == S || d->optype == B) {
+      o.rs2 = FILE_X;
+    }
+    if(d->optype == R || d->optype == I || d->optype == U ||
+       d->optype == J || (d->optype == C && d->op != OP_ECALL)) {
+      o.rd = FILE_X;
+    }
+  }
+  return o;
+}
+
+// Wait for a source register; x0 is always ready
+static inline void source(timing_t *t, uint64_t *ex, const regfile_t file, const uint8_t r)
+{
+  if(file == FILE_X && r != 0) {
+    stall(t, ex, t->ready[r], t->loaded[r] ? STALL_LOAD_USE : STALL_RAW);
+  } else if(file == FILE_F) {
+    stall(t, ex, t->fready[r], t->floaded[r] ? STALL_LOAD_USE : STALL_RAW);
+  }
+}
+
+void timing_retire(timing_t *t, const dinstr_t *d, const vaddr_t next)
+{
+  uint64_t ex = t->ex + 1;
+  stall(t, &ex, t->next_ex, t->next_reason);
+
+  // Data hazards on the source registers
+  const operands_t o = operands(d);
+  source(t, &ex, o.rs1, d->rs1);
+  source(t, &ex, o.rs2, d->rs2);
+  source(t, &ex, o.rs3, d->rs3);
+
+  // A blocking MEM stage holds everything behind it
+  const uint32_t opcode = d->op & 0x7f;
+  const bool load = opcode == OPCODE_LOAD || opcode == OPCODE_LOAD_FP || opcode == OPCODE_AMO;
+  const uint32_t mem = (load || d->optype == S) ? TIMING_MEM_LATENCY : 0;
+  t->next_ex = ex + 1 + mem;
+  t->next_reason = STALL_MEMORY;
+
+#ifdef TIMING_FORWARDING
+  // EX/MEM bypass for ALU results, MEM/WB bypass for loads
+  const uint64_t ready = ex + 1 + (load ? 1 + mem : 0);
+#else
+  const uint64_t ready = ex + WB_DISTANCE + 1 + mem;
+#endif
+  if(o.rd == FILE_X && d->rd != 0) {
+    t->ready[d->rd] = ready;
+    t->loaded[d->rd] = load;
+  } else if(o.rd == FILE_F) {
+    t->fready[d->rd] = ready;
+    t->floaded[d->rd] = load;
+  }
+
+  // Taken branches resolve in EX, JAL in ID; both flush what was fetched behind them
+  if(d->optype == B) {
+    t->branches++;
+  }
+  if(next != d->pc + d->len) {
+    const bool jal = (d->op & 0x7f) == OPCODE_JAL;
+    const uint64_t refill = ex + 1 + (jal ? TIMING_JUMP_PENALTY : TIMING_BRANCH_PENALTY);
+    if(refill > t->next_ex) {
+      t->next_ex = refill;
+      t->next_reason = d->optype == B ? STALL_BRANCH : STALL_JUMP;
+    }
+    t->taken += d->optype == B;
+  }
+
+  t->ex = ex;
+  t->instrs++;
+}
+
+// Cycles until the last retired instruction has left WB
+uint64_t timing_cycles(const timing_t *t)
+{
+  return t->instrs ? t->ex + WB_DISTANCE + 1 : 0;
+}
+
+void timing_report(const timing_t *t, const uint8_t id)
+{
+  static const char *names[STALL_KINDS] = {
+    "load-use", "raw", "branch", "jump", "memory"
+  };
+  const uint64_t cycles = timing_cycles(t);
+
+  fprintf(stderr, "timing::core %d: cycles=%lu instret=%lu IPC=%.3f CPI=%.3f\n", id,
+	  (unsigned long)cycles, (unsigned long)t->instrs,
+	  cycles ? (double)t->instrs / cycles : 0.0,
+	  t->instrs ? (double)cycles / t->instrs : 0.0);
+  fprintf(stderr, "timing::core %d: branches=%lu taken=%lu\n", id,
+	  (unsigned long)t->branches, (unsigned long)t->taken);
+  for(size_t i=0; i < STALL_KINDS; i++) {
+    fprintf(stderr, "timing::core %d: stall %-8s %10lu cycles (%.1f%%)\n", id, names[i],
+	    (unsigned long)t->stalls[i], cycles ? 100.0 * t->stalls[i] / cycles : 0.0);
+  }
+}
@@ -0,0 +1,61 @@
+/**
+Copyright 2022 orIgo <mrorigo@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef __TIMING_H__
+#define __TIMING_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include "cpu.h"
+
+// Cycle-approximate model of an in-order IF/ID/EX/MEM/WB pipeline, fed with
+// every retired instruction. Instructions overlap, so a cycle is only lost
+// to a hazard: a load-use (or, without forwarding, any RAW) dependency, a
+// taken branch or jump flushing the front end, or memory latency.
+typedef enum _stall_t {
+  STALL_LOAD_USE,
+  STALL_RAW,
+  STALL_BRANCH,
+  STALL_JUMP,
+  STALL_MEMORY,
+  STALL_KINDS
+} stall_t;
+
+typedef struct _timing_t {
+  uint64_t ex;              // cycle the last instruction was in EX
+  uint64_t next_ex;         // earliest EX cycle for the next one, after a flush or memory stall
+  stall_t  next_reason;
+  uint64_t ready[NUMREGS];  // first cycle a register can be consumed in EX
+  bool     loaded[NUMREGS]; // last written by a load
+  uint64_t fready[NUMREGS]; // the same for the F registers
+  bool     floaded[NUMREGS];
+
+  uint64_t instrs;
+  uint64_t branches;
+  uint64_t taken;
+  uint64_t stalls[STALL_KINDS];
+} timing_t;
+
+timing_t *timing_init(void);
+void	  timing_retire(timing_t *, const dinstr_t *, const vaddr_t);
+uint64_t  timing_cycles(const timing_t *);
+void	  timing_report(const timing_t *, const uint8_t);
+
+#endif
@@ -0,0 +1,1022 @@
+/**
+Copyright 2022 orIgo <mrorigo@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include <stdio.h>
+#include <string.h>
+#include "cpu.h"
+#include "vector.h"
+#include "sv32.h"
+
+// Host vectors. Everything below SIMD_KERNEL is written once against V()
+// and the VAND family, so the SSE2 and AVX2 builds share their kernels;
+// without either, the scalar expressions given next to them are used.
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define VECTOR_SIMD	1
+#define VECTOR_CHUNK	32
+typedef __m256i vec_t;
+#define V(op)		_mm256_##op
+#define VLOAD(p)	_mm256_loadu_si256((const __m256i *)(p))
+#define VSTORE(p, v)	_mm256_storeu_si256((__m256i *)(p), v)
+#define VAND(a, b)	_mm256_and_si256(a, b)
+#define VOR(a, b)	_mm256_or_si256(a, b)
+#define VXOR(a, b)	_mm256_xor_si256(a, b)
+#define VANDNOT(a, b)	_mm256_andnot_si256(a, b) // ~a & b
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define VECTOR_SIMD	1
+#define VECTOR_CHUNK	16
+typedef __m128i vec_t;
+#define V(op)		_mm_##op
+#define VLOAD(p)	_mm_loadu_si128((const __m128i *)(p))
+#define VSTORE(p, v)	_mm_storeu_si128((__m128i *)(p), v)
+#define VAND(a, b)	_mm_and_si128(a, b)
+#define VOR(a, b)	_mm_or_si128(a, b)
+#define VXOR(a, b)	_mm_xor_si128(a, b)
+#define VANDNOT(a, b)	_mm_andnot_si128(a, b)
+#else
+#define VECTOR_CHUNK	16
+#endif
+
+#if VLENB % VECTOR_CHUNK != 0
+#error "VECTOR_VLEN must be a multiple of the host vector width"
+#endif
+
+#ifdef VECTOR_SIMD
+#define VONES		V(set1_epi32)(-1)
+#define VSELECT(m, x, y) VOR(VAND(m, x), VANDNOT(m, y)) // m ? x : y
+
+// Unsigned compares, as signed ones with the sign bits flipped
+static inline vec_t v_gtu8(const vec_t a, const vec_t b)
+{
+  const vec_t s = V(set1_epi8)((char)0x80);
+  return V(cmpgt_epi8)(VXOR(a, s), VXOR(b, s));
+}
+
+static inline vec_t v_gtu16(const vec_t a, const vec_t b)
+{
+  const vec_t s = V(set1_epi16)((short)0x8000);
+  return V(cmpgt_epi16)(VXOR(a, s), VXOR(b, s));
+}
+
+static inline vec_t v_gtu32(const vec_t a, const vec_t b)
+{
+  const vec_t s = V(set1_epi32)((int)0x80000000);
+  return V(cmpgt_epi32)(VXOR(a, s), VXOR(b, s));
+}
+
+#if defined(__AVX2__)
+#define v_min8   _mm256_min_epi8
+#define v_max8   _mm256_max_epi8
+#define v_minu16 _mm256_min_epu16
+#define v_maxu16 _mm256_max_epu16
+#define v_min32  _mm256_min_epi32
+#define v_max32  _mm256_max_epi32
+#define v_minu32 _mm256_min_epu32
+#define v_maxu32 _mm256_max_epu32
+#define v_mul32  _mm256_mullo_epi32
+#else
+// SSE2 only has the unsigned byte and signed halfword min/max
+static inline vec_t v_min8(const vec_t a, const vec_t b)   { return VSELECT(_mm_cmpgt_epi8(a, b), b, a); }
+static inline vec_t v_max8(const vec_t a, const vec_t b)   { return VSELECT(_mm_cmpgt_epi8(a, b), a, b); }
+static inline vec_t v_minu16(const vec_t a, const vec_t b) { return _mm_sub_epi16(a, _mm_subs_epu16(a, b)); }
+static inline vec_t v_maxu16(const vec_t a, const vec_t b) { return _mm_add_epi16(b, _mm_subs_epu16(a, b)); }
+static inline vec_t v_min32(const vec_t a, const vec_t b)  { return VSELECT(_mm_cmpgt_epi32(a, b), b, a); }
+static inline vec_t v_max32(const vec_t a, const vec_t b)  { return VSELECT(_mm_cmpgt_epi32(a, b), a, b); }
+static inline vec_t v_minu32(const vec_t a, const vec_t b) { return VSELECT(v_gtu32(a, b), b, a); }
+static inline vec_t v_maxu32(const vec_t a, const vec_t b) { return VSELECT(v_gtu32(a, b), a, b); }
+
+// Low halves of the even and odd lane products, interleaved again
+static inline vec_t v_mul32(const vec_t a, const vec_t b)
+{
+  const vec_t even = _mm_mul_epu32(a, b);
+  const vec_t odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+  return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+			    _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+#endif
+#define v_minu8  V(min_epu8)
+#define v_maxu8  V(max_epu8)
+#define v_min16  V(min_epi16)
+#define v_max16  V(max_epi16)
+
+// No byte multiply on x86, the even and odd bytes go through halfwords
+static inline vec_t v_mul8(const vec_t a, const vec_t b)
+{
+  const vec_t even = V(mullo_epi16)(a, b);
+  const vec_t odd = V(mullo_epi16)(V(srli_epi16)(a, 8), V(srli_epi16)(b, 8));
+  return VOR(V(slli_epi16)(odd, 8), VAND(even, V(set1_epi16)(0xff)));
+}
+
+// Signed times unsigned: b read as unsigned adds a to the high half when negative
+static inline vec_t v_mulhsu16(const vec_t a, const vec_t b)
+{
+  return V(add_epi16)(V(mulhi_epi16)(a, b), VAND(V(srai_epi16)(b, 15), a));
+}
+
+// Saturating word arithmetic, which x86 only has for bytes and halfwords
+static inline vec_t v_addsu32(const vec_t a, const vec_t b)
+{
+  const vec_t r = V(add_epi32)(a, b);
+  return VOR(r, v_gtu32(a, r));
+}
+
+static inline vec_t v_subsu32(const vec_t a, const vec_t b)
+{
+  return VANDNOT(v_gtu32(b, a), V(sub_epi32)(a, b));
+}
+
+static inline vec_t v_sat32(const vec_t a, const vec_t r, const vec_t overflow)
+{
+  const vec_t sat = VXOR(V(srai_epi32)(a, 31), V(set1_epi32)(0x7fffffff));
+  return VSELECT(V(srai_epi32)(overflow, 31), sat, r);
+}
+
+static inline vec_t v_adds32(const vec_t a, const vec_t b)
+{
+  const vec_t r = V(add_epi32)(a, b);
+  return v_sat32(a, r, VAND(VXOR(a, r), VXOR(b, r)));
+}
+
+static inline vec_t v_subs32(const vec_t a, const vec_t b)
+{
+  const vec_t r = V(sub_epi32)(a, b);
+  return v_sat32(a, r, VAND(VXOR(a, b), VXOR(a, r)));
+}
+#endif // VECTOR_SIMD
+
+// Saturate a widened signed result to bits
+static inline int64_t clamp_s(const int64_t v, const unsigned bits)
+{
+  const int64_t max = (INT64_C(1) << (bits - 1)) - 1;
+  return v > max ? max : v < -max - 1 ? -max - 1 : v;
+}
+
+// Element-wise kernels: d = a op b over n bytes, n a multiple of
+// VECTOR_CHUNK. a is vs2, b is vs1 or a scalar splat across the group.
+// Each chunk is loaded before it is stored, so d may be a or b.
+typedef void (*vector_kernel_t)(uint8_t *d, const uint8_t *a, const uint8_t *b, const size_t n);
+
+#define SIMD_KERNEL(name, expr)						\
+  static void name(uint8_t *d, const uint8_t *pa, const uint8_t *pb, const size_t n) \
+  {									\
+    for(size_t i = 0; i < n; i += VECTOR_CHUNK) {			\
+      const vec_t a = VLOAD(pa + i), b = VLOAD(pb + i);			\
+      VSTORE(d + i, expr);						\
+    }									\
+  }
+
+// uT and sT are the unsigned and signed element types
+#define SCALAR_KERNEL(name, U, S, expr)					\
+  static void name(uint8_t *d, const uint8_t *pa, const uint8_t *pb, const size_t n) \
+  {									\
+    typedef U uT;							\
+    typedef S sT __attribute__((unused));				\
+    for(size_t i = 0; i < n; i += sizeof(uT)) {				\
+      uT a, b, r;							\
+      memcpy(&a, pa + i, sizeof(uT));					\
+      memcpy(&b, pb + i, sizeof(uT));					\
+      r = (uT)(expr);							\
+      memcpy(d + i, &r, sizeof(uT));					\
+    }									\
+  }
+
+#ifdef VECTOR_SIMD
+#define KERNEL(name, U, S, simd, scalar) SIMD_KERNEL(name, simd)
+#else
+#define KERNEL(name, U, S, simd, scalar) SCALAR_KERNEL(name, U, S, scalar)
+#endif
+
+// One kernel per SEW, indexed by vsew
+#define KERNEL_TABLE(name) static const vector_kernel_t name[3] = { name##8, name##16, name##32 };
+
+#define KERNELS(name, simd8, simd16, simd32, scalar)			\
+  KERNEL(name##8, uint8_t, int8_t, simd8, scalar)			\
+  KERNEL(name##16, uint16_t, int16_t, simd16, scalar)			\
+  KERNEL(name##32, uint32_t, int32_t, simd32, scalar)			\
+  KERNEL_TABLE(name)
+
+#define SCALAR_KERNELS(name, scalar)					\
+  SCALAR_KERNEL(name##8, uint8_t, int8_t, scalar)			\
+  SCALAR_KERNEL(name##16, uint16_t, int16_t, scalar)			\
+  SCALAR_KERNEL(name##32, uint32_t, int32_t, scalar)			\
+  KERNEL_TABLE(name)
+
+#define BITS		(8 * sizeof(uT))
+#define SMIN		((sT)((uT)1 << (BITS - 1)))
+#define LANE(cond)	((cond) ? (uT)~0u : 0) // compare results, all ones or zero
+
+KERNELS(k_add, V(add_epi8)(a, b), V(add_epi16)(a, b), V(add_epi32)(a, b), a + b)
+KERNELS(k_sub, V(sub_epi8)(a, b), V(sub_epi16)(a, b), V(sub_epi32)(a, b), a - b)
+KERNELS(k_rsub, V(sub_epi8)(b, a), V(sub_epi16)(b, a), V(sub_epi32)(b, a), b - a)
+KERNELS(k_and, VAND(a, b), VAND(a, b), VAND(a, b), a & b)
+KERNELS(k_or, VOR(a, b), VOR(a, b), VOR(a, b), a | b)
+KERNELS(k_xor, VXOR(a, b), VXOR(a, b), VXOR(a, b), a ^ b)
+KERNELS(k_minu, v_minu8(a, b), v_minu16(a, b), v_minu32(a, b), a < b ? a : b)
+KERNELS(k_min, v_min8(a, b), v_min16(a, b), v_min32(a, b), (sT)a < (sT)b ? a : b)
+KERNELS(k_maxu, v_maxu8(a, b), v_maxu16(a, b), v_maxu32(a, b), a > b ? a : b)
+KERNELS(k_max, v_max8(a, b), v_max16(a, b), v_max32(a, b), (sT)a > (sT)b ? a : b)
+KERNELS(k_mul, v_mul8(a, b), V(mullo_epi16)(a, b), v_mul32(a, b), (uint32_t)a * b)
+
+SCALAR_KERNEL(k_mulh8, uint8_t, int8_t, ((int64_t)(sT)a * (sT)b) >> BITS)
+KERNEL(k_mulh16, uint16_t, int16_t, V(mulhi_epi16)(a, b), ((int64_t)(sT)a * (sT)b) >> BITS)
+SCALAR_KERNEL(k_mulh32, uint32_t, int32_t, ((int64_t)(sT)a * (sT)b) >> BITS)
+KERNEL_TABLE(k_mulh)
+SCALAR_KERNEL(k_mulhu8, uint8_t, int8_t, ((uint64_t)a * b) >> BITS)
+KERNEL(k_mulhu16, uint16_t, int16_t, V(mulhi_epu16)(a, b), ((uint64_t)a * b) >> BITS)
+SCALAR_KERNEL(k_mulhu32, uint32_t, int32_t, ((uint64_t)a * b) >> BITS)
+KERNEL_TABLE(k_mulhu)
+SCALAR_KERNEL(k_mulhsu8, uint8_t, int8_t, ((int64_t)(sT)a * (int64_t)b) >> BITS)
+KERNEL(k_mulhsu16, uint16_t, int16_t, v_mulhsu16(a, b), ((int64_t)(sT)a * (int64_t)b) >> BITS)
+SCALAR_KERNEL(k_mulhsu32, uint32_t, int32_t, ((int64_t)(sT)a * (int64_t)b) >> BITS)
+KERNEL_TABLE(k_mulhsu)
+
+// No SIMD division on x86, these are the RV32M rules per element
+SCALAR_KERNELS(k_divu, b == 0 ? (uT)~0u : a / b)
+SCALAR_KERNELS(k_div, b == 0 ? (uT)~0u : ((sT)a == SMIN && (sT)b == -1) ? a : (uT)((sT)a / (sT)b))
+SCALAR_KERNELS(k_remu, b == 0 ? a : a % b)
+SCALAR_KERNELS(k_rem, b == 0 ? a : ((sT)a == SMIN && (sT)b == -1) ? 0 : (uT)((sT)a % (sT)b))
+
+KERNELS(k_seq, V(cmpeq_epi8)(a, b), V(cmpeq_epi16)(a, b), V(cmpeq_epi32)(a, b), LANE(a == b))
+KERNELS(k_sne, VANDNOT(V(cmpeq_epi8)(a, b), VONES), VANDNOT(V(cmpeq_epi16)(a, b), VONES),
+	VANDNOT(V(cmpeq_epi32)(a, b), VONES), LANE(a != b))
+KERNELS(k_sltu, v_gtu8(b, a), v_gtu16(b, a), v_gtu32(b, a), LANE(a < b))
+KERNELS(k_slt, V(cmpgt_epi8)(b, a), V(cmpgt_epi16)(b, a), V(cmpgt_epi32)(b, a), LANE((sT)a < (sT)b))
+KERNELS(k_sleu, VANDNOT(v_gtu8(a, b), VONES), VANDNOT(v_gtu16(a, b), VONES),
+	VANDNOT(v_gtu32(a, b), VONES), LANE(a <= b))
+KERNELS(k_sle, VANDNOT(V(cmpgt_epi8)(a, b), VONES), VANDNOT(V(cmpgt_epi16)(a, b), VONES),
+	VANDNOT(V(cmpgt_epi32)(a, b), VONES), LANE((sT)a <= (sT)b))
+KERNELS(k_sgtu, v_gtu8(a, b), v_gtu16(a, b), v_gtu32(a, b), LANE(a > b))
+KERNELS(k_sgt, V(cmpgt_epi8)(a, b), V(cmpgt_epi16)(a, b), V(cmpgt_epi32)(a, b), LANE((sT)a > (sT)b))
+
+KERNELS(k_saddu, V(adds_epu8)(a, b), V(adds_epu16)(a, b), v_addsu32(a, b),
+	(uT)(a + b) < a ? (uT)~0u : (uT)(a + b))
+KERNELS(k_sadd, V(adds_epi8)(a, b), V(adds_epi16)(a, b), v_adds32(a, b),
+	clamp_s((int64_t)(sT)a + (sT)b, BITS))
+KERNELS(k_ssubu, V(subs_epu8)(a, b), V(subs_epu16)(a, b), v_subsu32(a, b), a < b ? 0 : a - b)
+KERNELS(k_ssub, V(subs_epi8)(a, b), V(subs_epi16)(a, b), v_subs32(a, b),
+	clamp_s((int64_t)(sT)a - (sT)b, BITS))
+
+// Shifts by a vector of amounts have no x86 form below AVX2
+SCALAR_KERNELS(k_sll, a << (b & (BITS - 1)))
+SCALAR_KERNELS(k_srl, a >> (b & (BITS - 1)))
+SCALAR_KERNELS(k_sra, (sT)a >> (b & (BITS - 1)))
+
+// Shifts by a scalar take the amount c from element 0 of b. x86 has no
+// byte shifts, they are halfword shifts with the bits crossing in masked.
+#ifdef VECTOR_SIMD
+#define SHIFT_KERNEL(name, U, S, simd, scalar)				\
+  static void name(uint8_t *d, const uint8_t *pa, const uint8_t *pb, const size_t n) \
+  {									\
+    const int c = pb[0] & (8 * sizeof(U) - 1);				\
+    const __m128i cnt = _mm_cvtsi32_si128(c);				\
+    (void)c;								\
+    for(size_t i = 0; i < n; i += VECTOR_CHUNK) {			\
+      const vec_t a = VLOAD(pa + i);					\
+      VSTORE(d + i, simd);						\
+    }									\
+  }
+#else
+#define SHIFT_KERNEL(name, U, S, simd, scalar)				\
+  static void name(uint8_t *d, const uint8_t *pa, const uint8_t *pb, const size_t n) \
+  {									\
+    typedef U uT;							\
+    typedef S sT __attribute__((unused));				\
+    const int c = pb[0] & (BITS - 1);					\
+    for(size_t i = 0; i < n; i += sizeof(uT)) {				\
+      uT a, r;								\
+      memcpy(&a, pa + i, sizeof(uT));					\
+      r = (uT)(scalar);							\
+      memcpy(d + i, &r, sizeof(uT));					\
+    }									\
+  }
+#endif
+
+#define SRL8(a) VAND(V(srl_epi16)(a, cnt), V(set1_epi8)((char)(0xff >> c)))
+
+SHIFT_KERNEL(k_sllx8, uint8_t, int8_t, VAND(V(sll_epi16)(a, cnt), V(set1_epi8)((char)(0xff << c))), a << c)
+SHIFT_KERNEL(k_sllx16, uint16_t, int16_t, V(sll_epi16)(a, cnt), a << c)
+SHIFT_KERNEL(k_sllx32, uint32_t, int32_t, V(sll_epi32)(a, cnt), a << c)
+KERNEL_TABLE(k_sllx)
+SHIFT_KERNEL(k_srlx8, uint8_t, int8_t, SRL8(a), a >> c)
+SHIFT_KERNEL(k_srlx16, uint16_t, int16_t, V(srl_epi16)(a, cnt), a >> c)
+SHIFT_KERNEL(k_srlx32, uint32_t, int32_t, V(srl_epi32)(a, cnt), a >> c)
+KERNEL_TABLE(k_srlx)
+// Arithmetic byte shift: logical, then sign extend from the shifted sign bit
+SHIFT_KERNEL(k_srax8, uint8_t, int8_t,
+	     V(sub_epi8)(VXOR(SRL8(a), V(set1_epi8)((char)(0x80 >> c))), V(set1_epi8)((char)(0x80 >> c))),
+	     (sT)a >> c)
+SHIFT_KERNEL(k_srax16, uint16_t, int16_t, V(sra_epi16)(a, cnt), (sT)a >> c)
+SHIFT_KERNEL(k_srax32, uint32_t, int32_t, V(sra_epi32)(a, cnt), (sT)a >> c)
+KERNEL_TABLE(k_srax)
+
+#undef SRL8
+#undef LANE
+#undef SMIN
+#undef BITS
+
+// What an OP-V funct6 does with its kernels
+typedef enum _vector_kind_t {
+  VK_NONE = 0,
+  VK_BINARY,  // vd = k(vs2, vs1/x/imm)
+  VK_SHIFT,   // as BINARY, kx for the scalar shift amounts
+  VK_COMPARE, // k gives all ones lanes, packed into mask bits
+  VK_SAT,     // k saturates, kx wraps around: they differ where vxsat gets set
+  VK_MULADD,  // vd = k(acc, vs1/x * src), see vector_muladd
+  VK_MERGE,   // vmerge, and vmv.v when unmasked
+  VK_MVR,     // vmv<nr>r.v
+  VK_REDUCE,  // vd[0] = k over vs1[0] and the active elements of vs2
+  VK_MASK,    // mask register logicals
+  VK_VID,
+  VK_MV_S_X
+} vector_kind_t;
+
+typedef struct _vector_op_t {
+  vector_kind_t kind;
+  const vector_kernel_t *k;
+  const vector_kernel_t *kx;
+} vector_op_t;
+
+// OPIVV/OPIVX/OPIVI by funct6
+static const vector_op_t opi[64] = {
+  [0b000000] = { VK_BINARY, k_add, NULL },
+  [0b000010] = { VK_BINARY, k_sub, NULL },
+  [0b000011] = { VK_BINARY, k_rsub, NULL },
+  [0b000100] = { VK_BINARY, k_minu, NULL },
+  [0b000101] = { VK_BINARY, k_min, NULL },
+  [0b000110] = { VK_BINARY, k_maxu, NULL },
+  [0b000111] = { VK_BINARY, k_max, NULL },
+  [0b001001] = { VK_BINARY, k_and, NULL },
+  [0b001010] = { VK_BINARY, k_or, NULL },
+  [0b001011] = { VK_BINARY, k_xor, NULL },
+  [0b010111] = { VK_MERGE, NULL, NULL },
+  [0b011000] = { VK_COMPARE, k_seq, NULL },
+  [0b011001] = { VK_COMPARE, k_sne, NULL },
+  [0b011010] = { VK_COMPARE, k_sltu, NULL },
+  [0b011011] = { VK_COMPARE, k_slt, NULL },
+  [0b011100] = { VK_COMPARE, k_sleu, NULL },
+  [0b011101] = { VK_COMPARE, k_sle, NULL },
+  [0b011110] = { VK_COMPARE, k_sgtu, NULL },
+  [0b011111] = { VK_COMPARE, k_sgt, NULL },
+  [0b100000] = { VK_SAT, k_saddu, k_add },
+  [0b100001] = { VK_SAT, k_sadd, k_add },
+  [0b100010] = { VK_SAT, k_ssubu, k_sub },
+  [0b100011] = { VK_SAT, k_ssub, k_sub },
+  [0b100101] = { VK_SHIFT, k_sll, k_sllx },
+  [0b100111] = { VK_MVR, NULL, NULL },
+  [0b101000] = { VK_SHIFT, k_srl, k_srlx },
+  [0b101001] = { VK_SHIFT, k_sra, k_srax },
+};
+
+// OPMVV/OPMVX by funct6
+static const vector_op_t opm[64] = {
+  [0b000000] = { VK_REDUCE, k_add, NULL },
+  [0b000001] = { VK_REDUCE, k_and, NULL },
+  [0b000010] = { VK_REDUCE, k_or, NULL },
+  [0b000011] = { VK_REDUCE, k_xor, NULL },
+  [0b000100] = { VK_REDUCE, k_minu, NULL },
+  [0b000101] = { VK_REDUCE, k_min, NULL },
+  [0b000110] = { VK_REDUCE, k_maxu, NULL },
+  [0b000111] = { VK_REDUCE, k_max, NULL },
+  [0b010000] = { VK_MV_S_X, NULL, NULL }, // OPMVX only, vmv.x.s is vector_to_x
+  [0b010100] = { VK_VID, NULL, NULL },
+  [0b011000] = { VK_MASK, NULL, NULL },
+  [0b011001] = { VK_MASK, NULL, NULL },
+  [0b011010] = { VK_MASK, NULL, NULL },
+  [0b011011] = { VK_MASK, NULL, NULL },
+  [0b011100] = { VK_MASK, NULL, NULL },
+  [0b011101] = { VK_MASK, NULL, NULL },
+  [0b011110] = { VK_MASK, NULL, NULL },
+  [0b011111] = { VK_MASK, NULL, NULL },
+  [0b100000] = { VK_BINARY, k_divu, NULL },
+  [0b100001] = { VK_BINARY, k_div, NULL },
+  [0b100010] = { VK_BINARY, k_remu, NULL },
+  [0b100011] = { VK_BINARY, k_rem, NULL },
+  [0b100100] = { VK_BINARY, k_mulhu, NULL },
+  [0b100101] = { VK_BINARY, k_mul, NULL },
+  [0b100110] = { VK_BINARY, k_mulhsu, NULL },
+  [0b100111] = { VK_BINARY, k_mulh, NULL },
+  [0b101001] = { VK_MULADD, k_add, NULL },
+  [0b101011] = { VK_MULADD, k_sub, NULL },
+  [0b101101] = { VK_MULADD, k_add, NULL },
+  [0b101111] = { VK_MULADD, k_sub, NULL },
+};
+
+#define OPIVV 0
+#define OPMVV 2
+#define OPIVI 3
+#define OPIVX 4
+#define OPMVX 6
+
+#define VREG(r)		(core->vregisters[r])
+#define INSTR_VM(d)	(((d)->instruction >> 25) & 1) // 1 is unmasked
+
+// vtype and vl as the instruction sees them
+typedef struct _vconfig_t {
+  uint32_t sew;  // log2 of the element size in bytes
+  int      lmul; // log2, negative when fractional
+  uint32_t regs; // registers per group, 1 when fractional
+  uint32_t len;  // vl
+} vconfig_t;
+
+static bool vector_config(const core_t *core, vconfig_t *c)
+{
+  const uint32_t vt = core->csr.state[vtype];
+  if(vt & VTYPE_VILL) {
+    return false;
+  }
+  c->sew = (vt >> VTYPE_VSEW_SHIFT) & 7;
+  c->lmul = (int)(vt & VTYPE_VLMUL) - ((vt & 4) ? 8 : 0);
+  c->regs = c->lmul > 0 ? 1u << c->lmul : 1;
+  c->len = core->csr.state[vl];
+  return true;
+}
+
+// VLMAX of vtype, 0 for settings this implementation does not support
+static uint32_t vector_vlmax(const uint32_t vt)
+{
+  const uint32_t sew = (vt >> VTYPE_VSEW_SHIFT) & 7, lmul = vt & VTYPE_VLMUL;
+  if((vt >> 8) != 0 || sew > 2 || lmul == 4) {
+    return 0;
+  }
+  if(lmul > 4) {
+    // Fractional, SEW/LMUL may not exceed ELEN = 32
+    const uint32_t shift = 8 - lmul;
+    return sew + shift > 2 ? 0 : (VLENB >> sew) >> shift;
+  }
+  return (VLENB << lmul) >> sew;
+}
+
+static inline bool mask_bit(const uint8_t *m, const uint32_t i)
+{
+  return (m[i >> 3] >> (i & 7)) & 1;
+}
+
+// One byte per element of the first len bits of v0, spread to all ones or
+// zero and widened to SEW over n bytes. Bytes past len are zero.
+static void mask_bytes(uint8_t *m, const uint8_t *v0, const uint32_t sew, const uint32_t len, const size_t n)
+{
+  uint8_t e[VGROUP_MAX];
+  for(uint32_t i = 0; i < len; i += 8) {
+    // Bit k to byte k, then any set bit in a byte to all ones, as orc.b does
+    uint64_t x = (v0[i >> 3] * UINT64_C(0x0101010101010101)) & UINT64_C(0x8040201008040201);
+    x = (((x + UINT64_C(0x7f7f7f7f7f7f7f7f)) | x) & UINT64_C(0x8080808080808080)) >> 7;
+    x *= 0xff;
+    memcpy(e + i, &x, sizeof(x));
+  }
+  memset(m, 0, n);
+  if(sew == 0) {
+    memcpy(m, e, len);
+    return;
+  }
+  for(uint32_t i = 0; i < len; i++) {
+    const uint32_t w = (uint32_t)(int32_t)(int8_t)e[i];
+    memcpy(m + ((size_t)i << sew), &w, 1u << sew);
+  }
+}
+
+// d = m ? s : d over n bytes
+static void blend(uint8_t *d, const uint8_t *s, const uint8_t *m, const size_t n)
+{
+#ifdef VECTOR_SIMD
+  for(size_t i = 0; i < n; i += VECTOR_CHUNK) {
+    VSTORE(d + i, VSELECT(VLOAD(m + i), VLOAD(s + i), VLOAD(d + i)));
+  }
+#else
+  for(size_t i = 0; i < n; i += sizeof(uint64_t)) {
+    uint64_t x, y, z;
+    memcpy(&x, d + i, sizeof(x));
+    memcpy(&y, s + i, sizeof(y));
+    memcpy(&z, m + i, sizeof(z));
+    x = (y & z) | (x & ~z);
+    memcpy(d + i, &x, sizeof(x));
+  }
+#endif
+}
+
+// Write the first used bytes of src to vd, only the active elements when m
+static void commit(uint8_t *vd, const uint8_t *src, const uint8_t *m, const size_t used, const size_t n)
+{
+  if(m == NULL) {
+    memcpy(vd, src, used);
+  } else {
+    blend(vd, src, m, n);
+  }
+}
+
+#ifdef VECTOR_SIMD
+// Every other bit of x, packed
+static inline uint32_t even_bits(uint32_t x)
+{
+  x &= 0x55555555;
+  x = (x | (x >> 1)) & 0x33333333;
+  x = (x | (x >> 2)) & 0x0f0f0f0f;
+  x = (x | (x >> 4)) & 0x00ff00ff;
+  return (x | (x >> 8)) & 0x0000ffff;
+}
+#endif
+
+// Pack all ones/zero lanes of SEW into one bit per element
+static void lanes_to_bits(uint8_t *bits, const uint8_t *lanes, const uint32_t sew, const size_t n)
+{
+  uint64_t w[VLENB / sizeof(uint64_t)] = { 0 };
+#ifdef VECTOR_SIMD
+  for(size_t i = 0; i < n; i += VECTOR_CHUNK) {
+    uint32_t b = (uint32_t)V(movemask_epi8)(VLOAD(lanes + i));
+    for(uint32_t s = 0; s < sew; s++) {
+      b = even_bits(b);
+    }
+    const size_t e = i >> sew;
+    w[e / 64] |= (uint64_t)b << (e % 64);
+  }
+#else
+  for(size_t e = 0; e < (n >> sew); e++) {
+    w[e / 64] |= (uint64_t)(lanes[e << sew] & 1) << (e % 64);
+  }
+#endif
+  memcpy(bits, w, sizeof(w));
+}
+
+// Store the first len bits of bits to mask register vd, gated by v0 when
+// masked. Tail bits are left alone.
+static void mask_commit(core_t *core, const uint32_t vd, const uint8_t *bits, const bool vm, const uint32_t len)
+{
+  for(uint32_t k = 0; k * 64 < len; k++) {
+    uint64_t old, src, v0;
+    memcpy(&old, VREG(vd) + k * 8, sizeof(old));
+    memcpy(&src, bits + k * 8, sizeof(src));
+    memcpy(&v0, VREG(0) + k * 8, sizeof(v0));
+    uint64_t sel = len - k * 64 >= 64 ? ~UINT64_C(0) : (UINT64_C(1) << (len - k * 64)) - 1;
+    if(!vm) {
+      sel &= v0;
+    }
+    old = (src & sel) | (old & ~sel);
+    memcpy(VREG(vd) + k * 8, &old, sizeof(old));
+  }
+}
+
+// Element i of vd or vs2 as an unsigned value
+static inline uint32_t element(const uint8_t *r, const uint32_t sew, const uint32_t i)
+{
+  uint32_t v = 0;
+  memcpy(&v, r + ((size_t)i << sew), 1u << sew);
+  return v;
+}
+
+static void splat(uint8_t *d, const uint32_t sew, const uint32_t v, const size_t n)
+{
+  for(size_t i = 0; i < n; i += 1u << sew) {
+    memcpy(d + i, &v, 1u << sew);
+  }
+}
+
+// Reductions fold the group in halves with the kernel itself. The group is
+// padded to a power of two with the identity of the operation, and the last
+// chunk is halved against an identity chunk so that kernels can keep
+// working on whole host vectors.
+static uint32_t reduce_identity(const uint32_t funct6, const uint32_t sew)
+{
+  const uint32_t smin = 1u << ((8u << sew) - 1);
+  switch(funct6 & 7) {
+  case 0b001: case 0b100: return ~0u;     // and, minu
+  case 0b101:             return smin - 1; // min
+  case 0b111:             return smin;     // max
+  default:                return 0;        // sum, or, xor, maxu
+  }
+}
+
+static void vector_reduce(core_t *core, const dinstr_t *d, const vconfig_t *c,
+			  const vector_kernel_t k, const uint8_t *m, const size_t n)
+{
+  uint8_t buf[VGROUP_MAX], id[VECTOR_CHUNK];
+  const uint32_t ident = reduce_identity(d->instruction >> 26, c->sew);
+  size_t len = VECTOR_CHUNK;
+  while(len < n) {
+    len <<= 1;
+  }
+  splat(buf, c->sew, ident, len);
+  splat(id, c->sew, ident, VECTOR_CHUNK);
+  if(m == NULL) {
+    memcpy(buf, VREG(d->rs2), (size_t)c->len << c->sew);
+  } else {
+    blend(buf, VREG(d->rs2), m, n);
+  }
+
+  for(; len > VECTOR_CHUNK; len >>= 1) {
+    k(buf, buf, buf + len / 2, len / 2);
+  }
+  for(size_t h = VECTOR_CHUNK / 2; h >= (1u << c->sew); h >>= 1) {
+    uint8_t b[VECTOR_CHUNK];
+    memcpy(b, id, VECTOR_CHUNK);
+    memcpy(b, buf + h, h);
+    k(buf, buf, b, VECTOR_CHUNK);
+  }
+  memcpy(id, VREG(d->rs1), 1u << c->sew);
+  k(buf, buf, id, VECTOR_CHUNK);
+  memcpy(VREG(d->rd), buf, 1u << c->sew);
+}
+
+// vmadd/vnmsub multiply vd and add to vs2, vmacc/vnmsac the other way
+// around. Bit 2 of funct6 tells them apart.
+static void vector_muladd(core_t *core, const dinstr_t *d, const vconfig_t *c, const vector_kernel_t k,
+			  const uint8_t *b, uint8_t *tmp, const size_t n)
+{
+  const bool acc_vd = (d->instruction >> 28) & 1;
+  const uint8_t *acc = acc_vd ? VREG(d->rd) : VREG(d->rs2);
+  const uint8_t *src = acc_vd ? VREG(d->rs2) : VREG(d->rd);
+  k_mul[c->sew](tmp, src, b, n);
+  k(tmp, acc, tmp, n);
+}
+
+// Mask register logicals, funct6 011000 to 011111
+static void vector_mask_op(core_t *core, const dinstr_t *d, const uint32_t len)
+{
+  uint64_t r[VLENB / sizeof(uint64_t)];
+  for(size_t k = 0; k < VLENB / sizeof(uint64_t); k++) {
+    uint64_t a, b;
+    memcpy(&a, VREG(d->rs2) + k * 8, sizeof(a));
+    memcpy(&b, VREG(d->rs1) + k * 8, sizeof(b));
+    switch((d->instruction >> 26) & 7) {
+    case 0b000: r[k] = a & ~b;    break; // vmandn
+    case 0b001: r[k] = a & b;     break; // vmand
+    case 0b010: r[k] = a | b;     break; // vmor
+    case 0b011: r[k] = a ^ b;     break; // vmxor
+    case 0b100: r[k] = a | ~b;    break; // vmorn
+    case 0b101: r[k] = ~(a & b);  break; // vmnand
+    case 0b110: r[k] = ~(a | b);  break; // vmnor
+    default:    r[k] = ~(a ^ b);  break; // vmxnor
+    }
+  }
+  mask_commit(core, d->rd, (const uint8_t *)r, true, len);
+}
+
+// vmv1r.v to vmv8r.v copy whole registers whatever vtype is
+static bool vector_move_regs(core_t *core, const dinstr_t *d)
+{
+  const uint32_t nr = (d->imm & 7) + 1;
+  if((nr & (nr - 1)) != 0 || (d->rd & (nr - 1)) != 0 || (d->rs2 & (nr - 1)) != 0 || !INSTR_VM(d) ||
+     core->csr.state[vstart] != 0) {
+    return false;
+  }
+  memmove(VREG(d->rd), VREG(d->rs2), (size_t)nr * VLENB);
+  return true;
+}
+
+static inline bool aligned(const uint32_t r, const uint32_t regs)
+{
+  return (r & (regs - 1)) == 0;
+}
+
+// OP-V other than vsetvl* and vmv.x.s/vcpop/vfirst. x is the scalar
+// operand of the .vx forms. Returns false on an illegal instruction, with
+// the trap raised.
+bool vector_arith(core_t *core, const dinstr_t *d, const uint32_t x)
+{
+  const uint32_t funct3 = (d->instruction >> 12) & 7, funct6 = d->instruction >> 26;
+  const bool vm = INSTR_VM(d);
+  const vector_op_t *o = funct3 == OPMVV || funct3 == OPMVX ? &opm[funct6] : &opi[funct6];
+  vconfig_t c;
+
+  if(o->kind == VK_MVR) {
+    if(!vector_move_regs(core, d)) {
+      cause_trap(core, ILLEGAL_INSTRUCTION);
+      return false;
+    }
+    return true;
+  }
+  if(o->kind == VK_NONE || !vector_config(core, &c) || core->csr.state[vstart] != 0) {
+    cause_trap(core, ILLEGAL_INSTRUCTION);
+    return false;
+  }
+
+  // Register group alignment, and v0 may not be both mask and destination
+  const bool mask_dst = o->kind == VK_COMPARE || o->kind == VK_MASK;
+  const bool scalar_dst = o->kind == VK_REDUCE || o->kind == VK_MV_S_X;
+  bool ok = aligned(d->rs2, c.regs) || o->kind == VK_MASK;
+  ok &= mask_dst || scalar_dst || aligned(d->rd, c.regs);
+  ok &= (funct3 != OPIVV && funct3 != OPMVV) || o->kind == VK_MASK || o->kind == VK_REDUCE ||
+    o->kind == VK_VID || aligned(d->rs1, c.regs);
+  ok &= vm || mask_dst || scalar_dst || d->rd != 0 || o->kind == VK_MERGE;
+  switch(o->kind) {
+  case VK_MERGE:   ok &= vm ? d->rs2 == 0 : d->rd != 0; break;
+  case VK_MASK:    ok &= vm;                            break;
+  case VK_MV_S_X:  ok &= vm && d->rs2 == 0;             break;
+  case VK_VID:     ok &= d->rs1 == 0b10001 && d->rs2 == 0; break;
+  case VK_REDUCE:  ok &= funct3 == OPMVV;               break;
+  default:                                              break;
+  }
+  if(!ok) {
+    cause_trap(core, ILLEGAL_INSTRUCTION);
+    return false;
+  }
+  if(c.len == 0) {
+    return true;
+  }
+
+  if(o->kind == VK_MASK) {
+    vector_mask_op(core, d, c.len);
+    return true;
+  }
+  if(o->kind == VK_MV_S_X) {
+    memcpy(VREG(d->rd), &x, 1u << c.sew);
+    return true;
+  }
+
+  const size_t used = (size_t)c.len << c.sew;
+  const size_t n = (used + VECTOR_CHUNK - 1) & ~(size_t)(VECTOR_CHUNK - 1);
+  uint8_t splat_buf[VGROUP_MAX], tmp[VGROUP_MAX], m_buf[VGROUP_MAX];
+  const uint8_t *m = NULL;
+  if(!vm) {
+    mask_bytes(m_buf, VREG(0), c.sew, c.len, n);
+    m = m_buf;
+  }
+
+  const uint8_t *b = VREG(d->rs1);
+  if(funct3 == OPIVX || funct3 == OPMVX) {
+    splat(splat_buf, c.sew, x, n);
+    b = splat_buf;
+  } else if(funct3 == OPIVI) {
+    splat(splat_buf, c.sew, (uint32_t)d->imm, n);
+    b = splat_buf;
+  }
+  uint8_t *vd = VREG(d->rd);
+  const uint8_t *a = VREG(d->rs2);
+
+  switch(o->kind) {
+  case VK_BINARY:
+  case VK_SHIFT: {
+    const vector_kernel_t k = o->kind == VK_SHIFT && funct3 != OPIVV ? o->kx[c.sew] : o->k[c.sew];
+    if(m == NULL && used == n) {
+      k(vd, a, b, n);
+    } else {
+      k(tmp, a, b, n);
+      commit(vd, tmp, m, used, n);
+    }
+    break;
+  }
+
+  case VK_SAT: {
+    uint8_t wrapped[VGROUP_MAX];
+    o->k[c.sew](tmp, a, b, n);
+    o->kx[c.sew](wrapped, a, b, n);
+    bool sat = false;
+    for(size_t i = 0; i < used && !sat; i++) {
+      sat = ((tmp[i] ^ wrapped[i]) & (m ? m[i] : 0xff)) != 0;
+    }
+    if(sat) {
+      core->csr.state[vcsr] |= 1;
+    }
+    commit(vd, tmp, m, used, n);
+    break;
+  }
+
+  case VK_MULADD:
+    vector_muladd(core, d, &c, o->k[c.sew], b, tmp, n);
+    commit(vd, tmp, m, used, n);
+    break;
+
+  case VK_MERGE:
+    if(vm) {
+      memmove(vd, b, used);
+    } else {
+      memcpy(tmp, a, n);
+      blend(tmp, b, m, n);
+      memcpy(vd, tmp, used);
+    }
+    break;
+
+  case VK_COMPARE: {
+    uint8_t bits[VLENB];
+    o->k[c.sew](tmp, a, b, n);
+    lanes_to_bits(bits, tmp, c.sew, n);
+    mask_commit(core, d->rd, bits, vm, c.len);
+    break;
+  }
+
+  case VK_REDUCE:
+    vector_reduce(core, d, &c, o->k[c.sew], m, n);
+    break;
+
+  case VK_VID:
+    for(uint32_t i = 0; i < c.len; i++) {
+      memcpy(tmp + ((size_t)i << c.sew), &i, 1u << c.sew);
+    }
+    commit(vd, tmp, m, used, n);
+    break;
+
+  default:
+    break;
+  }
+  return true;
+}
+
+// vmv.x.s, vcpop.m and vfirst.m, by rs1
+bool vector_to_x(core_t *core, const dinstr_t *d, uint32_t *out)
+{
+  vconfig_t c;
+  if(!vector_config(core, &c) || core->csr.state[vstart] != 0) {
+    cause_trap(core, ILLEGAL_INSTRUCTION);
+    return false;
+  }
+  const uint8_t *vs2 = VREG(d->rs2);
+  switch(d->rs1) {
+  case 0b00000:
+    if(INSTR_VM(d)) {
+      const uint32_t v = element(vs2, c.sew, 0);
+      const uint32_t shift = 32 - (8u << c.sew);
+      *out = (uint32_t)((int32_t)(v << shift) >> shift);
+      return true;
+    }
+    break;
+
+  case 0b10000:
+  case 0b10001: {
+    uint32_t count = 0;
+    int32_t first = -1;
+    for(uint32_t k = 0; k * 64 < c.len; k++) {
+      uint64_t w, v0;
+      memcpy(&w, vs2 + k * 8, sizeof(w));
+      memcpy(&v0, VREG(0) + k * 8, sizeof(v0));
+      if(c.len - k * 64 < 64) {
+	w &= (UINT64_C(1) << (c.len - k * 64)) - 1;
+      }
+      if(!INSTR_VM(d)) {
+	w &= v0;
+      }
+      count += (uint32_t)__builtin_popcountll(w);
+      if(first < 0 && w != 0) {
+	first = (int32_t)(k * 64 + (uint32_t)__builtin_ctzll(w));
+      }
+    }
+    *out = d->rs1 == 0b10000 ? count : (uint32_t)first;
+    return true;
+  }
+  }
+  cause_trap(core, ILLEGAL_INSTRUCTION);
+  return false;
+}
+
+// vsetvli, vsetivli and vsetvl. Returns the new vl.
+uint32_t vector_setvl(core_t *core, const dinstr_t *d, const uint32_t rs1v, const uint32_t rs2v)
+{
+  const uint32_t vt = d->op == OP_VSETVL ? rs2v : (uint32_t)d->imm;
+  const uint32_t max = vector_vlmax(vt);
+  uint32_t avl;
+  if(d->op == OP_VSETIVLI) {
+    avl = d->rs1;
+  } else if(d->rs1 != 0) {
+    avl = rs1v;
+  } else if(d->rd != 0) {
+    avl = ~0u;
+  } else {
+    avl = core->csr.state[vl];
+  }
+
+  const uint32_t len = max == 0 ? 0 : (avl < max ? avl : max);
+  core->csr.state[vtype] = max == 0 ? VTYPE_VILL : vt;
+  core->csr.state[vl] = len;
+  core->csr.state[vstart] = 0;
+  return len;
+}
+
+// Vector loads and stores. Unit-stride (and strided with a stride of the
+// element size) go to the bus as one transfer, anything else, or a
+// transfer that faults, element by element so that vstart is exact.
+static bool vector_memory(core_t *core, const dinstr_t *d, const uint32_t base, const uint32_t stride, const bool store)
+{
+  static const memory_access_width_t widths[] = { BYTE, HALFWORD, WORD };
+  const uint32_t i = d->instruction;
+  const uint32_t width = (i >> 12) & 7, mop = (i >> 26) & 3, lumop = d->rs2, nf = i >> 29;
+  const bool vm = INSTR_VM(d);
+  const bool whole = mop == 0 && lumop == 0b01000, mask = mop == 0 && lumop == 0b01011;
+  const uint32_t vr = d->rd; // vd, or vs3 for stores
+  uint32_t eew = width == 0 ? 0 : width - 4;
+  uint32_t regs, evl;
+  vconfig_t c = { 0 }; // read below even when vtype is illegal, ok is false then
+
+  bool ok = width != 7;
+  if(whole) {
+    regs = nf + 1;
+    ok &= vm && (regs & (regs - 1)) == 0 && aligned(vr, regs) && (!store || width == 0);
+    evl = (regs * VLENB) >> eew;
+  } else {
+    ok &= vector_config(core, &c) && nf == 0;
+    if(mask) {
+      ok &= vm && width == 0;
+      regs = 1;
+      evl = (c.len + 7) / 8;
+    } else {
+      const int emul = c.lmul + (int)eew - (int)c.sew;
+      ok &= emul >= -3 && emul <= 3;
+      regs = emul > 0 ? 1u << emul : 1;
+      ok &= aligned(vr, regs) && (vm || vr != 0 || store);
+      evl = c.len;
+    }
+  }
+  if(!ok) {
+    cause_trap(core, ILLEGAL_INSTRUCTION);
+    return false;
+  }
+
+  uint8_t *r = VREG(vr);
+  uint32_t start = core->csr.state[vstart];
+  const size_t size = 1u << eew;
+  uint8_t m[VGROUP_MAX];
+  if(!vm) {
+    mask_bytes(m, VREG(0), eew, evl, (((size_t)evl << eew) + VECTOR_CHUNK - 1) & ~(size_t)(VECTOR_CHUNK - 1));
+  }
+
+  // Unit stride in one go on physical addresses, element by element otherwise
+  if(start < evl && (mop == 0 || stride == size) && !core->tlb->data) {
+    const size_t offs = (size_t)start << eew, bytes = ((size_t)evl << eew) - offs;
+    if(store && vm) {
+      if(bus_write_multiple(core->bus, base + offs, r + offs, bytes, BYTE) == bytes) {
+	start = evl;
+      }
+    } else if(!store) {
+      uint8_t buf[VGROUP_MAX];
+      if(bus_read_multiple(core->bus, base + offs, buf, bytes, BYTE) == bytes) {
+	if(vm) {
+	  memcpy(r + offs, buf, bytes);
+	} else {
+	  for(size_t k = 0; k < bytes; k++) {
+	    r[offs + k] = (buf[k] & m[offs + k]) | (r[offs + k] & ~m[offs + k]);
+	  }
+	}
+	start = evl;
+      }
+    }
+  }
+
+  for(; start < evl; start++) {
+    if(!vm && !mask_bit(VREG(0), start)) {
+      continue;
+    }
+    const vaddr_t addr = base + start * (mop == 0 ? size : stride);
+    uint32_t v = 0;
+    bool done;
+    if(store) {
+      memcpy(&v, r + ((size_t)start << eew), size);
+      done = core_store(core, addr, v, widths[eew]);
+    } else {
+      done = core_load(core, addr, widths[eew], &v);
+      if(done) {
+	memcpy(r + ((size_t)start << eew), &v, size);
+      }
+    }
+    if(!done) {
+      core->csr.state[vstart] = start;
+      return false;
+    }
+  }
+  core->csr.state[vstart] = 0;
+  return true;
+}
+
+bool vector_load(core_t *core, const dinstr_t *d, const uint32_t base, const uint32_t stride)
+{
+  return vector_memory(core, d, base, stride, false);
+}
+
+bool vector_store(core_t *core, const dinstr_t *d, const uint32_t base, const uint32_t stride)
+{
+  return vector_memory(core, d, base, stride, true);
+}
+
+// vxsat and vxrm are views of vcsr, as fflags and frm are of fcsr
+uint32_t vector_csr_read(csr_t *csr, const uint32_t addr)
+{
+  const uint32_t v = csr->state[vcsr] & 7;
+  switch(addr) {
+  case vxsat: return v & 1;
+  case vxrm:  return v >> 1;
+  default:    return v;
+  }
+}
+
+void vector_csr_write(csr_t *csr, const uint32_t addr, const uint32_t value)
+{
+  uint64_t *v = &csr->state[vcsr];
+  switch(addr) {
+  case vxsat: *v = (*v & 6) | (value & 1);        break;
+  case vxrm:  *v = (*v & 1) | ((value & 3) << 1); break;
+  default:    *v = value & 7;                     break;
+  }
+}
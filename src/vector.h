@@ -0,0 +1,58 @@
+/**
+Copyright 2022 orIgo <mrorigo@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef __VECTOR_H__
+#define __VECTOR_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "config.h"
+#include "csr.h"
+
+// Zve32x on host SIMD. A V register is VLENB bytes in core_t with its
+// elements in memory order, so a register group is one contiguous byte
+// array and unit-stride loads and stores are a single bus transfer. The
+// arithmetic runs over whole groups one host vector (SSE2, or AVX2 when
+// the build targets it) at a time; inactive and tail elements are blended
+// back afterwards. vl, vtype and vstart live in the CSR file, as fcsr does.
+
+#define VLENB		(VECTOR_VLEN/8)
+#define VGROUP_MAX	(8*VLENB) // bytes in a register group at LMUL=8
+
+// vtype
+#define VTYPE_VLMUL	0x07
+#define VTYPE_VSEW_SHIFT 3
+#define VTYPE_VTA	0x40
+#define VTYPE_VMA	0x80
+#define VTYPE_VILL	0x80000000u
+
+struct _core_t;
+struct _dinstr_t;
+
+uint32_t vector_setvl(struct _core_t *, const struct _dinstr_t *, const uint32_t rs1v, const uint32_t rs2v);
+bool	 vector_arith(struct _core_t *, const struct _dinstr_t *, const uint32_t x);
+bool	 vector_to_x(struct _core_t *, const struct _dinstr_t *, uint32_t *);
+bool	 vector_load(struct _core_t *, const struct _dinstr_t *, const uint32_t base, const uint32_t stride);
+bool	 vector_store(struct _core_t *, const struct _dinstr_t *, const uint32_t base, const uint32_t stride);
+
+uint32_t vector_csr_read(csr_t *, const uint32_t addr);
+void	 vector_csr_write(csr_t *, const uint32_t addr, const uint32_t value);
+
+#endif